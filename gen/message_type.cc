@@ -0,0 +1,42 @@
+// AUTOMATICALLY GENERATED CODE - DO NOT EDIT.
+
+#include "message_type.h"
+
+#include <map>
+
+using namespace std;
+
+string toString(MessageType value) {
+  switch (value) {
+    case IDENTIFY:             return "IDENTIFY";
+    case SEND_MESSAGE:         return "SEND_MESSAGE";
+    case RECEIVE_MESSAGE:      return "RECEIVE_MESSAGE";
+    case REQUEST_HISTORY:      return "REQUEST_HISTORY";
+    case RECEIVE_HISTORY:      return "RECEIVE_HISTORY";
+    case RELAY_MESSAGE:        return "RELAY_MESSAGE";
+    case SEARCH_HISTORY:       return "SEARCH_HISTORY";
+    case SEARCH_RESULTS:       return "SEARCH_RESULTS";
+    case HEARTBEAT:            return "HEARTBEAT";
+    case RECEIVE_HISTORY_PART: return "RECEIVE_HISTORY_PART";
+    default: return "<INVALID>";
+  }
+}
+
+bool fromString(const string& value, MessageType* output) {
+  static const map<string, MessageType> lookup = {
+    {"IDENTIFY",             IDENTIFY},
+    {"SEND_MESSAGE",         SEND_MESSAGE},
+    {"RECEIVE_MESSAGE",      RECEIVE_MESSAGE},
+    {"REQUEST_HISTORY",      REQUEST_HISTORY},
+    {"RECEIVE_HISTORY",      RECEIVE_HISTORY},
+    {"RELAY_MESSAGE",        RELAY_MESSAGE},
+    {"SEARCH_HISTORY",       SEARCH_HISTORY},
+    {"SEARCH_RESULTS",       SEARCH_RESULTS},
+    {"HEARTBEAT",            HEARTBEAT},
+    {"RECEIVE_HISTORY_PART", RECEIVE_HISTORY_PART},
+  };
+  auto i = lookup.find(value);
+  if (i == lookup.end()) return false;
+  *output = i->second;
+  return true;
+}
@@ -0,0 +1,22 @@
+// AUTOMATICALLY GENERATED CODE - DO NOT EDIT.
+
+#pragma once
+
+#include <string>
+
+enum MessageType {
+  IDENTIFY             = 1,   // Client -> Server. Identifies the user to the server.
+  SEND_MESSAGE         = 2,   // Client -> Server. Send a chat message.
+  RECEIVE_MESSAGE      = 3,   // Server -> Client. Receive a chat message.
+  REQUEST_HISTORY      = 4,   // Client -> Server. Request previous messages.
+  RECEIVE_HISTORY      = 5,   // Server -> Client. Receive previous messages.
+  RELAY_MESSAGE        = 6,   // Server -> Server. Forward a message for sequencing.
+  SEARCH_HISTORY       = 7,   // Client -> Server. Search previous messages.
+  SEARCH_RESULTS       = 8,   // Server -> Client. Receive matching messages.
+  HEARTBEAT            = 9,   // Both ways. Show that the connection is still alive.
+  RECEIVE_HISTORY_PART = 10,  // Server -> Client. Part of a RECEIVE_HISTORY.
+};
+
+std::string toString(MessageType value);
+bool fromString(const std::string& value, MessageType* output);
+
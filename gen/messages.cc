@@ -0,0 +1,586 @@
+// AUTOMATICALLY GENERATED CODE - DO NOT EDIT.
+
+#include "messages.h"
+
+#include "network.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace scrump;
+using namespace std;
+
+// IDENTIFY
+template <> DataNode network::encode(const Message<IDENTIFY>& message) {
+  DataNode::Object output;
+  output["display_name"] = message.display_name;
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<IDENTIFY>* message) {
+  DataNode::Object& object = input.asObject();
+  message->display_name = object["display_name"].asString();
+}
+
+template <> void BinaryReader::read(Message<IDENTIFY>* message) {
+  message->display_name = readString();
+}
+
+template <> void BinaryWriter::write(const Message<IDENTIFY>& message) {
+  writeString(message.display_name);
+}
+
+template <> size_t network::encodedSize(const Message<IDENTIFY>& message) {
+  size_t size = 0;
+  size += varUintSize(message.display_name.length()) + message.display_name.length();
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<IDENTIFY>& message, char* output) {
+  output = writeString(output, message.display_name);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<IDENTIFY>* message) {
+  if (!readString(position, end, &message->display_name)) return false;
+  return true;
+}
+
+// SEND_MESSAGE
+template <> DataNode network::encode(const Message<SEND_MESSAGE>& message) {
+  DataNode::Object output;
+  output["text"] = message.text;
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<SEND_MESSAGE>* message) {
+  DataNode::Object& object = input.asObject();
+  message->text = object["text"].asString();
+}
+
+template <> void BinaryReader::read(Message<SEND_MESSAGE>* message) {
+  message->text = readString();
+}
+
+template <> void BinaryWriter::write(const Message<SEND_MESSAGE>& message) {
+  writeString(message.text);
+}
+
+template <> size_t network::encodedSize(const Message<SEND_MESSAGE>& message) {
+  size_t size = 0;
+  size += varUintSize(message.text.length()) + message.text.length();
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<SEND_MESSAGE>& message, char* output) {
+  output = writeString(output, message.text);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<SEND_MESSAGE>* message) {
+  if (!readString(position, end, &message->text)) return false;
+  return true;
+}
+
+// RECEIVE_MESSAGE
+static string toString(Message<RECEIVE_MESSAGE>::Category value) {
+  switch (value) {
+    case Message<RECEIVE_MESSAGE>::CHAT_MESSAGE: return "CHAT_MESSAGE";
+    case Message<RECEIVE_MESSAGE>::NOTICE: return "NOTICE";
+  }
+  throw runtime_error("Bad RECEIVE_MESSAGE category.");
+}
+
+static void decodeEnum(const DataNode& input, Message<RECEIVE_MESSAGE>::Category* output) {
+  const string& name = input.asString();
+  if (name == "CHAT_MESSAGE") {
+    *output = Message<RECEIVE_MESSAGE>::CHAT_MESSAGE;
+    return;
+  }
+  if (name == "NOTICE") {
+    *output = Message<RECEIVE_MESSAGE>::NOTICE;
+    return;
+  }
+  throw runtime_error("Invalid RECEIVE_MESSAGE category: " + name);
+}
+
+static bool fromValue(uint64_t value, Message<RECEIVE_MESSAGE>::Category* output) {
+  switch (value) {
+    case Message<RECEIVE_MESSAGE>::CHAT_MESSAGE:
+    case Message<RECEIVE_MESSAGE>::NOTICE:
+      *output = static_cast<Message<RECEIVE_MESSAGE>::Category>(value);
+      return true;
+  }
+  return false;
+}
+
+static bool readEnum(const char** position, const char* end, Message<RECEIVE_MESSAGE>::Category* output) {
+  uint64_t value;
+  return network::readVarUint(position, end, &value) &&
+         fromValue(value, output);
+}
+
+template <> DataNode network::encode(const Message<RECEIVE_MESSAGE>& message) {
+  DataNode::Object output;
+  output["message_id"] = static_cast<int64_t>(message.message_id);
+  output["category"] = toString(message.category);
+  if (message.category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    output["sender_name"] = message.sender_name;
+  }
+  output["text"] = message.text;
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<RECEIVE_MESSAGE>* message) {
+  DataNode::Object& object = input.asObject();
+  message->message_id = object["message_id"].asInt64();
+  decodeEnum(object["category"], &message->category);
+  if (message->category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    message->sender_name = object["sender_name"].asString();
+  }
+  message->text = object["text"].asString();
+}
+
+template <> void BinaryReader::read(Message<RECEIVE_MESSAGE>* message) {
+  message->message_id = readVarUint();
+  if (!fromValue(readVarUint(), &message->category)) {
+    throw runtime_error("Invalid RECEIVE_MESSAGE category.");
+  }
+  if (message->category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    message->sender_name = readString();
+  }
+  message->text = readString();
+}
+
+template <> void BinaryWriter::write(const Message<RECEIVE_MESSAGE>& message) {
+  writeVarUint(message.message_id);
+  writeVarUint(static_cast<uint64_t>(message.category));
+  if (message.category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    writeString(message.sender_name);
+  }
+  writeString(message.text);
+}
+
+template <> size_t network::encodedSize(const Message<RECEIVE_MESSAGE>& message) {
+  size_t size = 0;
+  size += varUintSize(message.message_id);
+  size += varUintSize(static_cast<uint64_t>(message.category));
+  if (message.category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    size += varUintSize(message.sender_name.length()) + message.sender_name.length();
+  }
+  size += varUintSize(message.text.length()) + message.text.length();
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<RECEIVE_MESSAGE>& message, char* output) {
+  output = writeVarUint(output, message.message_id);
+  output = writeVarUint(output, static_cast<uint64_t>(message.category));
+  if (message.category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    output = writeString(output, message.sender_name);
+  }
+  output = writeString(output, message.text);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<RECEIVE_MESSAGE>* message) {
+  if (!readVarUint(position, end, &message->message_id)) return false;
+  if (!readEnum(position, end, &message->category)) return false;
+  if (message->category == Message<RECEIVE_MESSAGE>::CHAT_MESSAGE) {
+    if (!readString(position, end, &message->sender_name)) return false;
+  }
+  if (!readString(position, end, &message->text)) return false;
+  return true;
+}
+
+// REQUEST_HISTORY
+template <> DataNode network::encode(const Message<REQUEST_HISTORY>& message) {
+  DataNode::Object output;
+  output["start_id"] = static_cast<int64_t>(message.start_id);
+  output["num_messages"] = static_cast<int64_t>(message.num_messages);
+  output["accepts_parts"] = static_cast<int64_t>(message.accepts_parts);
+  output["newest"] = static_cast<int64_t>(message.newest);
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<REQUEST_HISTORY>* message) {
+  DataNode::Object& object = input.asObject();
+  message->start_id = object["start_id"].asInt64();
+  message->num_messages = object["num_messages"].asInt64();
+  if (object.count("accepts_parts") == 0) {
+    message->accepts_parts = {};
+  } else {
+    message->accepts_parts = object["accepts_parts"].asInt64();
+  }
+  if (object.count("newest") == 0) {
+    message->newest = {};
+  } else {
+    message->newest = object["newest"].asInt64();
+  }
+}
+
+template <> void BinaryReader::read(Message<REQUEST_HISTORY>* message) {
+  message->start_id = readVarUint();
+  message->num_messages = readVarUint();
+  message->accepts_parts = readVarUint();
+  message->newest = readVarUint();
+}
+
+template <> void BinaryWriter::write(const Message<REQUEST_HISTORY>& message) {
+  writeVarUint(message.start_id);
+  writeVarUint(message.num_messages);
+  writeVarUint(message.accepts_parts);
+  writeVarUint(message.newest);
+}
+
+template <> size_t network::encodedSize(const Message<REQUEST_HISTORY>& message) {
+  size_t size = 0;
+  size += varUintSize(message.start_id);
+  size += varUintSize(message.num_messages);
+  size += varUintSize(message.accepts_parts);
+  size += varUintSize(message.newest);
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<REQUEST_HISTORY>& message, char* output) {
+  output = writeVarUint(output, message.start_id);
+  output = writeVarUint(output, message.num_messages);
+  output = writeVarUint(output, message.accepts_parts);
+  output = writeVarUint(output, message.newest);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<REQUEST_HISTORY>* message) {
+  if (!readVarUint(position, end, &message->start_id)) return false;
+  if (!readVarUint(position, end, &message->num_messages)) return false;
+  if (*position == end) {
+    message->accepts_parts = {};
+  } else {
+    if (!readVarUint(position, end, &message->accepts_parts)) return false;
+  }
+  if (*position == end) {
+    message->newest = {};
+  } else {
+    if (!readVarUint(position, end, &message->newest)) return false;
+  }
+  return true;
+}
+
+// RECEIVE_HISTORY
+template <> DataNode network::encode(const Message<RECEIVE_HISTORY>& message) {
+  DataNode::Array output;
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    output.push_back(encode(entry));
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<RECEIVE_HISTORY>* message) {
+  message->messages.clear();
+  for (const DataNode& node : input.asArray()) {
+    Message<RECEIVE_MESSAGE> value;
+    decode(node, &value);
+    message->messages.push_back(move(value));
+  }
+}
+
+template <> void BinaryReader::read(Message<RECEIVE_HISTORY>* message) {
+  message->messages.clear();
+  for (uint64_t i = readVarUint(); i > 0; i--) {
+    Message<RECEIVE_MESSAGE> value;
+    read(&value);
+    message->messages.push_back(move(value));
+  }
+}
+
+template <> void BinaryWriter::write(const Message<RECEIVE_HISTORY>& message) {
+  writeVarUint(message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    write(entry);
+}
+
+template <> size_t network::encodedSize(const Message<RECEIVE_HISTORY>& message) {
+  size_t size = 0;
+  size += varUintSize(message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    size += encodedSize(entry);
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<RECEIVE_HISTORY>& message, char* output) {
+  output = writeVarUint(output, message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages) {
+    output = writeBinary(entry, output);
+  }
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<RECEIVE_HISTORY>* message) {
+  uint64_t messages_size;
+  if (!readVarUint(position, end, &messages_size)) return false;
+  if (messages_size > static_cast<uint64_t>(end - *position)) return false;
+  message->messages.clear();
+  for (uint64_t i = 0; i < messages_size; i++) {
+    Message<RECEIVE_MESSAGE> value;
+    if (!readBinary(position, end, &value)) return false;
+    message->messages.push_back(move(value));
+  }
+  return true;
+}
+
+// RELAY_MESSAGE
+template <> DataNode network::encode(const Message<RELAY_MESSAGE>& message) {
+  return encode(message.message);
+}
+
+template <> void network::decode(const DataNode& input, Message<RELAY_MESSAGE>* message) {
+  decode(input, &message->message);
+}
+
+template <> void BinaryReader::read(Message<RELAY_MESSAGE>* message) {
+  read(&message->message);
+}
+
+template <> void BinaryWriter::write(const Message<RELAY_MESSAGE>& message) {
+  write(message.message);
+}
+
+template <> size_t network::encodedSize(const Message<RELAY_MESSAGE>& message) {
+  size_t size = 0;
+  size += encodedSize(message.message);
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<RELAY_MESSAGE>& message, char* output) {
+  output = writeBinary(message.message, output);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<RELAY_MESSAGE>* message) {
+  if (!readBinary(position, end, &message->message)) return false;
+  return true;
+}
+
+// SEARCH_HISTORY
+template <> DataNode network::encode(const Message<SEARCH_HISTORY>& message) {
+  DataNode::Object output;
+  output["query"] = message.query;
+  output["sender"] = message.sender;
+  output["start_id"] = static_cast<int64_t>(message.start_id);
+  output["end_id"] = static_cast<int64_t>(message.end_id);
+  output["num_messages"] = static_cast<int64_t>(message.num_messages);
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<SEARCH_HISTORY>* message) {
+  DataNode::Object& object = input.asObject();
+  message->query = object["query"].asString();
+  message->sender = object["sender"].asString();
+  message->start_id = object["start_id"].asInt64();
+  message->end_id = object["end_id"].asInt64();
+  message->num_messages = object["num_messages"].asInt64();
+}
+
+template <> void BinaryReader::read(Message<SEARCH_HISTORY>* message) {
+  message->query = readString();
+  message->sender = readString();
+  message->start_id = readVarUint();
+  message->end_id = readVarUint();
+  message->num_messages = readVarUint();
+}
+
+template <> void BinaryWriter::write(const Message<SEARCH_HISTORY>& message) {
+  writeString(message.query);
+  writeString(message.sender);
+  writeVarUint(message.start_id);
+  writeVarUint(message.end_id);
+  writeVarUint(message.num_messages);
+}
+
+template <> size_t network::encodedSize(const Message<SEARCH_HISTORY>& message) {
+  size_t size = 0;
+  size += varUintSize(message.query.length()) + message.query.length();
+  size += varUintSize(message.sender.length()) + message.sender.length();
+  size += varUintSize(message.start_id);
+  size += varUintSize(message.end_id);
+  size += varUintSize(message.num_messages);
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<SEARCH_HISTORY>& message, char* output) {
+  output = writeString(output, message.query);
+  output = writeString(output, message.sender);
+  output = writeVarUint(output, message.start_id);
+  output = writeVarUint(output, message.end_id);
+  output = writeVarUint(output, message.num_messages);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<SEARCH_HISTORY>* message) {
+  if (!readString(position, end, &message->query)) return false;
+  if (!readString(position, end, &message->sender)) return false;
+  if (!readVarUint(position, end, &message->start_id)) return false;
+  if (!readVarUint(position, end, &message->end_id)) return false;
+  if (!readVarUint(position, end, &message->num_messages)) return false;
+  return true;
+}
+
+// SEARCH_RESULTS
+template <> DataNode network::encode(const Message<SEARCH_RESULTS>& message) {
+  DataNode::Object output;
+  {
+    DataNode::Array values;
+    for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+      values.push_back(encode(entry));
+    output["messages"] = move(values);
+  }
+  output["next_id"] = static_cast<int64_t>(message.next_id);
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<SEARCH_RESULTS>* message) {
+  DataNode::Object& object = input.asObject();
+  message->messages.clear();
+  for (const DataNode& node : object["messages"].asArray()) {
+    Message<RECEIVE_MESSAGE> value;
+    decode(node, &value);
+    message->messages.push_back(move(value));
+  }
+  message->next_id = object["next_id"].asInt64();
+}
+
+template <> void BinaryReader::read(Message<SEARCH_RESULTS>* message) {
+  message->messages.clear();
+  for (uint64_t i = readVarUint(); i > 0; i--) {
+    Message<RECEIVE_MESSAGE> value;
+    read(&value);
+    message->messages.push_back(move(value));
+  }
+  message->next_id = readVarUint();
+}
+
+template <> void BinaryWriter::write(const Message<SEARCH_RESULTS>& message) {
+  writeVarUint(message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    write(entry);
+  writeVarUint(message.next_id);
+}
+
+template <> size_t network::encodedSize(const Message<SEARCH_RESULTS>& message) {
+  size_t size = 0;
+  size += varUintSize(message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    size += encodedSize(entry);
+  size += varUintSize(message.next_id);
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<SEARCH_RESULTS>& message, char* output) {
+  output = writeVarUint(output, message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages) {
+    output = writeBinary(entry, output);
+  }
+  output = writeVarUint(output, message.next_id);
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<SEARCH_RESULTS>* message) {
+  uint64_t messages_size;
+  if (!readVarUint(position, end, &messages_size)) return false;
+  if (messages_size > static_cast<uint64_t>(end - *position)) return false;
+  message->messages.clear();
+  for (uint64_t i = 0; i < messages_size; i++) {
+    Message<RECEIVE_MESSAGE> value;
+    if (!readBinary(position, end, &value)) return false;
+    message->messages.push_back(move(value));
+  }
+  if (!readVarUint(position, end, &message->next_id)) return false;
+  return true;
+}
+
+// HEARTBEAT
+template <> DataNode network::encode(const Message<HEARTBEAT>& message) {
+  DataNode::Object output;
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<HEARTBEAT>* message) {
+}
+
+template <> void BinaryReader::read(Message<HEARTBEAT>* message) {
+}
+
+template <> void BinaryWriter::write(const Message<HEARTBEAT>& message) {
+}
+
+template <> size_t network::encodedSize(const Message<HEARTBEAT>& message) {
+  size_t size = 0;
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<HEARTBEAT>& message, char* output) {
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<HEARTBEAT>* message) {
+  return true;
+}
+
+// RECEIVE_HISTORY_PART
+template <> DataNode network::encode(const Message<RECEIVE_HISTORY_PART>& message) {
+  DataNode::Array output;
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    output.push_back(encode(entry));
+  return output;
+}
+
+template <> void network::decode(const DataNode& input, Message<RECEIVE_HISTORY_PART>* message) {
+  message->messages.clear();
+  for (const DataNode& node : input.asArray()) {
+    Message<RECEIVE_MESSAGE> value;
+    decode(node, &value);
+    message->messages.push_back(move(value));
+  }
+}
+
+template <> void BinaryReader::read(Message<RECEIVE_HISTORY_PART>* message) {
+  message->messages.clear();
+  for (uint64_t i = readVarUint(); i > 0; i--) {
+    Message<RECEIVE_MESSAGE> value;
+    read(&value);
+    message->messages.push_back(move(value));
+  }
+}
+
+template <> void BinaryWriter::write(const Message<RECEIVE_HISTORY_PART>& message) {
+  writeVarUint(message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    write(entry);
+}
+
+template <> size_t network::encodedSize(const Message<RECEIVE_HISTORY_PART>& message) {
+  size_t size = 0;
+  size += varUintSize(message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages)
+    size += encodedSize(entry);
+  return size;
+}
+
+template <> char* network::writeBinary(const Message<RECEIVE_HISTORY_PART>& message, char* output) {
+  output = writeVarUint(output, message.messages.size());
+  for (const Message<RECEIVE_MESSAGE>& entry : message.messages) {
+    output = writeBinary(entry, output);
+  }
+  return output;
+}
+
+template <> bool network::readBinary(const char** position, const char* end, Message<RECEIVE_HISTORY_PART>* message) {
+  uint64_t messages_size;
+  if (!readVarUint(position, end, &messages_size)) return false;
+  if (messages_size > static_cast<uint64_t>(end - *position)) return false;
+  message->messages.clear();
+  for (uint64_t i = 0; i < messages_size; i++) {
+    Message<RECEIVE_MESSAGE> value;
+    if (!readBinary(position, end, &value)) return false;
+    message->messages.push_back(move(value));
+  }
+  return true;
+}
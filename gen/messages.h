@@ -0,0 +1,221 @@
+// AUTOMATICALLY GENERATED CODE - DO NOT EDIT.
+
+#pragma once
+
+#include "message_type.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <scrump/binary.h>
+#include <scrump/data_node.h>
+#include <string>
+#include <vector>
+
+template <MessageType message_type>
+struct Message {
+  static const MessageType type = message_type;
+};
+
+namespace network {
+
+// JSON payloads.
+template <typename T> scrump::DataNode encode(const T& message);
+template <typename T>
+void decode(const scrump::DataNode& input, T* message);
+
+// Binary payloads. encodedSize() is the exact number of bytes which
+// writeBinary() writes, and writeBinary() returns the end of what it wrote.
+template <typename T> size_t encodedSize(const T& message);
+template <typename T> char* writeBinary(const T& message, char* output);
+
+// Decode a binary payload from [*position, end), advancing *position past it.
+// Returns false if the payload is truncated or invalid.
+template <typename T>
+bool readBinary(const char** position, const char* end, T* message);
+
+}  // namespace network
+
+namespace network {
+template <> scrump::DataNode encode(const Message<IDENTIFY>& message);
+template <> void decode(const scrump::DataNode& input, Message<IDENTIFY>* message);
+template <> size_t encodedSize(const Message<IDENTIFY>& message);
+template <> char* writeBinary(const Message<IDENTIFY>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<IDENTIFY>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<IDENTIFY>* message);
+template <> void BinaryWriter::write(const Message<IDENTIFY>& message);
+}  // namespace scrump
+
+// Client -> Server. Identifies the user to the server.
+template <> struct Message<IDENTIFY> {
+  std::string display_name;
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<SEND_MESSAGE>& message);
+template <> void decode(const scrump::DataNode& input, Message<SEND_MESSAGE>* message);
+template <> size_t encodedSize(const Message<SEND_MESSAGE>& message);
+template <> char* writeBinary(const Message<SEND_MESSAGE>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<SEND_MESSAGE>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<SEND_MESSAGE>* message);
+template <> void BinaryWriter::write(const Message<SEND_MESSAGE>& message);
+}  // namespace scrump
+
+// Client -> Server. Send a chat message.
+template <> struct Message<SEND_MESSAGE> {
+  std::string text;
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<RECEIVE_MESSAGE>& message);
+template <> void decode(const scrump::DataNode& input, Message<RECEIVE_MESSAGE>* message);
+template <> size_t encodedSize(const Message<RECEIVE_MESSAGE>& message);
+template <> char* writeBinary(const Message<RECEIVE_MESSAGE>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<RECEIVE_MESSAGE>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<RECEIVE_MESSAGE>* message);
+template <> void BinaryWriter::write(const Message<RECEIVE_MESSAGE>& message);
+}  // namespace scrump
+
+// Server -> Client. Receive a chat message.
+template <> struct Message<RECEIVE_MESSAGE> {
+  uint64_t message_id;  // Unique ID of this message.
+
+  enum Category {
+    CHAT_MESSAGE = 0,  // Sent by a user.
+    NOTICE = 1,        // Sent by the server.
+  };
+
+  Category category;
+  std::string sender_name;  // Only if category is CHAT_MESSAGE.
+  std::string text;
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<REQUEST_HISTORY>& message);
+template <> void decode(const scrump::DataNode& input, Message<REQUEST_HISTORY>* message);
+template <> size_t encodedSize(const Message<REQUEST_HISTORY>& message);
+template <> char* writeBinary(const Message<REQUEST_HISTORY>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<REQUEST_HISTORY>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<REQUEST_HISTORY>* message);
+template <> void BinaryWriter::write(const Message<REQUEST_HISTORY>& message);
+}  // namespace scrump
+
+// Client -> Server. Request previous messages.
+template <> struct Message<REQUEST_HISTORY> {
+  uint64_t start_id;
+  uint64_t num_messages;
+  uint64_t accepts_parts{};  // 1 if the reply may be split into parts.
+  uint64_t newest{};  // 1 for the newest of the messages from start_id.
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<RECEIVE_HISTORY>& message);
+template <> void decode(const scrump::DataNode& input, Message<RECEIVE_HISTORY>* message);
+template <> size_t encodedSize(const Message<RECEIVE_HISTORY>& message);
+template <> char* writeBinary(const Message<RECEIVE_HISTORY>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<RECEIVE_HISTORY>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<RECEIVE_HISTORY>* message);
+template <> void BinaryWriter::write(const Message<RECEIVE_HISTORY>& message);
+}  // namespace scrump
+
+// Server -> Client. Receive previous messages.
+template <> struct Message<RECEIVE_HISTORY> {
+  std::vector<Message<RECEIVE_MESSAGE>> messages;
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<RELAY_MESSAGE>& message);
+template <> void decode(const scrump::DataNode& input, Message<RELAY_MESSAGE>* message);
+template <> size_t encodedSize(const Message<RELAY_MESSAGE>& message);
+template <> char* writeBinary(const Message<RELAY_MESSAGE>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<RELAY_MESSAGE>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<RELAY_MESSAGE>* message);
+template <> void BinaryWriter::write(const Message<RELAY_MESSAGE>& message);
+}  // namespace scrump
+
+// Server -> Server. Forward a message for sequencing.
+template <> struct Message<RELAY_MESSAGE> {
+  Message<RECEIVE_MESSAGE> message;  // The message ID is assigned by the recipient.
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<SEARCH_HISTORY>& message);
+template <> void decode(const scrump::DataNode& input, Message<SEARCH_HISTORY>* message);
+template <> size_t encodedSize(const Message<SEARCH_HISTORY>& message);
+template <> char* writeBinary(const Message<SEARCH_HISTORY>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<SEARCH_HISTORY>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<SEARCH_HISTORY>* message);
+template <> void BinaryWriter::write(const Message<SEARCH_HISTORY>& message);
+}  // namespace scrump
+
+// Client -> Server. Search previous messages.
+template <> struct Message<SEARCH_HISTORY> {
+  std::string query;  // Every term must appear in each result.
+  std::string sender;  // If non-empty, only messages sent by this name match.
+  uint64_t start_id;
+  uint64_t end_id;  // Exclusive. 0 means that there is no upper bound.
+  uint64_t num_messages;
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<SEARCH_RESULTS>& message);
+template <> void decode(const scrump::DataNode& input, Message<SEARCH_RESULTS>* message);
+template <> size_t encodedSize(const Message<SEARCH_RESULTS>& message);
+template <> char* writeBinary(const Message<SEARCH_RESULTS>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<SEARCH_RESULTS>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<SEARCH_RESULTS>* message);
+template <> void BinaryWriter::write(const Message<SEARCH_RESULTS>& message);
+}  // namespace scrump
+
+// Server -> Client. Receive matching messages.
+template <> struct Message<SEARCH_RESULTS> {
+  std::vector<Message<RECEIVE_MESSAGE>> messages;
+  uint64_t next_id;  // If non-zero, the start_id of the next page of results.
+};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<HEARTBEAT>& message);
+template <> void decode(const scrump::DataNode& input, Message<HEARTBEAT>* message);
+template <> size_t encodedSize(const Message<HEARTBEAT>& message);
+template <> char* writeBinary(const Message<HEARTBEAT>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<HEARTBEAT>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<HEARTBEAT>* message);
+template <> void BinaryWriter::write(const Message<HEARTBEAT>& message);
+}  // namespace scrump
+
+// Both ways. Show that the connection is still alive.
+template <> struct Message<HEARTBEAT> {};
+
+namespace network {
+template <> scrump::DataNode encode(const Message<RECEIVE_HISTORY_PART>& message);
+template <> void decode(const scrump::DataNode& input, Message<RECEIVE_HISTORY_PART>* message);
+template <> size_t encodedSize(const Message<RECEIVE_HISTORY_PART>& message);
+template <> char* writeBinary(const Message<RECEIVE_HISTORY_PART>& message, char* output);
+template <> bool readBinary(const char** position, const char* end, Message<RECEIVE_HISTORY_PART>* message);
+}  // namespace network
+namespace scrump {
+template <> void BinaryReader::read(Message<RECEIVE_HISTORY_PART>* message);
+template <> void BinaryWriter::write(const Message<RECEIVE_HISTORY_PART>& message);
+}  // namespace scrump
+
+// Server -> Client. Part of a RECEIVE_HISTORY.
+template <> struct Message<RECEIVE_HISTORY_PART> {
+  std::vector<Message<RECEIVE_MESSAGE>> messages;
+};
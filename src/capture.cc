@@ -0,0 +1,227 @@
+#include "capture.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <scrump/logging.h>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+static const char MAGIC[] = "CHATCAP1";
+static const size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+// The writer thread wakes at least this often, and as soon as this much has
+// been recorded.
+static const chrono::milliseconds FLUSH_INTERVAL(100);
+static const size_t FLUSH_SIZE = 1 << 20;
+
+// Frames are dropped once this much is waiting to be written.
+static const size_t MAX_BUFFERED = 64 << 20;
+
+// The reader reads the file in pieces of this size.
+static const size_t READ_SIZE = 1 << 20;
+
+static runtime_error systemError(const string& message) {
+  return runtime_error(message + ": " + strerror(errno));
+}
+
+static void writeAll(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      throw systemError("Failed to write capture");
+    }
+    data += written;
+    length -= written;
+  }
+}
+
+CaptureWriter::CaptureWriter(const string& path)
+    : last_time_(network::monotonicMicroseconds()) {
+  // Captures hold everything users send, so only the server's user may read
+  // them.
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd_ < 0) throw systemError("Failed to open " + path);
+  writeAll(fd_, MAGIC, MAGIC_SIZE);
+  writer_ = thread(&CaptureWriter::writeLoop, this);
+}
+
+CaptureWriter::CaptureWriter(int fd, uint64_t last_connection,
+                             int64_t last_time)
+    : last_time_(last_time), last_connection_(last_connection), fd_(fd) {
+  writer_ = thread(&CaptureWriter::writeLoop, this);
+}
+
+CaptureWriter::~CaptureWriter() {
+  {
+    unique_lock<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_one();
+  writer_.join();
+  try {
+    flush();
+  } catch (const exception& error) {
+    LOG(ERROR) << error.what();
+  }
+  ::close(fd_);
+}
+
+uint64_t CaptureWriter::open(Connection::Mode mode) {
+  unique_lock<mutex> lock(mutex_);
+  uint64_t connection = ++last_connection_;
+  start(CAPTURE_OPEN, connection);
+  network::appendVarUint(&buffer_, mode);
+  return connection;
+}
+
+void CaptureWriter::frame(uint64_t connection, const char* data,
+                          size_t length) {
+  bool full;
+  {
+    unique_lock<mutex> lock(mutex_);
+    if (buffer_.size() + length > MAX_BUFFERED) {
+      dropped_++;
+      return;
+    }
+    start(CAPTURE_FRAME, connection);
+    network::appendVarUint(&buffer_, length);
+    buffer_.append(data, length);
+    full = buffer_.size() >= FLUSH_SIZE;
+  }
+  if (full) ready_.notify_one();
+}
+
+void CaptureWriter::close(uint64_t connection) {
+  unique_lock<mutex> lock(mutex_);
+  start(CAPTURE_CLOSE, connection);
+}
+
+void CaptureWriter::flush() {
+  unique_lock<mutex> file_lock(file_mutex_);
+  string data;
+  uint64_t dropped;
+  {
+    unique_lock<mutex> lock(mutex_);
+    data.swap(buffer_);
+    dropped = dropped_;
+    dropped_ = 0;
+  }
+  if (dropped > 0) {
+    LOG(WARNING) << "Dropped " << dropped
+                 << " frames because the capture could not be written fast "
+                    "enough.";
+  }
+  writeAll(fd_, data.data(), data.size());
+}
+
+uint64_t CaptureWriter::lastConnection() {
+  unique_lock<mutex> lock(mutex_);
+  return last_connection_;
+}
+
+int64_t CaptureWriter::lastTime() {
+  unique_lock<mutex> lock(mutex_);
+  return last_time_;
+}
+
+void CaptureWriter::start(CaptureRecordKind kind, uint64_t connection) {
+  // Records are added in order with the lock held, so the time never goes
+  // backwards.
+  int64_t now = network::monotonicMicroseconds();
+  network::appendVarUint(&buffer_, kind);
+  network::appendVarUint(&buffer_, now - last_time_);
+  network::appendVarUint(&buffer_, connection);
+  last_time_ = now;
+}
+
+void CaptureWriter::writeLoop() {
+  while (true) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      ready_.wait_for(lock, FLUSH_INTERVAL, [this] {
+        return stopping_ || buffer_.size() >= FLUSH_SIZE;
+      });
+      if (stopping_) return;
+    }
+    try {
+      flush();
+    } catch (const exception& error) {
+      LOG(ERROR) << error.what();
+    }
+  }
+}
+
+CaptureReader::CaptureReader(const string& path) {
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) throw systemError("Failed to open " + path);
+  while (buffer_.size() < MAGIC_SIZE && fill()) continue;
+  if (buffer_.compare(0, MAGIC_SIZE, MAGIC) != 0) {
+    ::close(fd_);
+    throw runtime_error(path + " is not a capture file.");
+  }
+  offset_ = MAGIC_SIZE;
+}
+
+CaptureReader::~CaptureReader() { ::close(fd_); }
+
+bool CaptureReader::next(CaptureRecord* record) {
+  while (true) {
+    const char* position = buffer_.data() + offset_;
+    const char* end = buffer_.data() + buffer_.size();
+    uint64_t kind, delay, value;
+    bool complete =
+        network::readVarUint(&position, end, &kind) &&
+        network::readVarUint(&position, end, &delay) &&
+        network::readVarUint(&position, end, &record->connection);
+    if (complete) {
+      switch (kind) {
+        case CAPTURE_OPEN:
+          complete = network::readVarUint(&position, end, &value);
+          if (complete && value != Connection::BINARY &&
+              value != Connection::JSON) {
+            throw runtime_error("Invalid connection mode in capture.");
+          }
+          record->mode = static_cast<Connection::Mode>(value);
+          break;
+        case CAPTURE_FRAME:
+          complete = network::readString(&position, end, &record->frame);
+          break;
+        case CAPTURE_CLOSE:
+          break;
+        default:
+          throw runtime_error("Invalid record in capture.");
+      }
+    }
+    if (complete) {
+      record->kind = static_cast<CaptureRecordKind>(kind);
+      time_ += delay;
+      record->time = time_;
+      offset_ = position - buffer_.data();
+      return true;
+    }
+    if (!fill()) {
+      if (offset_ != buffer_.size())
+        LOG(WARNING) << "The capture ends with an incomplete record.";
+      return false;
+    }
+  }
+}
+
+bool CaptureReader::fill() {
+  buffer_.erase(0, offset_);
+  offset_ = 0;
+  size_t size = buffer_.size();
+  buffer_.resize(size + READ_SIZE);
+  ssize_t result;
+  do {
+    result = read(fd_, &buffer_[size], READ_SIZE);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) throw systemError("Failed to read capture");
+  buffer_.resize(size + result);
+  return result > 0;
+}
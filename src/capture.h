@@ -0,0 +1,115 @@
+#pragma once
+
+#include "network.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// A capture file records the frames that a server receives from its users, so
+// that they can be replayed against another server by bin/replay. It starts
+// with the 8 bytes "CHATCAP1", followed by a sequence of records:
+//
+//     <varuint kind> <varuint delay> <varuint connection> ...
+//
+// The delay is the time since the previous record, in microseconds, and
+// connections are numbered from 1 in the order they were opened. The rest of
+// the record depends on its kind:
+//
+//     CAPTURE_OPEN:  <varuint mode>
+//     CAPTURE_FRAME: <varuint length> <bytes[length] frame>
+//     CAPTURE_CLOSE:
+//
+// A binary frame is a complete message, including its type and length. A JSON
+// frame is a single line, including its newline.
+enum CaptureRecordKind : uint64_t {
+  CAPTURE_OPEN,
+  CAPTURE_FRAME,
+  CAPTURE_CLOSE,
+};
+
+struct CaptureRecord {
+  CaptureRecordKind kind;
+  int64_t time;  // Microseconds since the capture started.
+  uint64_t connection;
+  Connection::Mode mode;  // Only for CAPTURE_OPEN.
+  std::string frame;      // Only for CAPTURE_FRAME.
+};
+
+// Appends records to a capture file. Records are gathered in memory and
+// written by a background thread, so recording a frame costs a copy under a
+// lock. If the disk cannot keep up, frames are dropped rather than buffered
+// without limit, and the number dropped is logged.
+class CaptureWriter {
+ public:
+  // Create or truncate the file.
+  CaptureWriter(const std::string& path);
+
+  // Continue a capture handed over by a previous server, from the state its
+  // writer returned from lastConnection() and lastTime().
+  CaptureWriter(int fd, uint64_t last_connection, int64_t last_time);
+
+  // Writes everything recorded so far.
+  ~CaptureWriter();
+
+  CaptureWriter(const CaptureWriter&) = delete;
+  CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+  // Record a new connection, returning its number.
+  uint64_t open(Connection::Mode mode);
+  void frame(uint64_t connection, const char* data, size_t length);
+  void close(uint64_t connection);
+
+  // Write everything recorded so far. This does not return until it is on
+  // disk.
+  void flush();
+
+  // For handing the capture over to another server, once nothing more will be
+  // recorded here and it has been flushed. The file shares its offset with
+  // the other server's copy of the descriptor.
+  int fd() const { return fd_; }
+  uint64_t lastConnection();
+  int64_t lastTime();  // From network::monotonicMicroseconds().
+
+ private:
+  // Start a record. Must be called with mutex_ held.
+  void start(CaptureRecordKind kind, uint64_t connection);
+
+  void writeLoop();
+
+  std::mutex mutex_;
+  std::condition_variable ready_;  // Signalled when buffer_ should be written.
+  std::string buffer_;
+  int64_t last_time_;
+  uint64_t last_connection_ = 0;
+  uint64_t dropped_ = 0;
+  bool stopping_ = false;
+
+  std::mutex file_mutex_;  // Held while taking and writing out buffer_.
+  int fd_;
+  std::thread writer_;
+};
+
+// Reads the records of a capture file in order.
+class CaptureReader {
+ public:
+  CaptureReader(const std::string& path);
+  ~CaptureReader();
+
+  CaptureReader(const CaptureReader&) = delete;
+  CaptureReader& operator=(const CaptureReader&) = delete;
+
+  // Read the next record. Returns false at the end of the file.
+  bool next(CaptureRecord* record);
+
+ private:
+  // Read more of the file into buffer_. Returns false at the end of the file.
+  bool fill();
+
+  int fd_;
+  std::string buffer_;
+  size_t offset_ = 0;
+  int64_t time_ = 0;
+};
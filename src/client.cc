@@ -1,15 +1,25 @@
+#include "history_cache.h"
 #include "network.h"
+#include "session.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <readline/readline.h>
 #include <scrump/args.h>
 #include <scrump/atomic_output.h>
 #include <scrump/color.h>
 #include <sstream>
 #include <string>
+#include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 using namespace scrump;
 using namespace std;
@@ -18,6 +28,26 @@ OPTION(string, host, "0.0.0.0", "Host address to connect to.");
 OPTION(int, port, 17994, "Port to connect to.");
 OPTION(string, display_name, "",
        "Display name to use. If unset, defaults to username.");
+OPTION(int, frame_interval_ms, 16,
+       "Minimum time between redraws of incoming messages, in milliseconds.");
+OPTION(string, cache_file, "",
+       "File to cache received messages in. If unset, defaults to "
+       "~/.chat_cache.");
+OPTION(int, cached_messages, 50,
+       "Number of cached messages to display on startup, and of the newest "
+       "messages to fetch from the server when nothing usable is cached.");
+OPTION(int, max_cached_messages, 100000,
+       "Maximum number of messages to keep in the cache file.");
+OPTION(int, history_page_size, 100,
+       "Maximum number of messages to request from the server at once when "
+       "catching up on missed messages.");
+OPTION(int, reconnect_min_ms, 500,
+       "Initial delay before reconnecting to the server, in milliseconds.");
+OPTION(int, reconnect_max_ms, 30000,
+       "Maximum delay before reconnecting to the server, in milliseconds.");
+OPTION(int, heartbeat_interval, 30,
+       "Interval between heartbeats sent to the server, in seconds. If the "
+       "server sends nothing for three intervals, the client reconnects.");
 
 const Color NOTICE_COLOR = Color::GREEN;
 const Color NAME_COLOR = Color::CYAN;
@@ -48,31 +78,91 @@ class ReadlineSaver {
   char* saved_line_;
 };
 
-class Output {
- public:
-  ~Output() {
-    cout << "\n";
+void formatMessage(ostream& output, const ChatMessage& message) {
+  switch (message.category) {
+    case ChatMessage::NOTICE:
+      output << NOTICE_COLOR << message.text << Color::RESET;
+      break;
+    case ChatMessage::CHAT_MESSAGE:
+      output << NAME_COLOR << message.sender_name << Color::RESET << ": "
+             << message.text;
+      break;
   }
+  output << "\n";
+}
 
-  template <typename T>
-  Output& operator<<(T value) {
-    cout << value;
-    return *this;
-  }
+// Collects incoming messages and draws them in batches. Saving and restoring
+// the prompt is expensive and causes flicker, so this is done at most once per
+// frame interval regardless of how quickly messages are arriving.
+class MessageRenderer {
+ public:
+  MessageRenderer(chrono::milliseconds frame_interval);
+
+  // Queue a message for display. Safe to call from any thread.
+  void push(const ChatMessage& message);
+
+  // Queue a local error message for display. Safe to call from any thread.
+  void error(const string& text);
+
+  // Repeatedly draw batches of queued messages. Does not return.
+  void run();
 
  private:
-  ReadlineSaver input_saver;
+  void append(const string& text);
+
+  const chrono::milliseconds frame_interval_;
+
+  mutex pending_mutex_;
+  condition_variable pending_available_;
+  string pending_;  // Formatted output which has not yet been drawn.
 };
 
-void displayMessage(const ChatMessage& message) {
-  switch (message.category) {
-    case ChatMessage::NOTICE:
-      Output() << NOTICE_COLOR << message.text << Color::RESET;
-      break;
-    case ChatMessage::CHAT_MESSAGE:
-      Output() << NAME_COLOR << message.sender_name << Color::RESET << ": "
-               << message.text;
-      break;
+MessageRenderer::MessageRenderer(chrono::milliseconds frame_interval)
+    : frame_interval_(frame_interval) {}
+
+void MessageRenderer::push(const ChatMessage& message) {
+  stringstream output;
+  formatMessage(output, message);
+  append(output.str());
+}
+
+void MessageRenderer::error(const string& text) {
+  stringstream output;
+  output << ERROR_COLOR << text << Color::RESET << "\n";
+  append(output.str());
+}
+
+void MessageRenderer::append(const string& text) {
+  unique_lock<mutex> lock(pending_mutex_);
+  if (pending_.empty()) pending_available_.notify_one();
+  pending_ += text;
+}
+
+void MessageRenderer::run() {
+  string batch;
+  auto last_draw = chrono::steady_clock::now() - frame_interval_;
+  while (true) {
+    {
+      unique_lock<mutex> lock(pending_mutex_);
+      pending_available_.wait(lock, [this] { return !pending_.empty(); });
+    }
+
+    // If the last draw was recent, wait for the rest of the frame so that any
+    // messages arriving in the meantime are drawn together. When idle, this
+    // returns immediately and the message is drawn without delay.
+    this_thread::sleep_until(last_draw + frame_interval_);
+
+    {
+      unique_lock<mutex> lock(pending_mutex_);
+      batch.swap(pending_);
+    }
+    {
+      // The prompt is hidden only for the duration of a single write.
+      ReadlineSaver input_saver;
+      cout << batch << flush;
+    }
+    batch.clear();
+    last_draw = chrono::steady_clock::now();
   }
 }
 
@@ -88,12 +178,6 @@ char* input(const string& prompt_text) {
 int main(int argc, char* args[]) {
   args::process(&argc, args);
 
-  // Connect to the server.
-  Socket socket;
-  socket.connect(options::host, options::port);
-  Connection connection(Connection::BINARY, move(socket));
-
-  // Identify.
   string display_name = options::display_name;
   if (display_name == "") {
     // Display name is unset. Default to the linux username.
@@ -102,17 +186,33 @@ int main(int argc, char* args[]) {
     getlogin_r(temp, MAX_LENGTH);
     display_name = string(temp);
   }
-  {
-    // Send the identification message.
-    Message<IDENTIFY> message;
-    message.display_name = display_name;
-    connection.send(message);
+
+  string cache_file = options::cache_file;
+  if (cache_file == "") {
+    const char* home = getenv("HOME");
+    cache_file = string(home ? home : ".") + "/.chat_cache";
   }
 
-  // Set up the message handlers.
-  connection.on<RECEIVE_MESSAGE>([](Message<RECEIVE_MESSAGE>&& message) {
-    displayMessage(message);
-  });
+  MessageRenderer renderer(chrono::milliseconds(options::frame_interval_ms));
+
+  // Open the cache and show the most recent messages from it.
+  unique_ptr<HistoryCache> cache;
+  try {
+    cache.reset(new HistoryCache(
+        cache_file, max(options::max_cached_messages, 1)));
+  } catch (const exception& error) {
+    cerr << error.what() << "\n";
+    return 1;
+  }
+  for (const ChatMessage& message : cache->recent(options::cached_messages))
+    renderer.push(message);
+
+  // Start the rendering thread.
+  thread render_thread(&MessageRenderer::run, &renderer);
+
+  // The current connection, or null if disconnected.
+  mutex connection_mutex;
+  Connection* connection = nullptr;
 
   // Start the message sending thread.
   thread input_thread([&] {
@@ -120,12 +220,92 @@ int main(int argc, char* args[]) {
     char* line = input(display_name);
     while (line) {
       message.text = line;
-      connection.send(message);
       free(line);
+      {
+        unique_lock<mutex> lock(connection_mutex);
+        if (connection == nullptr) {
+          renderer.error("Not connected. Message was not sent.");
+        } else {
+          try {
+            connection->send(message);
+          } catch (const exception& error) {
+            renderer.error(string("Failed to send message: ") + error.what());
+          }
+        }
+      }
       line = input(display_name);
     }
   });
 
-  // Repeatedly handle incoming messages.
-  while (true) connection.poll();
+  // Keep the connection alive while idle, and drop it if the server has gone
+  // quiet. Shutting the socket down makes the connection loop reconnect.
+  thread heartbeat_thread([&] {
+    const chrono::seconds interval(max(options::heartbeat_interval, 1));
+    while (true) {
+      this_thread::sleep_for(interval);
+      unique_lock<mutex> lock(connection_mutex);
+      if (connection == nullptr) continue;
+      int64_t silence =
+          network::monotonicMilliseconds() - connection->lastReceive();
+      if (silence >= 3 * chrono::milliseconds(interval).count()) {
+        renderer.error("The server stopped responding.");
+        shutdown(connection->fd(), SHUT_RDWR);
+        continue;
+      }
+      try {
+        connection->send(Message<HEARTBEAT>());
+      } catch (const exception&) {
+        shutdown(connection->fd(), SHUT_RDWR);
+      }
+    }
+  });
+
+  // Repeatedly connect to the server and handle incoming messages. Reconnects
+  // are delayed by an exponentially increasing, randomly jittered amount so
+  // that clients do not all reconnect at once after a server restart.
+  const chrono::milliseconds min_delay(options::reconnect_min_ms);
+  const chrono::milliseconds max_delay(options::reconnect_max_ms);
+  chrono::milliseconds delay = min_delay;
+  default_random_engine random(random_device{}());
+  while (true) {
+    try {
+      StreamSocket socket;
+      socket.connect(options::host, options::port);
+      Connection current(Connection::BINARY, move(socket));
+      delay = min_delay;
+
+      // Identify.
+      Message<IDENTIFY> identify;
+      identify.display_name = display_name;
+      current.send(identify);
+
+      Session session(
+          &current, cache.get(), max(options::history_page_size, 1),
+          max(options::cached_messages, 0),
+          [&](const ChatMessage& message) { renderer.push(message); },
+          [&](const string& text) { renderer.error(text); });
+      {
+        unique_lock<mutex> lock(connection_mutex);
+        connection = &current;
+      }
+      try {
+        session.start();
+        while (true) current.poll();
+      } catch (...) {
+        unique_lock<mutex> lock(connection_mutex);
+        connection = nullptr;
+        throw;
+      }
+    } catch (const exception& error) {
+      renderer.error(string("Disconnected: ") + error.what());
+    }
+
+    uniform_int_distribution<int64_t> jitter(delay.count() / 2, delay.count());
+    chrono::milliseconds wait(jitter(random));
+    stringstream message;
+    message << "Reconnecting in " << wait.count() << "ms..";
+    renderer.error(message.str());
+    this_thread::sleep_for(wait);
+    delay = min(delay * 2, max_delay);
+  }
 }
@@ -27,37 +27,695 @@
   And the corresponding implementation. This is because I am tired of repeatedly
   solving the same problem when I want to be able to use the string-names of
   enum values for input/output.
+
+  With --messages, it also acts as a schema compiler for network messages. Each
+  item of the enum is a message type, and is followed by the fields of that
+  message, indented by two spaces, in the order in which they are encoded:
+
+  -- messages.schema --
+    PING (0x01)  # Check that the other side is alive.
+    PONG (0x02)  # Reply to a PING.
+      uint64 sequence  # Copied from the PING.
+      Status status
+        OK   (0)
+        BUSY (1)
+      string reason if status == BUSY
+      RECORD[] records
+      optional uint64 flags
+  ---------------------
+
+  A field has a type, which is one of:
+
+    uint64     A varuint, or a JSON integer.
+    string     A length-prefixed string, or a JSON string.
+    <MESSAGE>  The payload of a message type declared earlier in the file.
+    <Name>     An enum nested in the message, whose values follow the field,
+               indented by four spaces. It is encoded as a varuint, or as the
+               name of the value in JSON.
+
+  Any type may be followed by [] for a list of values, which is encoded as a
+  varuint count followed by each value, or as a JSON array. A field may be
+  present only if an earlier enum field has a particular value. A message with
+  a single field may mark it inline, so that its JSON payload is that field's
+  value alone, rather than an object.
+
+  Fields marked optional may be left out of the end of a payload, or out of a
+  JSON object, by senders which predate them. They then read as zero, or as
+  empty. Only optional fields may follow an optional field. BinaryReader,
+  which cannot tell where a payload ends, reads them as if they were required,
+  so payloads which may lack them must be read with network::readBinary().
+
+  This produces the Message<> struct of each message type, and its JSON and
+  binary codecs. The binary payload of a message can be written with a single
+  allocation, as network::encodedSize() gives its exact size before
+  network::writeBinary() writes it. network::readBinary() decodes a payload in
+  place from a buffer, checking every length against the end of the buffer.
 */
 
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <regex>
 #include <scrump/args.h>
 #include <scrump/logging.h>
+#include <set>
 #include <vector>
 
 using namespace scrump;
 using namespace std;
 
 USAGE("Usage: enum --input <input file> --name <enum name>\n"
-      "            --output <output file>\n"
+      "            --output <output file> [--messages <messages file>]\n"
       "\n"
-      "  input file  - Name of the enum file to process.\n"
-      "  enum name   - Name to assign to the generated enum."
-      "  output file - Name for the generated .h and .cc files, excluding the "
-                      "extension.");
+      "  input file    - Name of the enum file to process.\n"
+      "  enum name     - Name to assign to the generated enum."
+      "  output file   - Name for the generated .h and .cc files, excluding "
+                        "the extension.\n"
+      "  messages file - Name for the generated message .h and .cc files, "
+                        "excluding the extension.");
 
 OPTION(string, input, "", "Name of the input file.");
 OPTION(string, output, "", "Name of the output file.");
 OPTION(string, name, "", "Name of the generated enum.");
+OPTION(string, messages, "",
+       "Name of the output file for messages. If set, each item of the enum "
+       "is a message type, followed by the fields of the message.");
+
+struct Value {
+  string name;
+  int64_t value;
+  string description;
+};
+
+struct Field {
+  enum Kind {
+    UINT64,
+    STRING,
+    MESSAGE,
+    ENUM,
+  };
+
+  Kind kind;
+  string type;  // The type as written in the schema.
+  string name;
+  bool is_list = false;
+  bool is_inline = false;
+  bool is_optional = false;  // May be missing from the end of a payload.
+  string condition_field;  // If non-empty, the field is only present if
+  string condition_value;  // condition_field has condition_value.
+  string description;
+  vector<Value> values;  // Populated only if kind is ENUM.
+};
 
 struct Item {
   string name;
   int64_t value;
   string description;
+  vector<Field> fields;  // Populated only with --messages.
 };
 
+// The C++ type of a single value of a field.
+static string valueType(const Field& field) {
+  switch (field.kind) {
+    case Field::UINT64: return "uint64_t";
+    case Field::STRING: return "std::string";
+    case Field::MESSAGE: return "Message<" + field.type + ">";
+    case Field::ENUM: return field.type;
+  }
+  return "";
+}
+
+static string fieldType(const Field& field) {
+  return field.is_list ? "std::vector<" + valueType(field) + ">"
+                       : valueType(field);
+}
+
+// The C++ type of a single value, for use outside of the message struct.
+static string qualifiedValueType(const Item& item, const Field& field) {
+  if (field.kind == Field::ENUM)
+    return "Message<" + item.name + ">::" + field.type;
+  if (field.kind == Field::STRING) return "string";
+  return valueType(field);
+}
+
+// The code which handles one value of a field, given the expression for the
+// value. Each is a single statement, or an expression for the encoders.
+static string jsonEncodeValue(const Field& field, const string& value) {
+  switch (field.kind) {
+    case Field::UINT64: return "static_cast<int64_t>(" + value + ")";
+    case Field::STRING: return value;
+    case Field::MESSAGE: return "encode(" + value + ")";
+    case Field::ENUM: return "toString(" + value + ")";
+  }
+  return "";
+}
+
+static string jsonDecodeValue(const Field& field, const string& node,
+                              const string& output) {
+  switch (field.kind) {
+    case Field::UINT64: return output + " = " + node + ".asInt64();";
+    case Field::STRING: return output + " = " + node + ".asString();";
+    case Field::MESSAGE: return "decode(" + node + ", &" + output + ");";
+    case Field::ENUM:
+      return "decodeEnum(" + node + ", &" + output + ");";
+  }
+  return "";
+}
+
+static string readValue(const Item& item, const Field& field,
+                        const string& output) {
+  switch (field.kind) {
+    case Field::UINT64: return output + " = readVarUint();";
+    case Field::STRING: return output + " = readString();";
+    case Field::MESSAGE: return "read(&" + output + ");";
+    case Field::ENUM:
+      return "if (!fromValue(readVarUint(), &" + output + ")) {\n"
+             "    throw runtime_error(\"Invalid " + item.name + " " +
+             field.name + ".\");\n"
+             "  }";
+  }
+  return "";
+}
+
+static string writeValue(const Field& field, const string& value) {
+  switch (field.kind) {
+    case Field::UINT64: return "writeVarUint(" + value + ");";
+    case Field::STRING: return "writeString(" + value + ");";
+    case Field::MESSAGE: return "write(" + value + ");";
+    case Field::ENUM:
+      return "writeVarUint(static_cast<uint64_t>(" + value + "));";
+  }
+  return "";
+}
+
+// An expression which reads one value from an in-memory buffer, and is false
+// if it is truncated or invalid.
+static string readBinaryValue(const Field& field, const string& output) {
+  string arguments = "position, end, &" + output + ")";
+  switch (field.kind) {
+    case Field::UINT64: return "readVarUint(" + arguments;
+    case Field::STRING: return "readString(" + arguments;
+    case Field::MESSAGE: return "readBinary(" + arguments;
+    case Field::ENUM: return "readEnum(" + arguments;
+  }
+  return "";
+}
+
+static string sizeOfValue(const Field& field, const string& value) {
+  switch (field.kind) {
+    case Field::UINT64: return "varUintSize(" + value + ")";
+    case Field::STRING:
+      return "varUintSize(" + value + ".length()) + " + value + ".length()";
+    case Field::MESSAGE: return "encodedSize(" + value + ")";
+    case Field::ENUM:
+      return "varUintSize(static_cast<uint64_t>(" + value + "))";
+  }
+  return "";
+}
+
+static string writeBinaryValue(const Field& field, const string& value) {
+  switch (field.kind) {
+    case Field::UINT64: return "output = writeVarUint(output, " + value + ");";
+    case Field::STRING: return "output = writeString(output, " + value + ");";
+    case Field::MESSAGE: return "output = writeBinary(" + value + ", output);";
+    case Field::ENUM:
+      return "output = writeVarUint(output, static_cast<uint64_t>(" + value +
+             "));";
+  }
+  return "";
+}
+
+// Emits the code for each field of a message, wrapped in the field's
+// condition. The callback emits the code for the field itself, at the given
+// indentation. For decoders, missing gives the condition under which an
+// optional field is absent, in which case it is reset instead.
+template <typename Function>
+static void forEachField(ostream& output, const Item& item,
+                         const string& message, Function emit,
+                         string (*missing)(const Field&) = nullptr) {
+  for (const Field& field : item.fields) {
+    string indent = "  ";
+    if (!field.condition_field.empty()) {
+      output << "  if (" << message << field.condition_field << " == Message<"
+             << item.name << ">::" << field.condition_value << ") {\n";
+      indent = "    ";
+    }
+    if (field.is_optional && missing) {
+      output << indent << "if (" << missing(field) << ") {\n"
+             << indent << "  " << message << field.name << " = {};\n"
+             << indent << "} else {\n";
+      emit(field, indent + "  ");
+      output << indent << "}\n";
+    } else {
+      emit(field, indent);
+    }
+    if (!field.condition_field.empty()) output << "  }\n";
+  }
+}
+
+static void writeHeader(ostream& output, const vector<Item>& messages) {
+  output << "// AUTOMATICALLY GENERATED CODE - DO NOT EDIT.\n"
+            "\n"
+            "#pragma once\n"
+            "\n"
+            "#include \"" << options::output << ".h\"\n"
+            "\n"
+            "#include <cstddef>\n"
+            "#include <cstdint>\n"
+            "#include <scrump/binary.h>\n"
+            "#include <scrump/data_node.h>\n"
+            "#include <string>\n"
+            "#include <vector>\n"
+            "\n"
+            "template <" << options::name << " message_type>\n"
+            "struct Message {\n"
+            "  static const " << options::name << " type = message_type;\n"
+            "};\n"
+            "\n"
+            "namespace network {\n"
+            "\n"
+            "// JSON payloads.\n"
+            "template <typename T> scrump::DataNode encode(const T& message);\n"
+            "template <typename T>\n"
+            "void decode(const scrump::DataNode& input, T* message);\n"
+            "\n"
+            "// Binary payloads. encodedSize() is the exact number of bytes "
+            "which\n"
+            "// writeBinary() writes, and writeBinary() returns the end of "
+            "what it wrote.\n"
+            "template <typename T> size_t encodedSize(const T& message);\n"
+            "template <typename T> char* writeBinary(const T& message, "
+            "char* output);\n"
+            "\n"
+            "// Decode a binary payload from [*position, end), advancing "
+            "*position past it.\n"
+            "// Returns false if the payload is truncated or invalid.\n"
+            "template <typename T>\n"
+            "bool readBinary(const char** position, const char* end, "
+            "T* message);\n"
+            "\n"
+            "}  // namespace network\n";
+
+  for (const Item& item : messages) {
+    string type = "Message<" + item.name + ">";
+    output << "\n"
+              "namespace network {\n"
+              "template <> scrump::DataNode encode(const " << type
+           << "& message);\n"
+              "template <> void decode(const scrump::DataNode& input, "
+           << type << "* message);\n"
+              "template <> size_t encodedSize(const " << type
+           << "& message);\n"
+              "template <> char* writeBinary(const " << type
+           << "& message, char* output);\n"
+              "template <> bool readBinary(const char** position, "
+              "const char* end, " << type << "* message);\n"
+              "}  // namespace network\n"
+              "namespace scrump {\n"
+              "template <> void BinaryReader::read(" << type << "* message);\n"
+              "template <> void BinaryWriter::write(const " << type
+           << "& message);\n"
+              "}  // namespace scrump\n"
+              "\n";
+    if (!item.description.empty()) output << "// " << item.description << "\n";
+    output << "template <> struct " << type << " {";
+    if (item.fields.empty()) {
+      output << "};\n";
+      continue;
+    }
+    output << "\n";
+    bool first = true;
+    for (const Field& field : item.fields) {
+      if (field.kind == Field::ENUM) {
+        if (!first) output << "\n";
+        output << "  enum " << field.type << " {\n";
+        size_t width = 0;
+        for (const Value& value : field.values) {
+          width = max(width, value.name.length() + 3 +
+                                 to_string(value.value).length());
+        }
+        for (const Value& value : field.values) {
+          string entry = value.name + " = " + to_string(value.value) + ",";
+          output << "    " << entry;
+          if (!value.description.empty()) {
+            output << string(width + 1 - entry.length(), ' ') << "  // "
+                   << value.description;
+          }
+          output << "\n";
+        }
+        output << "  };\n"
+                  "\n";
+      }
+      output << "  " << fieldType(field) << " " << field.name
+             << (field.is_optional ? "{};" : ";");
+      if (!field.description.empty()) {
+        output << "  // " << field.description;
+      } else if (!field.condition_field.empty()) {
+        output << "  // Only if " << field.condition_field << " is "
+               << field.condition_value << ".";
+      }
+      output << "\n";
+      first = false;
+    }
+    output << "};\n";
+  }
+}
+
+static void writeEnumStrings(ostream& output, const Item& item,
+                             const Field& field) {
+  string type = qualifiedValueType(item, field);
+  string scope = "Message<" + item.name + ">::";
+  output << "static string toString(" << type << " value) {\n"
+            "  switch (value) {\n";
+  for (const Value& value : field.values) {
+    output << "    case " << scope << value.name << ": return \"" << value.name
+           << "\";\n";
+  }
+  output << "  }\n"
+            "  throw runtime_error(\"Bad " << item.name << " " << field.name
+         << ".\");\n"
+            "}\n"
+            "\n"
+            "static void decodeEnum(const DataNode& input, " << type
+         << "* output) {\n"
+            "  const string& name = input.asString();\n";
+  for (const Value& value : field.values) {
+    output << "  if (name == \"" << value.name << "\") {\n"
+              "    *output = " << scope << value.name << ";\n"
+              "    return;\n"
+              "  }\n";
+  }
+  output << "  throw runtime_error(\"Invalid " << item.name << " "
+         << field.name << ": \" + name);\n"
+            "}\n"
+            "\n";
+
+  // Values outside the enumeration are rejected, since other code switches
+  // over them.
+  output << "static bool fromValue(uint64_t value, " << type
+         << "* output) {\n"
+            "  switch (value) {\n";
+  for (const Value& value : field.values)
+    output << "    case " << scope << value.name << ":\n";
+  output << "      *output = static_cast<" << type << ">(value);\n"
+            "      return true;\n"
+            "  }\n"
+            "  return false;\n"
+            "}\n"
+            "\n"
+            "static bool readEnum(const char** position, const char* end, "
+         << type << "* output) {\n"
+            "  uint64_t value;\n"
+            "  return network::readVarUint(position, end, &value) &&\n"
+            "         fromValue(value, output);\n"
+            "}\n"
+            "\n";
+}
+
+static void writeSource(ostream& output, const vector<Item>& messages) {
+  output << "// AUTOMATICALLY GENERATED CODE - DO NOT EDIT.\n"
+            "\n"
+            "#include \"" << options::messages << ".h\"\n"
+            "\n"
+            "#include \"network.h\"\n"
+            "\n"
+            "#include <cstring>\n"
+            "#include <stdexcept>\n"
+            "\n"
+            "using namespace scrump;\n"
+            "using namespace std;\n";
+
+  for (const Item& item : messages) {
+    string type = "Message<" + item.name + ">";
+    output << "\n"
+              "// " << item.name << "\n";
+    for (const Field& field : item.fields)
+      if (field.kind == Field::ENUM) writeEnumStrings(output, item, field);
+
+    // JSON encoder.
+    output << "template <> DataNode network::encode(const " << type
+           << "& message) {\n";
+    if (item.fields.size() == 1 && item.fields[0].is_inline) {
+      const Field& field = item.fields[0];
+      if (field.is_list) {
+        output << "  DataNode::Array output;\n"
+                  "  for (const " << qualifiedValueType(item, field)
+               << "& entry : message." << field.name << ")\n"
+                  "    output.push_back(" << jsonEncodeValue(field, "entry")
+               << ");\n"
+                  "  return output;\n";
+      } else {
+        output << "  return " << jsonEncodeValue(field, "message." + field.name)
+               << ";\n";
+      }
+    } else {
+      output << "  DataNode::Object output;\n";
+      forEachField(output, item, "message.",
+                   [&](const Field& field, const string& indent) {
+        if (field.is_list) {
+          output << indent << "{\n"
+                 << indent << "  DataNode::Array values;\n"
+                 << indent << "  for (const " << qualifiedValueType(item, field)
+                 << "& entry : message." << field.name << ")\n"
+                 << indent << "    values.push_back("
+                 << jsonEncodeValue(field, "entry") << ");\n"
+                 << indent << "  output[\"" << field.name
+                 << "\"] = move(values);\n"
+                 << indent << "}\n";
+        } else {
+          output << indent << "output[\"" << field.name << "\"] = "
+                 << jsonEncodeValue(field, "message." + field.name) << ";\n";
+        }
+      });
+      output << "  return output;\n";
+    }
+    output << "}\n"
+              "\n";
+
+    // JSON decoder.
+    output << "template <> void network::decode(const DataNode& input, "
+           << type << "* message) {\n";
+    if (item.fields.size() == 1 && item.fields[0].is_inline) {
+      const Field& field = item.fields[0];
+      if (field.is_list) {
+        output << "  message->" << field.name << ".clear();\n"
+                  "  for (const DataNode& node : input.asArray()) {\n"
+                  "    " << qualifiedValueType(item, field) << " value;\n"
+                  "    " << jsonDecodeValue(field, "node", "value") << "\n"
+                  "    message->" << field.name << ".push_back(move(value));\n"
+                  "  }\n";
+      } else {
+        output << "  " << jsonDecodeValue(field, "input",
+                                          "message->" + field.name) << "\n";
+      }
+    } else if (!item.fields.empty()) {
+      output << "  DataNode::Object& object = input.asObject();\n";
+      forEachField(output, item, "message->",
+                   [&](const Field& field, const string& indent) {
+        string node = "object[\"" + field.name + "\"]";
+        if (field.is_list) {
+          output << indent << "message->" << field.name << ".clear();\n"
+                 << indent << "for (const DataNode& node : " << node
+                 << ".asArray()) {\n"
+                 << indent << "  " << qualifiedValueType(item, field)
+                 << " value;\n"
+                 << indent << "  " << jsonDecodeValue(field, "node", "value")
+                 << "\n"
+                 << indent << "  message->" << field.name
+                 << ".push_back(move(value));\n"
+                 << indent << "}\n";
+        } else {
+          output << indent
+                 << jsonDecodeValue(field, node, "message->" + field.name)
+                 << "\n";
+        }
+      }, [](const Field& field) {
+        return "object.count(\"" + field.name + "\") == 0";
+      });
+    }
+    output << "}\n"
+              "\n";
+
+    // Binary reader.
+    output << "template <> void BinaryReader::read(" << type
+           << "* message) {\n";
+    forEachField(output, item, "message->",
+                 [&](const Field& field, const string& indent) {
+      if (field.is_list) {
+        output << indent << "message->" << field.name << ".clear();\n"
+               << indent << "for (uint64_t i = readVarUint(); i > 0; i--) {\n"
+               << indent << "  " << qualifiedValueType(item, field)
+               << " value;\n"
+               << indent << "  " << readValue(item, field, "value") << "\n"
+               << indent << "  message->" << field.name
+               << ".push_back(move(value));\n"
+               << indent << "}\n";
+      } else {
+        output << indent << readValue(item, field, "message->" + field.name)
+               << "\n";
+      }
+    });
+    output << "}\n"
+              "\n";
+
+    // Binary writer.
+    output << "template <> void BinaryWriter::write(const " << type
+           << "& message) {\n";
+    forEachField(output, item, "message.",
+                 [&](const Field& field, const string& indent) {
+      if (field.is_list) {
+        output << indent << "writeVarUint(message." << field.name
+               << ".size());\n"
+               << indent << "for (const " << qualifiedValueType(item, field)
+               << "& entry : message." << field.name << ")\n"
+               << indent << "  " << writeValue(field, "entry") << "\n";
+      } else {
+        output << indent << writeValue(field, "message." + field.name) << "\n";
+      }
+    });
+    output << "}\n"
+              "\n";
+
+    // Exact binary size.
+    output << "template <> size_t network::encodedSize(const " << type
+           << "& message) {\n"
+              "  size_t size = 0;\n";
+    forEachField(output, item, "message.",
+                 [&](const Field& field, const string& indent) {
+      if (field.is_list) {
+        output << indent << "size += varUintSize(message." << field.name
+               << ".size());\n"
+               << indent << "for (const " << qualifiedValueType(item, field)
+               << "& entry : message." << field.name << ")\n"
+               << indent << "  size += " << sizeOfValue(field, "entry")
+               << ";\n";
+      } else {
+        output << indent << "size += "
+               << sizeOfValue(field, "message." + field.name) << ";\n";
+      }
+    });
+    output << "  return size;\n"
+              "}\n"
+              "\n";
+
+    // Binary writer into a buffer of encodedSize() bytes.
+    output << "template <> char* network::writeBinary(const " << type
+           << "& message, char* output) {\n";
+    forEachField(output, item, "message.",
+                 [&](const Field& field, const string& indent) {
+      if (field.is_list) {
+        output << indent << "output = writeVarUint(output, message."
+               << field.name << ".size());\n"
+               << indent << "for (const " << qualifiedValueType(item, field)
+               << "& entry : message." << field.name << ") {\n"
+               << indent << "  " << writeBinaryValue(field, "entry") << "\n"
+               << indent << "}\n";
+      } else {
+        output << indent << writeBinaryValue(field, "message." + field.name)
+               << "\n";
+      }
+    });
+    output << "  return output;\n"
+              "}\n"
+              "\n";
+
+    // Binary reader from an in-memory buffer. Each element of a list takes at
+    // least one byte, so a count larger than the rest of the buffer is
+    // rejected before anything is allocated.
+    output << "template <> bool network::readBinary(const char** position, "
+              "const char* end, " << type << "* message) {\n";
+    forEachField(output, item, "message->",
+                 [&](const Field& field, const string& indent) {
+      if (field.is_list) {
+        output << indent << "uint64_t " << field.name << "_size;\n"
+               << indent << "if (!readVarUint(position, end, &" << field.name
+               << "_size)) return false;\n"
+               << indent << "if (" << field.name << "_size > "
+               << "static_cast<uint64_t>(end - *position)) return false;\n"
+               << indent << "message->" << field.name << ".clear();\n"
+               << indent << "for (uint64_t i = 0; i < " << field.name
+               << "_size; i++) {\n"
+               << indent << "  " << qualifiedValueType(item, field)
+               << " value;\n"
+               << indent << "  if (!" << readBinaryValue(field, "value")
+               << ") return false;\n"
+               << indent << "  message->" << field.name
+               << ".push_back(move(value));\n"
+               << indent << "}\n";
+      } else {
+        output << indent << "if (!"
+               << readBinaryValue(field, "message->" + field.name)
+               << ") return false;\n";
+      }
+    }, [](const Field&) { return string("*position == end"); });
+    output << "  return true;\n"
+              "}\n";
+  }
+}
+
+// Check that the fields of each message refer only to things which exist.
+static bool checkMessages(const vector<Item>& messages) {
+  map<string, bool> declared;  // Message types declared so far.
+  set<string> empty_messages;   // Those which have no fields.
+  for (const Item& item : messages) {
+    map<string, const Field*> fields;
+    bool after_optional = false;
+    for (const Field& field : item.fields) {
+      string where = item.name + "." + field.name;
+      if (fields.count(field.name)) {
+        LOG(ERROR) << where << " is declared more than once.";
+        return false;
+      }
+      if (field.kind == Field::MESSAGE && !declared.count(field.type)) {
+        LOG(ERROR) << where << " has type " << field.type
+                   << ", which is not a message declared before it.";
+        return false;
+      }
+      if (field.kind == Field::ENUM && field.values.empty()) {
+        LOG(ERROR) << where << " has type " << field.type
+                   << ", which is neither a message nor an enum with values.";
+        return false;
+      }
+      if (field.kind == Field::MESSAGE && field.is_list &&
+          empty_messages.count(field.type)) {
+        LOG(ERROR) << where << " is a list of " << field.type
+                   << ", which has no fields.";
+        return false;
+      }
+      if (after_optional && !field.is_optional) {
+        LOG(ERROR) << where << " follows an optional field, but is required.";
+        return false;
+      }
+      after_optional = field.is_optional;
+      if (field.is_inline && item.fields.size() != 1) {
+        LOG(ERROR) << where << " is inline, but is not the only field.";
+        return false;
+      }
+      if (!field.condition_field.empty()) {
+        auto i = fields.find(field.condition_field);
+        bool found = false;
+        if (i != fields.end() && i->second->kind == Field::ENUM &&
+            !i->second->is_list) {
+          for (const Value& value : i->second->values)
+            found = found || value.name == field.condition_value;
+        }
+        if (!found) {
+          LOG(ERROR) << where << " depends on " << field.condition_field
+                     << " being " << field.condition_value
+                     << ", which is not a value of an earlier enum field.";
+          return false;
+        }
+      }
+      fields[field.name] = &field;
+    }
+    declared[item.name] = true;
+    if (item.fields.empty()) empty_messages.insert(item.name);
+  }
+  return true;
+}
+
 int scrump_main(int argc, char* args[]) {
   // Verify that the output name is a valid enumeration name.
   regex enum_name_syntax(R"([A-Za-z][A-Za-z0-9_]*)");
@@ -75,9 +733,11 @@ int scrump_main(int argc, char* args[]) {
 
   // Generate the enum mapping.
   vector<Item> enumeration;
+  const bool with_messages = !options::messages.empty();
 
   int line_number = 0;  // Incremented on each line read, for error messages.
   int64_t index = 0;    // Incremented for each item, reset by explicit values.
+  int64_t value_index = 0;  // As index, for the values of a nested enum.
   string line;
   // 1 = Enumeration item.
   // 2 = Identifier.
@@ -96,12 +756,85 @@ int scrump_main(int argc, char* args[]) {
       R"()?)"
       //    5    6  65
       R"(\s*(#\s*(.*))?)");
+  // With --messages, a line indented by two spaces is a field.
+  // 1 = Inline or optional marker (optional).
+  // 2 = Type.
+  // 3 = List brackets (optional).
+  // 4 = Field name.
+  // 5 = Condition (optional).
+  // 6 = Condition field.
+  // 7 = Condition value.
+  // 8 = Description (optional).
+  // 9 = Description text.
+  regex field_syntax(
+      //   1                        2                     2 3    3
+      R"(  (inline\s+|optional\s+)?([A-Za-z][A-Za-z0-9_]*)(\[\])?\s+)"
+      // 4                 4
+      R"(([a-z][a-z0-9_]*))"
+      // 5        6                 6             7                     7  5
+      R"((\s+if\s+([a-z][a-z0-9_]*)\s*==\s*([A-Za-z][A-Za-z0-9_]*))?)"
+      //    8    9  98
+      R"(\s*(#\s*(.*))?)");
   int max_enum_name_length = 0;  // Longest enumeration item name length.
   int max_enum_id_length = 0;    // Longest decimal representation of an id.
   while (getline(input, line)) {
     line_number++;
-    // Match the line to the syntax pattern.
     smatch result;
+
+    // Fields, and the values of nested enums, belong to the latest item.
+    if (with_messages && line.compare(0, 2, "  ") == 0 &&
+        line.find_first_not_of(" ") != string::npos &&
+        line[line.find_first_not_of(" ")] != '#') {
+      Field* field = nullptr;
+      if (!enumeration.empty() && !enumeration.back().fields.empty())
+        field = &enumeration.back().fields.back();
+      if (line.compare(0, 4, "    ") == 0) {
+        if (field == nullptr || field->kind != Field::ENUM ||
+            !regex_match(line, result, line_syntax) ||
+            result[1].length() == 0) {
+          LOG(ERROR) << options::input << ": Syntax error on line "
+                     << line_number << "\n  " << line;
+          return 1;
+        }
+        Value value;
+        value.name = result[2];
+        if (result[3].length() != 0) value_index = stoll(result[4], 0, 0);
+        value.value = value_index++;
+        if (result[5].length() != 0) value.description = result[6];
+        field->values.push_back(value);
+        continue;
+      }
+      if (enumeration.empty() || !regex_match(line, result, field_syntax)) {
+        LOG(ERROR) << options::input << ": Syntax error on line "
+                   << line_number << "\n  " << line;
+        return 1;
+      }
+      Field next;
+      next.is_inline = result[1].str().compare(0, 6, "inline") == 0;
+      next.is_optional = result[1].str().compare(0, 8, "optional") == 0;
+      next.type = result[2];
+      next.is_list = result[3].length() != 0;
+      next.name = result[4];
+      if (result[5].length() != 0) {
+        next.condition_field = result[6];
+        next.condition_value = result[7];
+      }
+      if (result[8].length() != 0) next.description = result[9];
+      if (next.type == "uint64") {
+        next.kind = Field::UINT64;
+      } else if (next.type == "string") {
+        next.kind = Field::STRING;
+      } else if (regex_match(next.type, regex("[A-Z][A-Z0-9_]*"))) {
+        next.kind = Field::MESSAGE;
+      } else {
+        next.kind = Field::ENUM;
+        value_index = 0;
+      }
+      enumeration.back().fields.push_back(next);
+      continue;
+    }
+
+    // Match the line to the syntax pattern.
     if (!regex_match(line, result, line_syntax)) {
       LOG(ERROR) << options::input << ": Syntax error on line " << line_number
                  << "\n  " << line;
@@ -128,6 +861,7 @@ int scrump_main(int argc, char* args[]) {
         max_enum_id_length = id_length;
     }
   }
+  if (with_messages && !checkMessages(enumeration)) return 1;
 
   // Construct the header file.
   ofstream output(options::output + ".h");
@@ -204,7 +938,31 @@ int scrump_main(int argc, char* args[]) {
             "  *output = i->second;\n"
             "  return true;\n"
             "}\n";
+  output.close();
   LOG(INFO) << options::output << ".cc generated.";
 
+  if (!with_messages) return 0;
+
+  // Construct the message header and source files.
+  output.open(options::messages + ".h");
+  if (!output.good()) {
+    LOG(ERROR) << "Failed to open header file '" << options::messages
+               << ".h' for output.";
+    return 1;
+  }
+  writeHeader(output, enumeration);
+  output.close();
+  LOG(INFO) << options::messages << ".h generated.";
+
+  output.open(options::messages + ".cc");
+  if (!output.good()) {
+    LOG(ERROR) << "Failed to open source file '" << options::messages
+               << ".cc' for output.";
+    return 1;
+  }
+  writeSource(output, enumeration);
+  output.close();
+  LOG(INFO) << options::messages << ".cc generated.";
+
   return 0;
 }
@@ -0,0 +1,155 @@
+// Prints every message broadcast by a server on the same host, read from the
+// server's shared-memory ring. This is intended as a starting point for local
+// bots which need to see the full message stream. Under load, it also reports
+// how many system calls the server makes to broadcast each message.
+
+#include "network.h"
+#include "shm_ring.h"
+#include "unix_socket.h"
+
+#include <chrono>
+#include <iostream>
+#include <scrump/args.h>
+#include <scrump/binary.h>
+#include <scrump/logging.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace scrump;
+using namespace std;
+
+USAGE("Usage: firehose --unix_socket <path>\n"
+      "\n"
+      "  path - Path of the server's Unix domain socket.");
+
+OPTION(string, unix_socket, "", "Path of the server's Unix domain socket.");
+OPTION(int, stats_interval, 10,
+       "Interval between reports of the server's broadcast statistics, in "
+       "seconds. 0 disables the reports.");
+
+struct Stats {
+  uint64_t broadcasts = 0;
+  uint64_t syscalls = 0;
+  string backend;
+};
+
+// Ask the server how many messages it has broadcast, and how many system calls
+// it has made sending them.
+static Stats readStats() {
+  int fd = connectUnix(options::unix_socket);
+  string reply;
+  try {
+    string request = "STATS\n";
+    if (send(fd, request.data(), request.length(), MSG_NOSIGNAL) < 0)
+      throw runtime_error("Failed to send request.");
+    char buffer[256];
+    ssize_t length;
+    while ((length = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+      reply.append(buffer, length);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+
+  Stats stats;
+  string header;
+  istringstream input(reply);
+  if (!(input >> header >> stats.broadcasts >> stats.syscalls >>
+        stats.backend) ||
+      header != "STATS") {
+    throw runtime_error("Unexpected statistics from server.");
+  }
+  return stats;
+}
+
+// Log the system calls per broadcast over each interval.
+static void reportStats() {
+  Stats last;
+  bool first = true;
+  while (true) {
+    try {
+      Stats stats = readStats();
+      uint64_t broadcasts = stats.broadcasts - last.broadcasts;
+      uint64_t syscalls = stats.syscalls - last.syscalls;
+      if (!first && broadcasts > 0) {
+        LOG(INFO) << broadcasts << " broadcasts, " << syscalls
+                  << " send syscalls ("
+                  << static_cast<double>(syscalls) / broadcasts
+                  << " per broadcast, " << stats.backend << ").";
+      }
+      last = stats;
+      first = false;
+    } catch (const exception& error) {
+      LOG(WARNING) << "Failed to read statistics: " << error.what();
+    }
+    this_thread::sleep_for(chrono::seconds(options::stats_interval));
+  }
+}
+
+int scrump_main(int argc, char* args[]) {
+  // Ask the server for its ring.
+  int fd = -1;
+  vector<int> descriptors;
+  try {
+    fd = connectUnix(options::unix_socket);
+    string request = "SHM\n";
+    if (send(fd, request.data(), request.length(), MSG_NOSIGNAL) < 0)
+      throw runtime_error("Failed to send request.");
+    if (receiveDescriptors(fd, &descriptors) != "SHM\n" ||
+        descriptors.size() != 2) {
+      throw runtime_error("Unexpected response from server.");
+    }
+  } catch (const exception& error) {
+    LOG(ERROR) << error.what();
+    return 1;
+  }
+  ShmRingReader ring(descriptors[0], descriptors[1]);
+
+  // Exit once the server goes away.
+  thread([fd] {
+    char buffer[256];
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0) continue;
+    LOG(INFO) << "Server closed the connection.";
+    _exit(0);
+  }).detach();
+
+  if (options::stats_interval > 0) thread(reportStats).detach();
+
+  string frame;
+  uint64_t overruns = 0;
+  while (true) {
+    ring.next(&frame);
+    if (ring.overruns() != overruns) {
+      LOG(WARNING) << "Fell behind the server. Some messages were missed.";
+      overruns = ring.overruns();
+    }
+
+    // Each frame is a complete binary message.
+    const char* position = frame.data();
+    const char* end = position + frame.length();
+    uint64_t type, length;
+    if (!network::readVarUint(&position, end, &type) ||
+        !network::readVarUint(&position, end, &length) ||
+        length != static_cast<uint64_t>(end - position) ||
+        type != RECEIVE_MESSAGE) {
+      LOG(WARNING) << "Skipping unexpected frame.";
+      continue;
+    }
+    ChatMessage message = deserialize<ChatMessage>(string(position, length));
+    switch (message.category) {
+      case ChatMessage::NOTICE:
+        cout << message.message_id << " * " << message.text << "\n";
+        break;
+      case ChatMessage::CHAT_MESSAGE:
+        cout << message.message_id << " <" << message.sender_name << "> "
+             << message.text << "\n";
+        break;
+    }
+    cout << flush;
+  }
+}
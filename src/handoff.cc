@@ -0,0 +1,103 @@
+#include "handoff.h"
+
+#include "unix_socket.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+// Each fragment starts with one of these.
+static const char LAST_FRAGMENT = 0;
+static const char MORE_FRAGMENTS = 1;
+
+void HandoffWriter::start(HandoffRecord type) {
+  record_.clear();
+  descriptors_.clear();
+  network::appendVarUint(&record_, type);
+}
+
+void HandoffWriter::addString(const string& value) {
+  network::appendVarUint(&record_, value.length());
+  record_ += value;
+}
+
+void HandoffWriter::addMessage(const ChatMessage& message) {
+  size_t size = network::encodedSize(message);
+  network::appendVarUint(&record_, size);
+  size_t offset = record_.length();
+  record_.resize(offset + size);
+  network::writeBinary(message, &record_[offset]);
+}
+
+void HandoffWriter::send() {
+  size_t offset = 0;
+  string fragment;
+  do {
+    size_t length = min(record_.length() - offset, HANDOFF_RECORD_SIZE);
+    bool last = offset + length == record_.length();
+    fragment.assign(1, last ? LAST_FRAGMENT : MORE_FRAGMENTS);
+    fragment.append(record_, offset, length);
+    sendDescriptors(fd_, fragment, offset == 0 ? descriptors_ : vector<int>());
+    offset += length;
+  } while (offset < record_.length());
+}
+
+void HandoffWriter::sendMessages(HandoffRecord type, const ChatMessage* begin,
+                                 const ChatMessage* end) {
+  start(type);
+  size_t empty_size = size();
+  for (const ChatMessage* message = begin; message != end; message++) {
+    // A record is sent before it would overflow, rather than after, so only a
+    // single message larger than a record makes one larger.
+    size_t message_size = network::encodedSize(*message);
+    if (size() > empty_size &&
+        size() + network::varUintSize(message_size) + message_size >
+            HANDOFF_RECORD_SIZE) {
+      send();
+      start(type);
+    }
+    addMessage(*message);
+  }
+  send();
+}
+
+string receiveHandoffRecord(int fd, vector<int>* descriptors) {
+  string record;
+  while (true) {
+    string fragment = receiveDescriptors(fd, descriptors);
+    if (fragment.empty()) {
+      if (record.empty()) return record;
+      throw runtime_error("Handoff ended part way through a record.");
+    }
+    record.append(fragment, 1, string::npos);
+    if (fragment[0] == LAST_FRAGMENT) return record;
+    if (fragment[0] != MORE_FRAGMENTS)
+      throw runtime_error("Invalid handoff fragment.");
+  }
+}
+
+uint64_t HandoffReader::readVarUint() {
+  uint64_t value;
+  if (!network::readVarUint(&position_, end_, &value))
+    throw runtime_error("Truncated handoff record.");
+  return value;
+}
+
+string HandoffReader::readString() {
+  string value;
+  if (!network::readString(&position_, end_, &value))
+    throw runtime_error("Truncated handoff record.");
+  return value;
+}
+
+ChatMessage HandoffReader::readMessage() {
+  uint64_t length = readVarUint();
+  if (length > static_cast<uint64_t>(end_ - position_))
+    throw runtime_error("Truncated handoff record.");
+  const char* end = position_ + length;
+  ChatMessage message;
+  if (!network::readBinary(&position_, end, &message) || position_ != end)
+    throw runtime_error("Invalid message in handoff.");
+  return message;
+}
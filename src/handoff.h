@@ -0,0 +1,89 @@
+#pragma once
+
+#include "network.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// During a hot restart, the old server sends its state to the new server as a
+// sequence of records on a SOCK_SEQPACKET socket. Each record is a varuint
+// record type, followed by varuints and length-prefixed strings. Descriptors
+// are attached to the records which carry them.
+//
+// A record may be of any size, since it is sent as a series of fragments which
+// each fit in a single packet. Each fragment is a byte which is 1 if more of
+// the record follows and 0 otherwise, then the next part of the record. Any
+// descriptors are attached to the first fragment.
+enum HandoffRecord : uint64_t {
+  HANDOFF_LISTENER,      // <kind>, with the listener attached.
+  HANDOFF_RING,          // With the shared-memory ring attached.
+  HANDOFF_RING_READERS,  // With connections to ring readers attached.
+  HANDOFF_CONNECTIONS,   // Per connection: <is_peer> <mode> <address> <name>
+                         // <capture_id>.
+  HANDOFF_BUFFERED,      // <connection index> <data>: unparsed received data.
+  HANDOFF_NEXT_ID,       // <next_id>
+  HANDOFF_HISTORY,       // Per message: <binary RECEIVE_MESSAGE payload>.
+  HANDOFF_PENDING,       // Unsequenced messages, as for HANDOFF_HISTORY.
+  HANDOFF_END,
+  HANDOFF_FRESH,  // Per connection: <kind>, for those without a header yet.
+  HANDOFF_QUEUED,  // <connection index> <data>: frames not yet written.
+  HANDOFF_CAPTURE,  // <path> <last_connection> <last_time>, with the file.
+};
+
+// Also the kind of listener a connection was accepted by.
+enum ListenerKind : uint64_t { TCP_LISTENER, PEER_LISTENER, UNIX_LISTENER };
+
+// Records are split into fragments of at most this size, well within
+// MAX_MESSAGE_SIZE. Records of many items are filled up to about this size.
+const size_t HANDOFF_RECORD_SIZE = 32768;
+
+class HandoffWriter {
+ public:
+  HandoffWriter(int fd) : fd_(fd) {}
+
+  void start(HandoffRecord type);
+
+  void addVarUint(uint64_t value) { network::appendVarUint(&record_, value); }
+  void addString(const std::string& value);
+  void addMessage(const ChatMessage& message);
+  void addDescriptor(int fd) { descriptors_.push_back(fd); }
+
+  size_t size() const { return record_.length(); }
+  size_t numDescriptors() const { return descriptors_.size(); }
+
+  void send();
+
+  // Send messages as records of the given type, packed into as few records
+  // as possible.
+  void sendMessages(HandoffRecord type, const ChatMessage* begin,
+                    const ChatMessage* end);
+
+ private:
+  int fd_;
+  std::string record_;
+  std::vector<int> descriptors_;
+};
+
+// Receive a whole record sent by HandoffWriter::send(), appending any attached
+// descriptors to *descriptors. Returns an empty string at the end of the
+// stream.
+std::string receiveHandoffRecord(int fd, std::vector<int>* descriptors);
+
+// Reads the fields of a record. These throw if the record is malformed.
+class HandoffReader {
+ public:
+  HandoffReader(const std::string& record)
+      : position_(record.data()), end_(record.data() + record.length()) {}
+
+  uint64_t readVarUint();
+  std::string readString();
+  ChatMessage readMessage();
+
+  bool done() const { return position_ == end_; }
+
+ private:
+  const char* position_;
+  const char* end_;
+};
@@ -0,0 +1,208 @@
+#include "history_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Identifies the file format. Caches with any other header are discarded.
+static const char HEADER[] = "CHATLOG1";
+static const size_t HEADER_SIZE = sizeof(HEADER) - 1;
+
+static runtime_error systemError(const string& message) {
+  return runtime_error(message + ": " + strerror(errno));
+}
+
+static bool writeAll(int fd, const char* data, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    length -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Parse the record at [*position, end), advancing *position past it. Returns
+// false if it is incomplete or corrupt.
+static bool readRecord(const char** position, const char* end,
+                       ChatMessage* message) {
+  uint64_t length;
+  if (!network::readVarUint(position, end, &length) ||
+      length > static_cast<uint64_t>(end - *position)) {
+    return false;
+  }
+  const char* payload = *position;
+  *position += length;
+  return network::readBinary(&payload, *position, message);
+}
+
+HistoryCache::HistoryCache(const string& filename, size_t max_messages)
+    : filename_(filename), max_messages_(max(max_messages, size_t{1})) {
+  fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) throw systemError("Failed to open " + filename);
+  try {
+    load();
+  } catch (...) {
+    unmap();
+    close(fd_);
+    throw;
+  }
+}
+
+void HistoryCache::load() {
+  struct stat info;
+  if (fstat(fd_, &info) < 0) throw systemError("Failed to stat " + filename_);
+  size_ = info.st_size;
+  remap();
+
+  // Check the header, and start afresh if it is missing or unrecognised.
+  if (size_ < HEADER_SIZE || memcmp(data_, HEADER, HEADER_SIZE) != 0) {
+    clear();
+    return;
+  }
+
+  // Index the records, stopping at the first incomplete or corrupt one.
+  const char* end = data_ + size_;
+  const char* position = data_ + HEADER_SIZE;
+  const char* valid_end = position;
+  ChatMessage message;
+  while (position < end && readRecord(&position, end, &message)) {
+    offsets_[message.message_id] = valid_end - data_;
+    valid_end = position;
+  }
+
+  // Drop anything after the last valid record.
+  if (valid_end != end) {
+    size_ = valid_end - data_;
+    if (ftruncate(fd_, size_) < 0)
+      throw systemError("Failed to truncate history cache");
+  }
+  if (offsets_.size() > max_messages_) compact();
+}
+
+HistoryCache::~HistoryCache() {
+  unmap();
+  if (fd_ >= 0) close(fd_);
+}
+
+bool HistoryCache::contains(uint64_t message_id) const {
+  return offsets_.count(message_id) != 0;
+}
+
+uint64_t HistoryCache::lastId() const {
+  return offsets_.rbegin()->first;
+}
+
+bool HistoryCache::get(uint64_t message_id, ChatMessage* message) {
+  auto i = offsets_.find(message_id);
+  if (i == offsets_.end()) return false;
+  *message = read(i->second);
+  return true;
+}
+
+vector<ChatMessage> HistoryCache::recent(uint64_t num_messages) {
+  vector<ChatMessage> messages;
+  auto i = offsets_.end();
+  while (messages.size() < num_messages && i != offsets_.begin()) {
+    i--;
+    messages.push_back(read(i->second));
+  }
+  return vector<ChatMessage>(messages.rbegin(), messages.rend());
+}
+
+bool HistoryCache::add(const ChatMessage& message) {
+  if (contains(message.message_id)) return false;
+
+  string payload = network::serialize(message);
+  string record;
+  network::appendVarUint(&record, payload.length());
+  record += payload;
+
+  if (!writeAll(fd_, record.data(), record.length(), size_))
+    throw systemError("Failed to write to history cache");
+  offsets_[message.message_id] = size_;
+  size_ += record.length();
+  if (offsets_.size() >= 2 * max_messages_) compact();
+  return true;
+}
+
+void HistoryCache::clear() {
+  unmap();
+  offsets_.clear();
+  if (ftruncate(fd_, 0) < 0 || !writeAll(fd_, HEADER, HEADER_SIZE, 0))
+    throw systemError("Failed to reset history cache");
+  size_ = HEADER_SIZE;
+}
+
+void HistoryCache::compact() {
+  if (mapped_size_ < size_) remap();
+
+  // Copy the newest records into a new file, then replace the old one.
+  auto first = offsets_.end();
+  for (size_t i = 0; i < max_messages_ && first != offsets_.begin(); i++)
+    first--;
+  string data(HEADER, HEADER_SIZE);
+  map<uint64_t, size_t> offsets;
+  for (auto i = first; i != offsets_.end(); i++) {
+    const char* start = data_ + i->second;
+    const char* position = start;
+    ChatMessage message;
+    readRecord(&position, data_ + size_, &message);
+    offsets[i->first] = data.length();
+    data.append(start, position);
+  }
+
+  string temporary = filename_ + ".tmp";
+  int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0600);
+  if (fd < 0) throw systemError("Failed to open " + temporary);
+  if (!writeAll(fd, data.data(), data.length(), 0) ||
+      rename(temporary.c_str(), filename_.c_str()) < 0) {
+    close(fd);
+    unlink(temporary.c_str());
+    throw systemError("Failed to compact history cache");
+  }
+  unmap();
+  close(fd_);
+  fd_ = fd;
+  size_ = data.length();
+  offsets_.swap(offsets);
+}
+
+void HistoryCache::remap() {
+  if (mapped_size_ >= size_) return;
+  unmap();
+  if (size_ == 0) return;
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) throw systemError("Failed to map history cache");
+  data_ = static_cast<const char*>(data);
+  mapped_size_ = size_;
+}
+
+void HistoryCache::unmap() {
+  if (data_ == nullptr) return;
+  munmap(const_cast<char*>(data_), mapped_size_);
+  data_ = nullptr;
+  mapped_size_ = 0;
+}
+
+ChatMessage HistoryCache::read(size_t offset) {
+  // Records appended since the last mapping are not visible until remapped.
+  if (mapped_size_ < size_) remap();
+  const char* position = data_ + offset;
+  ChatMessage message;
+  if (!readRecord(&position, data_ + mapped_size_, &message))
+    throw runtime_error("Corrupt record in history cache.");
+  return message;
+}
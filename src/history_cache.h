@@ -0,0 +1,73 @@
+#pragma once
+
+#include "network.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// An on-disk log of received chat messages, keyed by message ID. The file is
+// memory-mapped for reading, and new messages are appended to the end of it.
+//
+// Each record is stored as:
+//
+//   <varuint length> <bytes[length] RECEIVE_MESSAGE binary payload>
+//
+// A truncated or corrupt record (for instance, from a crash part way through
+// an append) is discarded when the cache is opened, along with everything
+// after it.
+//
+// Only the newest max_messages are kept. Once the file holds twice that many,
+// it is rewritten without the oldest, so the file and the index of it stay
+// bounded.
+class HistoryCache {
+ public:
+  HistoryCache(const std::string& filename, size_t max_messages);
+  ~HistoryCache();
+
+  HistoryCache(const HistoryCache&) = delete;
+  HistoryCache& operator=(const HistoryCache&) = delete;
+
+  bool empty() const { return offsets_.empty(); }
+  bool contains(uint64_t message_id) const;
+
+  // ID of the newest message in the cache. Must not be called if empty.
+  uint64_t lastId() const;
+
+  // Fetch a single message from the cache. Returns false if it is absent.
+  bool get(uint64_t message_id, ChatMessage* message);
+
+  // Fetch up to num_messages of the newest messages, oldest first.
+  std::vector<ChatMessage> recent(uint64_t num_messages);
+
+  // Append a message to the cache. Returns false if it was already present.
+  bool add(const ChatMessage& message);
+
+  // Discard all cached messages.
+  void clear();
+
+ private:
+  // Ensure that the mapping covers the whole file.
+  void remap();
+  void unmap();
+
+  // Index the records in the file, and truncate it after the last valid one.
+  void load();
+
+  // Rewrite the file with only the newest max_messages_.
+  void compact();
+
+  // The record at offset, which must have been validated by load().
+  ChatMessage read(size_t offset);
+
+  const std::string filename_;
+  const size_t max_messages_;
+  int fd_ = -1;
+  size_t size_ = 0;  // Length of the valid portion of the file.
+
+  const char* data_ = nullptr;
+  size_t mapped_size_ = 0;
+
+  std::map<uint64_t, size_t> offsets_;  // Message ID -> record offset.
+};
@@ -0,0 +1,213 @@
+// Measures the memory that a server uses for each idle connection. This starts
+// a server, opens each requested number of connections to it in turn, and
+// reports the growth in the server's resident memory divided by the number of
+// connections.
+//
+// Connections come from a range of loopback addresses, so that large counts
+// do not run out of ephemeral ports. Each needs a descriptor in this process
+// and in the server, so the descriptor limit must allow for that. The server
+// also runs a thread per connection, each with its own stack mapping, so at
+// 100000 connections kernel.threads-max and vm.max_map_count must be raised
+// above their usual defaults.
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <scrump/args.h>
+#include <scrump/logging.h>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace scrump;
+using namespace std;
+
+USAGE("Usage: idle_benchmark [--server <path>] [--counts <n,n,...>]\n"
+      "\n"
+      "  path - Server binary to measure.\n"
+      "  n    - Numbers of idle connections to measure with.");
+
+OPTION(string, server, "bin/server", "Server binary to measure.");
+OPTION(int, port, 27994, "Port for the server to listen on.");
+OPTION(string, counts, "10000,100000",
+       "Comma-separated numbers of idle connections to measure with.");
+OPTION(int, settle_seconds, 2,
+       "Time to let the server settle before each measurement, in seconds.");
+
+// Connections per source address, well below the number of ephemeral ports.
+const int CONNECTIONS_PER_ADDRESS = 20000;
+
+// Time to wait for the server to start, or to accept every connection.
+const chrono::seconds STARTUP_TIMEOUT(10), ACCEPT_TIMEOUT(120);
+
+// Read a field from /proc/<pid>/status, such as VmRSS (in kB) or Threads.
+static int64_t readStatus(pid_t pid, const string& field) {
+  ifstream status("/proc/" + to_string(pid) + "/status");
+  string line;
+  while (getline(status, line)) {
+    if (line.compare(0, field.length() + 1, field + ":") != 0) continue;
+    return stoll(line.substr(field.length() + 1));
+  }
+  throw runtime_error("No " + field + " for process " + to_string(pid) + ".");
+}
+
+static pid_t startServer() {
+  pid_t pid = fork();
+  if (pid < 0)
+    throw runtime_error("Failed to fork: " + string(strerror(errno)));
+  if (pid == 0) {
+    // Notices about connections would be broadcast to every connection.
+    string port = to_string(options::port);
+    execl(options::server.c_str(), options::server.c_str(), "--host",
+          "127.0.0.1", "--port", port.c_str(), "--connection_notices", "false",
+          "--idle_timeout", "0", "--stats_interval", "0", nullptr);
+    cerr << "Failed to run " << options::server << ": " << strerror(errno)
+         << "\n";
+    _exit(1);
+  }
+  return pid;
+}
+
+// Open a connection from the given loopback address. Returns -1 on failure.
+static int connectFrom(uint32_t source) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(source);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  address.sin_port = htons(options::port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const char header[] = "BINARY\n";
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+      send(fd, header, sizeof(header) - 1, MSG_NOSIGNAL) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void closeAll(vector<int>* connections) {
+  for (int fd : *connections) close(fd);
+  connections->clear();
+}
+
+// The server runs a thread per connection, so it has accepted every
+// connection once it has that many more threads.
+static bool waitForThreads(pid_t pid, int64_t threads) {
+  auto deadline = chrono::steady_clock::now() + ACCEPT_TIMEOUT;
+  while (readStatus(pid, "Threads") < threads) {
+    if (chrono::steady_clock::now() > deadline) return false;
+    this_thread::sleep_for(chrono::milliseconds(100));
+  }
+  return true;
+}
+
+static int64_t measure(pid_t pid, int64_t base_threads, int count) {
+  vector<int> connections;
+  connections.reserve(count);
+  for (int i = 0; i < count; i++) {
+    // 127.0.0.2 onwards, as the server listens on 127.0.0.1.
+    uint32_t source = INADDR_LOOPBACK + 1 + i / CONNECTIONS_PER_ADDRESS;
+    int fd = connectFrom(source);
+    if (fd < 0) {
+      LOG(ERROR) << "Failed to open connection " << i + 1 << " of " << count
+                 << ": " << strerror(errno);
+      closeAll(&connections);
+      return -1;
+    }
+    connections.push_back(fd);
+  }
+  if (!waitForThreads(pid, base_threads + count)) {
+    LOG(ERROR) << "The server did not accept all " << count
+               << " connections in time.";
+    closeAll(&connections);
+    return -1;
+  }
+  this_thread::sleep_for(chrono::seconds(options::settle_seconds));
+  int64_t rss = readStatus(pid, "VmRSS");
+  closeAll(&connections);
+
+  // Wait for the server to finish with the connections before the next run.
+  auto deadline = chrono::steady_clock::now() + ACCEPT_TIMEOUT;
+  while (readStatus(pid, "Threads") > base_threads &&
+         chrono::steady_clock::now() < deadline) {
+    this_thread::sleep_for(chrono::milliseconds(100));
+  }
+  return rss;
+}
+
+int scrump_main(int argc, char* args[]) {
+  vector<int> counts;
+  stringstream list(options::counts);
+  string count;
+  while (getline(list, count, ',')) counts.push_back(stoi(count));
+
+  // Both ends of each connection are in this process, so it needs a descriptor
+  // for each connection, as does the server.
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  LOG(INFO) << "Descriptor limit is " << limit.rlim_cur << ".";
+
+  pid_t pid = startServer();
+  int status = 0;
+  int64_t base_threads = 0, base_rss = 0;
+  auto deadline = chrono::steady_clock::now() + STARTUP_TIMEOUT;
+  while (true) {
+    this_thread::sleep_for(chrono::milliseconds(500));
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      LOG(ERROR) << "The server exited.";
+      return 1;
+    }
+    // The server is ready once it accepts a connection.
+    int fd = connectFrom(INADDR_LOOPBACK + 1);
+    if (fd >= 0) {
+      close(fd);
+      break;
+    }
+    if (chrono::steady_clock::now() > deadline) {
+      LOG(ERROR) << "The server did not start in time.";
+      kill(pid, SIGKILL);
+      return 1;
+    }
+  }
+  this_thread::sleep_for(chrono::seconds(options::settle_seconds));
+  base_threads = readStatus(pid, "Threads");
+  base_rss = readStatus(pid, "VmRSS");
+  cout << "Baseline: " << base_rss << " kB resident, " << base_threads
+       << " threads\n";
+
+  bool failed = false;
+  for (int count : counts) {
+    int64_t rss = measure(pid, base_threads, count);
+    if (rss < 0) {
+      failed = true;
+      break;
+    }
+    double per_connection = (rss - base_rss) * 1024.0 / count;
+    cout << setw(8) << count << " idle connections: " << setw(10) << rss
+         << " kB resident, " << fixed << setprecision(0) << per_connection
+         << " bytes per connection\n" << flush;
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  return failed ? 1 : 0;
+}
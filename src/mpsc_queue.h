@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// A lock-free queue with any number of producers and a single consumer.
+// Pushing is a single compare-and-swap loop, so producers never wait for each
+// other or for the consumer. The consumer takes everything queued at once.
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() = default;
+  ~MpscQueue();
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  // Add a value to the queue. Returns true if the queue was previously empty,
+  // in which case the consumer may need waking.
+  bool push(T value);
+
+  // Append every queued value to *output, in the order they were pushed.
+  void popAll(std::vector<T>* output);
+
+  bool empty() const { return head_.load() == nullptr; }
+
+ private:
+  struct Node {
+    T value;
+    Node* next;
+  };
+
+  // The most recently pushed node. Nodes link towards older ones.
+  std::atomic<Node*> head_{nullptr};
+};
+
+template <typename T>
+MpscQueue<T>::~MpscQueue() {
+  Node* node = head_.load();
+  while (node != nullptr) {
+    Node* next = node->next;
+    delete node;
+    node = next;
+  }
+}
+
+template <typename T>
+bool MpscQueue<T>::push(T value) {
+  Node* node =
+      new Node{std::move(value), head_.load(std::memory_order_relaxed)};
+  while (!head_.compare_exchange_weak(node->next, node,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+    continue;
+  }
+  return node->next == nullptr;
+}
+
+template <typename T>
+void MpscQueue<T>::popAll(std::vector<T>* output) {
+  Node* node = head_.exchange(nullptr, std::memory_order_acquire);
+
+  // The nodes are newest first, so fill the output from the back.
+  std::size_t count = 0;
+  for (Node* i = node; i != nullptr; i = i->next) count++;
+  std::size_t start = output->size();
+  output->resize(start + count);
+  for (std::size_t i = start + count; i > start; i--) {
+    (*output)[i - 1] = std::move(node->value);
+    Node* next = node->next;
+    delete node;
+    node = next;
+  }
+}
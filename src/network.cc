@@ -1,300 +1,432 @@
 #include "network.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <poll.h>
 #include <scrump/data_node.h>
 #include <scrump/logging.h>
 #include <scrump/json.h>
 #include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 
 using namespace std;
 using namespace scrump;
 
-#define ENCODER(name)  \
-  template <> scrump::DataNode network::encode(const Message<name>& message)
-#define DECODER(name)  \
-  template <> void network::decode(  \
-      const DataNode& input, Message<name>* message)
-#define READER(name)  \
-  template <> void scrump::BinaryReader::read(Message<name>* message)
-#define WRITER(name)  \
-  template <> void scrump::BinaryWriter::write(const Message<name>& message)
-
-// IDENTIFY
-ENCODER(IDENTIFY) {
-  return DataNode::Object{{"display_name", message.display_name}};
-}
-
-DECODER(IDENTIFY) {
-  message->display_name = input.asObject()["display_name"].asString();
-}
-
-READER(IDENTIFY) {
-  message->display_name = readString();
+bool operator==(const ChatMessage& a, const ChatMessage& b) {
+  return a.message_id == b.message_id && a.category == b.category &&
+         a.sender_name == b.sender_name && a.text == b.text;
 }
 
-WRITER(IDENTIFY) {
-  writeString(message.display_name);
+void network::appendVarUint(string* output, uint64_t value) {
+  while (value >= 0x80) {
+    output->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  output->push_back(static_cast<char>(value));
 }
 
-// SEND_MESSAGE
-ENCODER(SEND_MESSAGE) {
-  return DataNode::Object{{"text", message.text}};
+size_t network::varUintSize(uint64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
 }
 
-DECODER(SEND_MESSAGE) {
-  message->text = input.asObject()["text"].asString();
+char* network::writeVarUint(char* output, uint64_t value) {
+  while (value >= 0x80) {
+    *output++ = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  *output++ = static_cast<char>(value);
+  return output;
 }
 
-READER(SEND_MESSAGE) {
-  message->text = readString();
+char* network::writeString(char* output, const string& value) {
+  output = writeVarUint(output, value.length());
+  memcpy(output, value.data(), value.length());
+  return output + value.length();
 }
 
-WRITER(SEND_MESSAGE) {
-  writeString(message.text);
-}
+bool network::readVarUint(const char** position, const char* end,
+                          uint64_t* value) {
+  // Message types and most lengths fit in a single byte, which is quicker to
+  // decode on its own than with the word-at-a-time path below.
+  if (*position < end && static_cast<uint8_t>(**position) < 0x80) {
+    *value = static_cast<uint8_t>(*(*position)++);
+    return true;
+  }
 
-// RECEIVE_MESSAGE
-ENCODER(RECEIVE_MESSAGE) {
-  // Convert the category into a string.
-  string category;
-  switch (message.category) {
-    case ChatMessage::CHAT_MESSAGE:
-      return DataNode::Object{
-          {"message_id", static_cast<int64_t>(message.message_id)},
-          {"category", "CHAT_MESSAGE"},
-          {"sender_name", message.sender_name},
-          {"text", message.text}};
-    case ChatMessage::NOTICE:
-      return DataNode::Object{
-          {"message_id", static_cast<int64_t>(message.message_id)},
-          {"category", "NOTICE"},
-          {"text", message.text}};
-    default:
-      throw runtime_error("Bad message category.");
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // Most varuints fit in 8 bytes, and can be decoded from a single load
+  // without a branch per byte. The length is found from the first byte with
+  // its continuation bit clear, then the 7-bit groups are packed together by
+  // merging adjacent pairs of lanes, which doubles the lane width each time.
+  if (end - *position >= 8) {
+    uint64_t word;
+    memcpy(&word, *position, sizeof(word));
+    uint64_t stops = ~word & 0x8080808080808080;
+    if (stops != 0) {
+      int bits = __builtin_ctzll(stops) + 1;  // Up to the last stop bit.
+      uint64_t x = bits == 64 ? word : word & ((uint64_t{1} << bits) - 1);
+      x &= 0x7F7F7F7F7F7F7F7F;
+      x = ((x & 0x7F007F007F007F00) >> 1) | (x & 0x007F007F007F007F);
+      x = ((x & 0x3FFF00003FFF0000) >> 2) | (x & 0x00003FFF00003FFF);
+      x = ((x & 0x0FFFFFFF00000000) >> 4) | (x & 0x000000000FFFFFFF);
+      *value = x;
+      *position += bits / 8;
+      return true;
+    }
   }
-}
+#endif
 
-DECODER(RECEIVE_MESSAGE) {
-  DataNode::Object& node = input.asObject();
-  message->message_id = node["message_id"].asInt64();
-  // Parse the category from its string form.
-  string category = node["category"].asString();
-  if (category == "CHAT_MESSAGE") {
-    message->category = ChatMessage::CHAT_MESSAGE;
-    message->sender_name = node["sender_name"].asString();
-  } else if (category == "NOTICE") {
-    message->category = ChatMessage::NOTICE;
-  } else {
-    throw runtime_error("Invalid message category: " + category);
+  *value = 0;
+  for (int shift = 0; *position < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*position)++;
+    *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) return true;
   }
-  message->text = node["text"].asString();
+  return false;
 }
 
-READER(RECEIVE_MESSAGE) {
-  message->message_id = readVarUint();
-  message->category = static_cast<ChatMessage::Category>(readVarUint());
-  if (message->category == ChatMessage::CHAT_MESSAGE) {
-    message->sender_name = readString();
-  } else {
-    message->sender_name = "";
+bool network::readString(const char** position, const char* end,
+                         string* value) {
+  uint64_t length;
+  if (!readVarUint(position, end, &length) ||
+      length > static_cast<uint64_t>(end - *position)) {
+    return false;
   }
-  message->text = readString();
+  value->assign(*position, length);
+  *position += length;
+  return true;
 }
 
-WRITER(RECEIVE_MESSAGE) {
-  writeVarUint(message.message_id);
-  writeVarUint(static_cast<uint64_t>(message.category));
-  if (message.category == ChatMessage::CHAT_MESSAGE)
-    writeString(message.sender_name);
-  writeString(message.text);
+int64_t network::monotonicMilliseconds() {
+  return chrono::duration_cast<chrono::milliseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
 }
 
-// REQUEST_HISTORY
-ENCODER(REQUEST_HISTORY) {
-  return DataNode::Object{
-      {"start_id", static_cast<int64_t>(message.start_id)},
-      {"num_messages", static_cast<int64_t>(message.num_messages)}};
+int64_t network::monotonicMicroseconds() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
 }
 
-DECODER(REQUEST_HISTORY) {
-  DataNode::Object& node = input.asObject();
-  message->start_id = node["start_id"].asInt64();
-  message->num_messages = node["num_messages"].asInt64();
+const HandlerTable::Entry* HandlerTable::find(MessageType type) const {
+  auto i = entries_.find(type);
+  return i == entries_.end() ? nullptr : &i->second;
 }
 
-READER(REQUEST_HISTORY) {
-  message->start_id = readVarUint();
-  message->num_messages = readVarUint();
+void HandlerTable::limit(MessageType type, const RateLimit& limit) {
+  auto i = entries_.find(type);
+  if (i == entries_.end())
+    throw logic_error("No handler to limit for " + toString(type) + ".");
+  // Written so that NaN and infinite values fail too. A rate of more than a
+  // million per second would round down to no interval at all.
+  double interval = 1e6 / limit.rate;
+  if (!(limit.rate > 0) || !(limit.burst >= 1) || !(interval >= 1) ||
+      !(limit.burst * interval <= network::MAX_REFILL_TIME)) {
+    throw invalid_argument("Invalid limit for " + toString(type) + ".");
+  }
+  Entry& entry = i->second;
+  if (!entry.limit) {
+    entry.limit.reset(new Limit);
+    entry.limit->slot = num_limits_++;
+  }
+  entry.limit->interval = static_cast<int64_t>(interval);
+  entry.limit->tolerance =
+      static_cast<int64_t>((limit.burst - 1) * entry.limit->interval);
+  entry.limit->action = limit.action;
 }
 
-WRITER(REQUEST_HISTORY) {
-  writeVarUint(message.start_id);
-  writeVarUint(message.num_messages);
+uint64_t HandlerTable::numDropped(MessageType type) const {
+  const Entry* entry = find(type);
+  return entry && entry->limit ? entry->limit->num_dropped.load() : 0;
 }
 
-// RECEIVE_HISTORY
-ENCODER(RECEIVE_HISTORY) {
-  DataNode::Array output;
-  for (const ChatMessage& entry : message.messages)
-    output.push_back(encode(entry));
-  return output;
+uint64_t HandlerTable::numDelayed(MessageType type) const {
+  const Entry* entry = find(type);
+  return entry && entry->limit ? entry->limit->num_delayed.load() : 0;
 }
 
-DECODER(RECEIVE_HISTORY) {
-  message->messages.clear();
-  DataNode::Array& messages = input.asArray();
-  for (const DataNode& node : messages) {
-    ChatMessage temp;
-    decode(node, &temp);
-    message->messages.push_back(move(temp));
+// Maximum size of each read from a socket.
+static const size_t RECEIVE_SIZE = 16384;
+
+// A binary frame header is two varuints, each of at most 10 bytes.
+static const size_t MAX_FRAME_HEADER_SIZE = 20;
+
+void ReceiveBuffer::consume(size_t length) {
+  start_ += length;
+  if (start_ == data_.length()) {
+    // Idle connections spend most of their time with nothing buffered, so
+    // the space is released rather than kept for the next message.
+    string().swap(data_);
+    start_ = 0;
   }
 }
 
-READER(RECEIVE_HISTORY) {
-  uint64_t num_messages = readVarUint();
-  for (uint64_t i = 0; i < num_messages; i++) {
-    ChatMessage temp;
-    read(&temp);
-    message->messages.push_back(temp);
+void ReceiveBuffer::fill(int fd, int interrupt_fd) {
+  // Wait for data before making room for it, so that an idle connection holds
+  // no buffer space.
+  pollfd fds[] = {{fd, POLLIN, 0}, {interrupt_fd, POLLIN, 0}};
+  while (::poll(fds, interrupt_fd == -1 ? 1 : 2, -1) < 0) {
+    if (errno != EINTR) throw socket_error(strerror(errno));
+  }
+  if (interrupt_fd != -1 && (fds[1].revents & POLLIN))
+    throw interrupted_error();
+
+  // Move any partial frame to the front so that the buffer does not grow
+  // without bound.
+  if (start_ > 0) {
+    data_.erase(0, start_);
+    start_ = 0;
   }
-}
 
-WRITER(RECEIVE_HISTORY) {
-  writeVarUint(message.messages.size());
-  for (const ChatMessage& entry : message.messages) write(entry);
+  // Read everything which has arrived, up to RECEIVE_SIZE. At least one byte
+  // is requested so that the end of the stream can be detected.
+  int available = 0;
+  if (ioctl(fd, FIONREAD, &available) < 0) available = RECEIVE_SIZE;
+  size_t size = min<size_t>(max(available, 1), RECEIVE_SIZE);
+  size_t length = data_.length();
+  data_.resize(length + size);
+  ssize_t received;
+  do {
+    received = recv(fd, &data_[length], size, 0);
+  } while (received < 0 && errno == EINTR);
+  data_.resize(length + max<ssize_t>(received, 0));
+  if (received < 0) throw socket_error(strerror(errno));
+  if (received == 0) throw socket_error("Connection severed.");
 }
 
-BinaryConnection::BinaryConnection(Socket socket)
-    : socket_(move(socket)) {}
+BinaryConnection::BinaryConnection(StreamSocket socket, string buffered)
+    : socket_(move(socket)), buffer_(move(buffered)) {}
 
-void BinaryConnection::poll() {
-  BinaryReader reader(socket_);
+void BinaryConnection::sendFrame(const string& frame) {
+  socket_.send(frame);
+}
 
+void BinaryConnection::poll(const HandlerTable& handlers,
+                            Connection& connection) {
   // Receive the message.
-  MessageType type = static_cast<MessageType>(reader.readVarUint());
-  string data = reader.readString();
+  uint64_t type_value, length;
+  const char* payload;
+  while (true) {
+    const char* position = buffer_.begin();
+    bool have_header =
+        network::readVarUint(&position, buffer_.end(), &type_value) &&
+        network::readVarUint(&position, buffer_.end(), &length);
+    if (have_header) {
+      // Reject an oversized frame before buffering it.
+      if (length > max_frame_size_) {
+        throw runtime_error("Frame of " + to_string(length) +
+                            " bytes exceeds the limit of " +
+                            to_string(max_frame_size_) + " bytes.");
+      }
+      if (length <= static_cast<uint64_t>(buffer_.end() - position)) {
+        payload = position;
+        break;
+      }
+    }
+    if (!have_header && buffer_.size() >= MAX_FRAME_HEADER_SIZE)
+      throw runtime_error("Bad frame header from client.");
+    buffer_.fill(fd(), interrupt_fd_);
+  }
+  MessageType type = static_cast<MessageType>(type_value);
+  const HandlerTable::Entry* handler = handlers.find(type);
+
+  // Apply any limit first. If a delay is interrupted, the frame is left in
+  // the buffer as if it had not been polled, so it is neither passed to the
+  // frame callback nor consumed until it is admitted.
+  bool admitted = handler == nullptr || !handler->limit ||
+                  connection.admit(*handler->limit, interrupt_fd_);
+  if (handlers.frame_) {
+    handlers.frame_(connection, buffer_.begin(),
+                    payload + length - buffer_.begin());
+  }
+
+  // The payload is parsed in place, so the frame is only consumed once its
+  // handler is done with it.
+  struct Consume {
+    ReceiveBuffer& buffer;
+    size_t length;
+    ~Consume() { buffer.consume(length); }
+  } consume{buffer_, static_cast<size_t>(payload + length - buffer_.begin())};
 
   // Check whether there is a handler for this message type.
-  auto i = callbacks_.find(type);
-  if (i == callbacks_.end()) {
+  if (handler == nullptr) {
     LOG(WARNING) << "No handler for incoming message of type "
                  << toString(type);
     return;
   }
 
-  // Invoke the handler.
-  i->second(data);
+  // Invoke the handler, if the message is within its limit.
+  if (admitted) handler->binary(connection, payload, length);
 }
 
-JSONConnection::JSONConnection(Socket socket)
-    : socket_(move(socket)) {}
+JSONConnection::JSONConnection(StreamSocket socket, string buffered)
+    : socket_(move(socket)), buffer_(move(buffered)) {}
 
 static void discard(const string& data) {
   LOG(ERROR) << "Severing connection due to bad message: " << data;
   throw runtime_error("Bad message from client.");
 }
 
-void JSONConnection::poll() {
-  string data;
-  char c = 0;
-
-  // Receive the message.
-  while (socket_.receive(&c, 1) && c != '\n') data.push_back(c);
-  if (c != '\n') throw socket_error("Connection severed.");
-
-  // Decode the message.
-  MessageType type;
-  DataNode payload;
-  {
-    DataNode node;
-    try {
-      node = JSON::parse(data);
-    } catch (...) {
-      return discard(data);
+// Whether arrays and objects in some JSON nest more than max_depth deep.
+static bool nestsDeeperThan(const string& data, size_t max_depth) {
+  size_t depth = 0;
+  bool in_string = false;
+  for (size_t i = 0; i < data.length(); i++) {
+    char c = data[i];
+    if (in_string) {
+      if (c == '\\') {
+        i++;
+      } else if (c == '"') {
+        in_string = false;
+      }
+    } else if (c == '"') {
+      in_string = true;
+    } else if (c == '[' || c == '{') {
+      if (++depth > max_depth) return true;
+    } else if ((c == ']' || c == '}') && depth > 0) {
+      depth--;
     }
+  }
+  return false;
+}
 
-    // Check that the message is an object.
-    if (node.type() != DataNode::OBJECT) return discard(data);
-    DataNode::Object& object = node.asObject();
+// Decode a line into its message type and payload. Returns false if it is not
+// a valid message.
+static bool decodeLine(const string& data, MessageType* type,
+                       DataNode* payload) {
+  if (nestsDeeperThan(data, network::MAX_JSON_DEPTH)) return false;
+  DataNode node;
+  try {
+    node = JSON::parse(data);
+  } catch (...) {
+    return false;
+  }
 
-    // Check that there is a type field and it is a valid string value.
-    auto i = object.find("type");
-    if (i == object.end()) return discard(data);
-    DataNode& type_node = i->second;
-    if (type_node.type() != DataNode::STRING) return discard(data);
-    if (!fromString(type_node.asString(), &type)) return discard(data);
+  // Check that the message is an object.
+  if (node.type() != DataNode::OBJECT) return false;
+  DataNode::Object& object = node.asObject();
+
+  // Check that there is a type field and it is a valid string value.
+  auto i = object.find("type");
+  if (i == object.end()) return false;
+  DataNode& type_node = i->second;
+  if (type_node.type() != DataNode::STRING) return false;
+  if (!fromString(type_node.asString(), type)) return false;
+
+  // Check that there is a payload field and extract it.
+  i = object.find("payload");
+  if (i == object.end()) return false;
+  *payload = move(i->second);
+  return true;
+}
 
-    // Check that there is a payload field and extract it.
-    i = object.find("payload");
-    if (i == object.end()) return discard(data);
-    payload = move(i->second);
+void JSONConnection::poll(const HandlerTable& handlers,
+                          Connection& connection) {
+  // Receive the message.
+  size_t scanned = 0;
+  const void* newline;
+  while ((newline = memchr(buffer_.begin() + scanned, '\n',
+                           buffer_.size() - scanned)) == nullptr) {
+    scanned = buffer_.size();
+    if (scanned > max_frame_size_) {
+      throw runtime_error("Line exceeds the limit of " +
+                          to_string(max_frame_size_) + " bytes.");
+    }
+    buffer_.fill(fd(), interrupt_fd_);
+  }
+  size_t length = static_cast<const char*>(newline) - buffer_.begin();
+  // A line which arrived in a single read has not been checked yet.
+  if (length > max_frame_size_) {
+    throw runtime_error("Line exceeds the limit of " +
+                        to_string(max_frame_size_) + " bytes.");
   }
+  string data(buffer_.begin(), length);
+  MessageType type;
+  DataNode payload;
+  bool valid = decodeLine(data, &type, &payload);
+  const HandlerTable::Entry* handler = valid ? handlers.find(type) : nullptr;
+
+  // As for binary frames, a line is only passed to the frame callback and
+  // consumed once it is admitted.
+  bool admitted = handler == nullptr || !handler->limit ||
+                  connection.admit(*handler->limit, interrupt_fd_);
+  if (handlers.frame_) handlers.frame_(connection, buffer_.begin(), length + 1);
+  buffer_.consume(length + 1);
+  if (!valid) return discard(data);
 
   // Check whether there is a handler for this message type.
-  auto i = callbacks_.find(type);
-  if (i == callbacks_.end()) {
+  if (handler == nullptr) {
     LOG(WARNING) << "No handler for incoming message of type "
                  << toString(type);
     return;
   }
 
-  // Invoke the handler.
-  i->second(payload);
+  // Invoke the handler, if the message is within its limit.
+  if (admitted) handler->json(connection, payload);
+}
+
+void JSONConnection::sendFrame(const string& frame) {
+  socket_.send(frame);
 }
 
-void JSONConnection::send(MessageType message_type, DataNode object) {
+string JSONConnection::encode(MessageType message_type, DataNode object) {
   DataNode node = scrump::DataNode::Object{
       {"type", toString(message_type)},
       {"payload", move(object)}};
-  socket_.send(scrump::JSON::stringify(node) + "\n");
-}
-
-static string readline(Socket& socket) {
-  string data;
-  char c;
-  while (socket.receive(&c, 1) && c != '\n') data.push_back(c);
-  return data;
+  return scrump::JSON::stringify(node) + "\n";
 }
 
-Connection::Connection(Socket socket) {
-  {
-    string mode_string = readline(socket);
-    if (mode_string == "BINARY") {
-      mode_ = Connection::BINARY;
-    } else if (mode_string == "JSON") {
-      mode_ = Connection::JSON;
-    } else {
-      LOG(ERROR) << "Invalid connection mode. Aborting.";
-      socket.send("Invalid connection type.");
-      return;
-    }
-  }
-  LOG(INFO) << "Connection mode is "
-            << (mode_ == Connection::BINARY ? "BINARY" : "JSON");
-  switch (mode_) {
+Connection::Connection(Mode mode, StreamSocket socket)
+    : mode_(mode) {
+  switch (mode) {
     case BINARY:
+      socket.send("BINARY\n");
       new(&binary_connection_) BinaryConnection(move(socket));
       break;
     case JSON:
+      socket.send("JSON\n");
       new(&json_connection_) JSONConnection(move(socket));
       break;
   }
 }
 
-Connection::Connection(Mode mode, Socket socket)
+Connection::Connection(Mode mode, StreamSocket socket, string buffered)
     : mode_(mode) {
   switch (mode) {
     case BINARY:
-      socket.send("BINARY\n");
-      new(&binary_connection_) BinaryConnection(move(socket));
+      new(&binary_connection_) BinaryConnection(move(socket), move(buffered));
       break;
     case JSON:
-      socket.send("JSON\n");
-      new(&json_connection_) JSONConnection(move(socket));
+      new(&json_connection_) JSONConnection(move(socket), move(buffered));
       break;
   }
 }
 
+struct Connection::SendState {
+  std::atomic<int> bulk_waiting{0};  // Bulk senders waiting for live ones.
+  std::atomic<uint64_t> live_sends{0};  // Live senders given the lock.
+  mutex lane_mutex;
+
+  // Signalled when live_waiting_ is 0, or a live sender has taken the lock
+  // while a bulk sender waits.
+  condition_variable live_done;
+
+  mutable mutex queue_mutex;
+  string queue;  // Guarded by queue_mutex.
+};
+
 Connection::~Connection() {
+  delete send_state_.load();
   switch (mode_) {
     case BINARY: binary_connection_.~BinaryConnection(); break;
     case JSON: json_connection_.~JSONConnection(); break;
@@ -302,9 +434,248 @@ Connection::~Connection() {
 }
 
 void Connection::poll() {
-  unique_lock<mutex> lock(reader_mutex_);
+  static const HandlerTable no_handlers;
+  const HandlerTable& handlers = handlers_ ? *handlers_ : no_handlers;
+  switch (mode_) {
+    case BINARY: binary_connection_.poll(handlers, *this); break;
+    case JSON: json_connection_.poll(handlers, *this); break;
+  }
+  last_receive_ = network::monotonicMilliseconds();
+}
+
+// A bulk sender waits for at most this many live sends before it competes
+// for the writer lock on equal terms.
+static const uint64_t MAX_LIVE_SENDS_AHEAD_OF_BULK = 16;
+
+unique_lock<mutex> Connection::lockWriter(Priority priority) {
+  if (priority == LIVE) {
+    live_waiting_++;
+    unique_lock<mutex> lock(writer_mutex_);
+    bool last = --live_waiting_ == 0;
+    // Without the state, no bulk sender can be waiting.
+    SendState* state = send_state_;
+    if (state != nullptr) {
+      state->live_sends++;
+      if (last || state->bulk_waiting > 0) {
+        unique_lock<mutex> lane_lock(state->lane_mutex);
+        state->live_done.notify_all();
+      }
+    }
+    return lock;
+  }
+
+  // A bulk sender which meets no live sender goes straight ahead.
+  if (live_waiting_ == 0) {
+    unique_lock<mutex> lock(writer_mutex_, try_to_lock);
+    if (lock.owns_lock()) return lock;
+  }
+
+  // A live sender which arrives between this check and taking the lock waits
+  // for one piece at most.
+  SendState& state = sendState();
+  {
+    unique_lock<mutex> lane_lock(state.lane_mutex);
+    state.bulk_waiting++;
+    uint64_t start = state.live_sends;
+    state.live_done.wait(lane_lock, [this, &state, start] {
+      return live_waiting_ == 0 ||
+             state.live_sends - start >= MAX_LIVE_SENDS_AHEAD_OF_BULK;
+    });
+    state.bulk_waiting--;
+  }
+  return unique_lock<mutex>(writer_mutex_);
+}
+
+void Connection::sendFrame(const string& frame) {
+  unique_lock<mutex> lock = lockWriter(LIVE);
+  SendTimer timer(this);
+  writeQueued(true);
+  write(frame.data(), frame.length(), true);
+  writeQueued(true);
+}
+
+bool Connection::post(const string& frame) {
+  unique_lock<mutex> lock = tryLockWriter();
+  if (!lock.owns_lock()) {
+    queue(frame.data(), frame.length());
+    return flush();
+  }
+  size_t written = write(frame.data(), frame.length(), false);
+  if (written == frame.length()) return true;
+  queue(frame.data() + written, frame.length() - written);
+  return false;
+}
+
+bool Connection::flush() {
+  // Whoever holds the writer lock writes the queue once it is done, or
+  // leaves it for the next flush.
+  unique_lock<mutex> lock(writer_mutex_, try_to_lock);
+  if (!lock.owns_lock()) return false;
+  return writeQueued(false);
+}
+
+unique_lock<mutex> Connection::tryLockWriter() {
+  unique_lock<mutex> lock(writer_mutex_, try_to_lock);
+  if (lock.owns_lock() && hasQueued()) lock.unlock();
+  return lock;
+}
+
+void Connection::queue(const char* data, size_t length) {
+  SendState& state = sendState();
+  unique_lock<mutex> queue_lock(state.queue_mutex);
+  if (state.queue.empty()) {
+    beginSend();
+  } else if (state.queue.size() + length > network::MAX_QUEUED_SIZE) {
+    throw runtime_error("Too much is queued for the connection.");
+  }
+  state.queue.append(data, length);
+}
+
+string Connection::queued() const {
+  SendState* state = send_state_;
+  if (state == nullptr) return "";
+  unique_lock<mutex> queue_lock(state->queue_mutex);
+  return state->queue;
+}
+
+Connection::SendState& Connection::sendState() {
+  SendState* state = send_state_;
+  if (state != nullptr) return *state;
+  unique_ptr<SendState> created(new SendState);
+  if (send_state_.compare_exchange_strong(state, created.get()))
+    return *created.release();
+  return *state;  // Another thread allocated it first.
+}
+
+bool Connection::hasQueued() const {
+  SendState* state = send_state_;
+  if (state == nullptr) return false;
+  unique_lock<mutex> queue_lock(state->queue_mutex);
+  return !state->queue.empty();
+}
+
+void Connection::beginSend() {
+  int64_t idle = 0;
+  send_started_.compare_exchange_strong(idle,
+                                        network::monotonicMilliseconds());
+}
+
+void Connection::endSend() {
+  SendState* state = send_state_;
+  if (state == nullptr) {
+    send_started_ = 0;
+    // A frame may have been queued for the first time in the meantime.
+    state = send_state_;
+    if (state == nullptr) return;
+  }
+  unique_lock<mutex> queue_lock(state->queue_mutex);
+  if (state->queue.empty()) {
+    send_started_ = 0;
+  } else {
+    beginSend();
+  }
+}
+
+bool Connection::writeQueued(bool block) {
+  // Nothing has ever been queued.
+  SendState* state = send_state_;
+  if (state == nullptr) return true;
+  while (true) {
+    // Frames may be queued while this writes, so the queue is taken whole.
+    string data;
+    {
+      unique_lock<mutex> queue_lock(state->queue_mutex);
+      if (state->queue.empty()) {
+        if (!block) send_started_ = 0;
+        return true;
+      }
+      data.swap(state->queue);
+    }
+    size_t written = write(data.data(), data.length(), block);
+    if (written < data.length()) {
+      unique_lock<mutex> queue_lock(state->queue_mutex);
+      state->queue.insert(0, data, written, string::npos);
+      return false;
+    }
+  }
+}
+
+atomic<uint64_t> Connection::num_writes_{0};
+
+size_t Connection::write(const char* data, size_t length, bool block) {
+  size_t written = 0;
+  while (written < length) {
+    num_writes_.fetch_add(1, memory_order_relaxed);
+    ssize_t result = ::send(fd(), data + written, length - written,
+                            MSG_NOSIGNAL | (block ? 0 : MSG_DONTWAIT));
+    if (result >= 0) {
+      written += result;
+    } else if (!block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (errno != EINTR) {
+      throw socket_error(string("Failed to send: ") + strerror(errno));
+    }
+  }
+  return written;
+}
+
+int Connection::fd() {
+  switch (mode_) {
+    case BINARY: return binary_connection_.fd();
+    case JSON: return json_connection_.fd();
+  }
+  return -1;
+}
+
+void Connection::setInterrupt(int fd) {
+  switch (mode_) {
+    case BINARY: return binary_connection_.setInterrupt(fd);
+    case JSON: return json_connection_.setInterrupt(fd);
+  }
+}
+
+bool Connection::admit(const HandlerTable::Limit& limit, int interrupt_fd) {
+  if (!limit_times_) limit_times_.reset(new int64_t[handlers_->num_limits_]());
+  int64_t& full_time = limit_times_[limit.slot];
+  int64_t now = network::monotonicMicroseconds();
+
+  // The bucket has a token left unless it is more than the tolerance away
+  // from being full.
+  int64_t earliest = full_time - limit.tolerance;
+  if (now < earliest) {
+    if (limit.action == RateLimit::DROP) {
+      limit.num_dropped++;
+      return false;
+    }
+    // A delay may be long, so it must not hold up a hot restart.
+    pollfd fds[] = {{interrupt_fd, POLLIN, 0}};
+    while (now < earliest) {
+      timespec timeout;
+      timeout.tv_sec = (earliest - now) / 1000000;
+      timeout.tv_nsec = (earliest - now) % 1000000 * 1000;
+      int result = ppoll(fds, interrupt_fd == -1 ? 0 : 1, &timeout, nullptr);
+      if (result < 0 && errno != EINTR) throw socket_error(strerror(errno));
+      if (result > 0 && (fds[0].revents & POLLIN)) throw interrupted_error();
+      now = network::monotonicMicroseconds();
+    }
+    limit.num_delayed++;
+    now = earliest;
+  }
+  full_time = max(full_time, now) + limit.interval;
+  return true;
+}
+
+void Connection::setMaxFrameSize(size_t size) {
+  switch (mode_) {
+    case BINARY: return binary_connection_.setMaxFrameSize(size);
+    case JSON: return json_connection_.setMaxFrameSize(size);
+  }
+}
+
+string Connection::buffered() const {
   switch (mode_) {
-    case BINARY: return binary_connection_.poll();
-    case JSON: return json_connection_.poll();
+    case BINARY: return binary_connection_.buffered();
+    case JSON: return json_connection_.buffered();
   }
+  return "";
 }
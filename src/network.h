@@ -1,132 +1,285 @@
 #pragma once
 
 #include "message_type.h"
+#include "messages.h"
+#include "stream_socket.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <unordered_map>
 #include <scrump/binary.h>
 #include <scrump/data_node.h>
 #include <scrump/json.h>
-#include <scrump/socket.h>
 #include <string>
 #include <vector>
 
 namespace network {
 
-template <typename T> scrump::DataNode encode(const T& message);
-template <typename T> void decode(const scrump::DataNode& input, T* message);
+// Append the varuint encoding of value to output.
+void appendVarUint(std::string* output, uint64_t value);
+
+// Decode a varuint from [*position, end), advancing *position past it. Returns
+// false if the varuint is truncated or too long.
+bool readVarUint(const char** position, const char* end, uint64_t* value);
+
+// As readVarUint(), for a length-prefixed string. The length is checked before
+// anything is allocated.
+bool readString(const char** position, const char* end, std::string* value);
+
+// The number of bytes in the varuint encoding of value.
+size_t varUintSize(uint64_t value);
+
+// Write the varuint encoding of value, or value as a length-prefixed string,
+// to output. Returns the end of what was written.
+char* writeVarUint(char* output, uint64_t value);
+char* writeString(char* output, const std::string& value);
+
+// Encode the binary payload of a message, with a single allocation.
+template <typename T>
+std::string serialize(const T& message) {
+  std::string output(encodedSize(message), '\0');
+  writeBinary(message, &output[0]);
+  return output;
+}
+
+// Milliseconds since an arbitrary point in the past. This never goes backwards.
+int64_t monotonicMilliseconds();
+int64_t monotonicMicroseconds();  // As above, from the same point.
+
+// Connections close if they receive a frame larger than this, unless it is
+// changed with Connection::setMaxFrameSize().
+const size_t DEFAULT_MAX_FRAME_SIZE = 16 << 20;
+
+// Connection::post() fails once more than this is queued for a connection,
+// although a single frame of any size can always be queued.
+const size_t MAX_QUEUED_SIZE = 16 << 20;
+
+// The longest time, in microseconds, that an empty token bucket may take to
+// refill (about 30 years). This keeps every bucket's times far from
+// overflowing.
+const double MAX_REFILL_TIME = 1e15;
+
+// JSON messages which nest arrays and objects deeper than this are rejected
+// before they are parsed, since the parser recurses once per level. Every
+// valid message nests far less deeply.
+const size_t MAX_JSON_DEPTH = 32;
 
 }  // namespace network
 
-template <MessageType message_type>
-struct Message {
-  static const MessageType type = message_type;
-};
+typedef Message<RECEIVE_MESSAGE> ChatMessage;
 
-#define DECLARE_MESSAGE(name)  \
-  namespace network {  \
-    template <> scrump::DataNode encode(const Message<name>& message);  \
-    template <> void decode(  \
-        const scrump::DataNode& input, Message<name>* message);  \
-  }  \
-  namespace scrump {  \
-    template <> void BinaryReader::read(Message<name>* message);  \
-    template <> void BinaryWriter::write(const Message<name>& message);  \
-  }  \
-  template <> struct Message<name>
-
-DECLARE_MESSAGE(IDENTIFY) {
-  std::string display_name;
-};
+bool operator==(const ChatMessage& a, const ChatMessage& b);
 
-DECLARE_MESSAGE(SEND_MESSAGE) {
-  std::string text;
+// Thrown by Connection::poll() if its interrupt descriptor becomes readable.
+class interrupted_error : public std::runtime_error {
+ public:
+  interrupted_error() : std::runtime_error("Interrupted.") {}
 };
 
-DECLARE_MESSAGE(RECEIVE_MESSAGE) {
-  enum Category {
-    CHAT_MESSAGE = 0,  // Sent by a user.
-    NOTICE = 1,        // Sent by the server.
-  };
+// Data which has been received from a socket but not yet parsed. Incomplete
+// frames are kept here between reads, so that they can be handed over along
+// with the socket.
+class ReceiveBuffer {
+ public:
+  ReceiveBuffer(std::string data = "") : data_(std::move(data)) {}
 
-  uint64_t message_id;  // Unique ID of this message.
+  const char* begin() const { return data_.data() + start_; }
+  const char* end() const { return data_.data() + data_.length(); }
+  size_t size() const { return data_.length() - start_; }
+  std::string contents() const { return data_.substr(start_); }
 
-  Category category;
-  std::string sender_name;  // Populated only if category is CHAT_MESSAGE.
-  std::string text;
-};
-typedef Message<RECEIVE_MESSAGE> ChatMessage;
+  // Discard data from the front of the buffer.
+  void consume(size_t length);
+
+  // Receive more data. If interrupt_fd is not -1 and becomes readable before
+  // any data arrives, this throws interrupted_error instead.
+  void fill(int fd, int interrupt_fd);
 
-DECLARE_MESSAGE(REQUEST_HISTORY) {
-  uint64_t start_id;
-  uint64_t num_messages;
+ private:
+  std::string data_;
+  size_t start_ = 0;
 };
 
-DECLARE_MESSAGE(RECEIVE_HISTORY) {
-  std::vector<ChatMessage> messages;
+class Connection;
+
+// How often a connection may send messages of one type. Each connection has a
+// token bucket for each limited type, which holds up to burst messages and
+// refills at rate messages per second. A message which arrives while the
+// bucket is empty is either dropped, or delayed until the bucket refills.
+struct RateLimit {
+  enum Action {
+    DROP,
+    DELAY,
+  };
+
+  double rate;
+  double burst;
+  Action action;
 };
 
-#undef DECLARE_MESSAGE
+// Message handlers, which can be shared by any number of connections. Each
+// handler is passed the connection which received the message, through which
+// it can find any per-connection state using Connection::context().
+class HandlerTable {
+ public:
+  template <MessageType message_type>
+  void on(std::function<void(Connection& connection,
+                             Message<message_type>&& message)> callback) {
+    Entry& entry = entries_[message_type];
+    // Parse the binary payload and run the callback.
+    entry.binary = [callback](Connection& connection, const char* data,
+                              size_t length) {
+      Message<message_type> message;
+      if (!network::readBinary(&data, data + length, &message)) {
+        throw std::runtime_error("Malformed " + toString(message_type) +
+                                 " message.");
+      }
+      callback(connection, std::move(message));
+    };
+    // Parse the JSON object and run the callback.
+    entry.json = [callback](Connection& connection,
+                            const scrump::DataNode& payload) {
+      Message<message_type> message;
+      network::decode(payload, &message);
+      callback(connection, std::move(message));
+    };
+  }
+
+  // Run a callback on every complete frame received, before it is passed to
+  // its handler. A binary frame includes its type and length, and a JSON
+  // frame is a line including its newline. Frames which are delayed by a
+  // limit are passed at the end of the delay, and frames which are dropped
+  // are passed all the same.
+  void onFrame(std::function<void(Connection& connection, const char* data,
+                                  size_t length)> callback) {
+    frame_ = std::move(callback);
+  }
+
+  // Limit how often each connection may send messages of the given type,
+  // which must already have a handler. Messages over the limit are never
+  // passed to the handler. This must not be called once any connection using
+  // the table has been polled.
+  //
+  // Throws std::invalid_argument unless the rate is at most a million per
+  // second and an empty bucket refills within network::MAX_REFILL_TIME.
+  void limit(MessageType type, const RateLimit& limit);
+
+  // The numbers of messages of the given type which have been dropped or
+  // delayed by its limit, across every connection.
+  uint64_t numDropped(MessageType type) const;
+  uint64_t numDelayed(MessageType type) const;
+
+ private:
+  friend class BinaryConnection;
+  friend class JSONConnection;
+  friend class Connection;
+
+  // A token bucket is kept as the time at which it will next be full, so the
+  // state for each connection is a single integer.
+  struct Limit {
+    int64_t interval;   // Microseconds for one token to refill.
+    int64_t tolerance;  // Microseconds for all but one token to refill.
+    RateLimit::Action action;
+    size_t slot;  // Index of this limit's bucket in each connection.
+    mutable std::atomic<uint64_t> num_dropped{0}, num_delayed{0};
+  };
+
+  struct Entry {
+    std::function<void(Connection&, const char*, size_t)> binary;
+    std::function<void(Connection&, const scrump::DataNode&)> json;
+    std::unique_ptr<Limit> limit;  // Null if the type is not limited.
+  };
+
+  // Returns null if there is no handler for the given type.
+  const Entry* find(MessageType type) const;
+
+  std::unordered_map<MessageType, Entry> entries_;
+  size_t num_limits_ = 0;
+  std::function<void(Connection&, const char*, size_t)> frame_;
+};
 
 class BinaryConnection {
  public:
-  BinaryConnection(scrump::Socket socket);
+  BinaryConnection(StreamSocket socket, std::string buffered = "");
 
+  // Encode a message as a complete binary frame.
   template <MessageType message_type>
-  void send(const Message<message_type>& message) {
-    // Send the message in binary form.
-    scrump::BinaryWriter writer(socket_);
-    writer.writeVarUint(static_cast<uint64_t>(message_type));
-    writer.writeString(scrump::serialize(message));
+  static std::string encode(const Message<message_type>& message) {
+    // The payload is sized first so that the whole frame is written into a
+    // single allocation.
+    size_t size = network::encodedSize(message);
+    std::string frame(network::varUintSize(message_type) +
+                          network::varUintSize(size) + size,
+                      '\0');
+    char* output = network::writeVarUint(&frame[0], message_type);
+    output = network::writeVarUint(output, size);
+    network::writeBinary(message, output);
+    return frame;
   }
 
   template <MessageType message_type>
-  void on(std::function<void(Message<message_type>&& message)> callback) {
-    // Parse the binary payload and run the callback.
-    callbacks_.emplace(message_type, [callback](const std::string& data) {
-      callback(scrump::deserialize<Message<message_type>>(data));
-    });
+  void send(const Message<message_type>& message) {
+    sendFrame(encode(message));
   }
 
-  void poll();
+  // Send a frame produced by encode().
+  void sendFrame(const std::string& frame);
 
- private:
-  typedef std::function<void(const std::string&)> Handler;
+  int fd() { return socket_.fd(); }
+
+  // Receive one message and pass it to its handler. The payload is parsed
+  // directly from the receive buffer.
+  void poll(const HandlerTable& handlers, Connection& connection);
+
+  void setInterrupt(int fd) { interrupt_fd_ = fd; }
+  void setMaxFrameSize(size_t size) { max_frame_size_ = size; }
+  std::string buffered() const { return buffer_.contents(); }
 
-  scrump::Socket socket_;
-  std::unordered_map<MessageType, Handler> callbacks_;
+ private:
+  StreamSocket socket_;
+  ReceiveBuffer buffer_;
+  int interrupt_fd_ = -1;
+  size_t max_frame_size_ = network::DEFAULT_MAX_FRAME_SIZE;
 };
 
 class JSONConnection {
  public:
-  JSONConnection(scrump::Socket socket);
+  JSONConnection(StreamSocket socket, std::string buffered = "");
 
+  // Encode a message as a complete JSON line.
   template <MessageType message_type>
-  void send(const Message<message_type>& message) {
-    send(message_type, network::encode(message));
+  static std::string encode(const Message<message_type>& message) {
+    return encode(message_type, network::encode(message));
   }
 
   template <MessageType message_type>
-  void on(std::function<void(Message<message_type>&& message)> callback) {
-    // Parse the JSON object and run the callback.
-    callbacks_.emplace(
-        message_type, [callback](const scrump::DataNode& payload) {
-      Message<message_type> message;
-      network::decode(payload, &message);
-      callback(std::move(message));
-    });
+  void send(const Message<message_type>& message) {
+    sendFrame(encode(message));
   }
 
-  void poll();
+  // Send a frame produced by encode().
+  void sendFrame(const std::string& frame);
 
- private:
-  void send(MessageType message_type, scrump::DataNode object);
+  int fd() { return socket_.fd(); }
+
+  // Receive one message and pass it to its handler.
+  void poll(const HandlerTable& handlers, Connection& connection);
+
+  void setInterrupt(int fd) { interrupt_fd_ = fd; }
+  void setMaxFrameSize(size_t size) { max_frame_size_ = size; }
+  std::string buffered() const { return buffer_.contents(); }
 
-  typedef std::function<void(const scrump::DataNode&)> Handler;
+ private:
+  static std::string encode(MessageType message_type, scrump::DataNode object);
 
-  scrump::Socket socket_;
-  std::unordered_map<MessageType, Handler> callbacks_;
+  StreamSocket socket_;
+  ReceiveBuffer buffer_;
+  int interrupt_fd_ = -1;
+  size_t max_frame_size_ = network::DEFAULT_MAX_FRAME_SIZE;
 };
 
 class Connection {
@@ -136,37 +289,218 @@ class Connection {
     JSON,
   };
 
-  Connection(scrump::Socket socket);  // Server side.
-  Connection(Mode mode, scrump::Socket socket);  // Client side.
+  Connection(Mode mode, StreamSocket socket);  // Client side.
+
+  // Server side, for a connection whose header has already been read. Any
+  // data which was received but not yet parsed is passed as buffered.
+  Connection(Mode mode, StreamSocket socket, std::string buffered);
+
   ~Connection();
 
+  // Outgoing traffic is either live (new messages, notices and replies to
+  // small requests), or bulk (large replies, which should be sent in pieces).
+  // A bulk send waits until no live send is waiting, so live traffic is only
+  // ever held up by a single piece of a bulk reply. So that a steady stream
+  // of live traffic cannot hold bulk replies back forever, a waiting bulk send
+  // also goes ahead once a few live sends have gone ahead of it.
+  enum Priority {
+    LIVE,
+    BULK,
+  };
+
   template <MessageType message_type>
-  void send(const Message<message_type>& message) {
-    std::unique_lock<std::mutex> lock(writer_mutex_);
+  void send(const Message<message_type>& message, Priority priority = LIVE) {
+    std::unique_lock<std::mutex> lock = lockWriter(priority);
+    SendTimer timer(this);
+    writeQueued(true);
     switch (mode_) {
-      case BINARY: return binary_connection_.send(message);
-      case JSON: return json_connection_.send(message);
+      case BINARY: binary_connection_.send(message); break;
+      case JSON: json_connection_.send(message); break;
     }
+    writeQueued(true);
   }
 
+  // Encode a message as a frame for connections of the given mode.
   template <MessageType message_type>
-  void on(std::function<void(Message<message_type>&& message)> callback) {
-    std::unique_lock<std::mutex> lock(callback_mutex_);
-    switch (mode_) {
-      case BINARY: return binary_connection_.on(callback);
-      case JSON: return json_connection_.on(callback);
+  static std::string encode(Mode mode, const Message<message_type>& message) {
+    switch (mode) {
+      case BINARY: return BinaryConnection::encode(message);
+      case JSON: return JSONConnection::encode(message);
     }
+    return "";
+  }
+
+  // Send a frame produced by encode() for this connection's mode.
+  void sendFrame(const std::string& frame);
+
+  // Broadcasts must not wait for a slow connection, so they post frames
+  // instead of sending them. A frame which cannot be written at once, because
+  // another sender is writing or the socket's buffer is full, is queued. The
+  // queue is written ahead of anything sent later, and by flush().
+  //
+  // These never block, and return whether nothing is left queued. They throw
+  // if the connection fails, or if more than network::MAX_QUEUED_SIZE would
+  // be queued.
+  bool post(const std::string& frame);
+  bool flush();
+
+  // For writing a frame to the underlying descriptor directly, as post() does
+  // but alongside other connections. Returns the writer lock if it is free and
+  // nothing is queued, and otherwise an unlocked lock, in which case the frame
+  // should be posted instead. Any part of the frame which is not written must
+  // be passed to queue() before the lock is released.
+  std::unique_lock<std::mutex> tryLockWriter();
+  void queue(const char* data, size_t length);
+
+  // Frames which have been queued but not written. This must not be called
+  // concurrently with any sender.
+  std::string queued() const;
+
+  int fd();
+
+  // The number of send() system calls made to write frames for post(),
+  // flush(), sendFrame() and any queue, across every connection.
+  static uint64_t numWrites() { return num_writes_; }
+
+  // For detecting dead connections: the time at which a message was last
+  // received, and the time at which the send in progress started (or 0 if
+  // there is none), from network::monotonicMilliseconds().
+  int64_t lastReceive() const { return last_receive_; }
+  int64_t sendStarted() const { return send_started_; }
+
+  Mode mode() const { return mode_; }
+
+  // Handle messages using a table shared with other connections. The table
+  // must outlive the connection.
+  void setHandlers(const HandlerTable* handlers) { handlers_ = handlers; }
+
+  // Handle messages of one type for this connection alone. This replaces any
+  // shared table.
+  template <MessageType message_type>
+  void on(std::function<void(Message<message_type>&& message)> callback) {
+    if (!own_handlers_) own_handlers_.reset(new HandlerTable);
+    handlers_ = own_handlers_.get();
+    own_handlers_->on<message_type>(
+        [callback](Connection&, Message<message_type>&& message) {
+      callback(std::move(message));
+    });
   }
 
+  // Per-connection state for shared handlers.
+  void setContext(void* context) { context_ = context; }
+  void* context() const { return context_; }
+
+  // Receive one message and pass it to its handler. Handlers must be set up
+  // before the connection is first polled, and only one thread may poll.
   void poll();
-    
+
+  // Make poll() throw interrupted_error when the given descriptor becomes
+  // readable. This must be called before the connection is polled.
+  void setInterrupt(int fd);
+
+  // Make poll() throw, before buffering any of it, if a frame larger than the
+  // given number of bytes arrives. For JSON connections, this limits the
+  // length of each line.
+  void setMaxFrameSize(size_t size);
+
+  // Data which has been received but not yet parsed. This must not be called
+  // concurrently with poll().
+  std::string buffered() const;
+
  private:
+  friend class BinaryConnection;
+  friend class JSONConnection;
+
+  // Apply the limit for a message which has arrived. Returns false if the
+  // message should be dropped, and waits first if it should be delayed. If
+  // interrupt_fd is not -1 and becomes readable while waiting, this throws
+  // interrupted_error and leaves the limit as it was.
+  bool admit(const HandlerTable::Limit& limit, int interrupt_fd);
+
+  // The writer lock must be held for the duration of every write. A send is
+  // in progress from when it starts until it ends with nothing queued.
+  std::unique_lock<std::mutex> lockWriter(Priority priority = LIVE);
+  void beginSend();
+  void endSend();
+
+  // Write as much as possible without blocking, or everything if block is
+  // set. Returns whether nothing is left queued. Needs the writer lock.
+  bool writeQueued(bool block);
+  size_t write(const char* data, size_t length, bool block);
+
+  // What is needed to hold bulk senders back, and to queue frames. Most
+  // connections never have a bulk sender wait or a frame queued, so this is
+  // only allocated when one first does, and then kept until the connection
+  // is destroyed.
+  struct SendState;
+  SendState& sendState();
+  bool hasQueued() const;
+
+  class SendTimer {
+   public:
+    SendTimer(Connection* connection) : connection_(connection) {
+      connection_->beginSend();
+    }
+    ~SendTimer() { connection_->endSend(); }
+
+   private:
+    Connection* connection_;
+  };
+
+  static std::atomic<uint64_t> num_writes_;
+
   Mode mode_;
+  std::atomic<int> live_waiting_{0};  // Live senders waiting for the lock.
+
+  std::mutex writer_mutex_;
+  std::atomic<SendState*> send_state_{nullptr};  // Null until first needed.
+  std::atomic<int64_t> last_receive_{network::monotonicMilliseconds()};
+  std::atomic<int64_t> send_started_{0};
+
+  const HandlerTable* handlers_ = nullptr;
+  std::unique_ptr<HandlerTable> own_handlers_;  // Set only by on().
+  void* context_ = nullptr;
 
-  std::mutex reader_mutex_, writer_mutex_, callback_mutex_;
+  // When each of the handler table's token buckets will next be full, in
+  // microseconds. Allocated by the first message that has a limit.
+  std::unique_ptr<int64_t[]> limit_times_;
 
   union {
     BinaryConnection binary_connection_;
     JSONConnection json_connection_;
   };
 };
+
+// A sequence of messages which is encoded at most once per connection mode,
+// regardless of how many connections it is sent to.
+template <MessageType message_type>
+class EncodedMessages {
+ public:
+  EncodedMessages(const std::vector<Message<message_type>>& messages)
+      : messages_(messages) {}
+
+  // The frames for every message, concatenated.
+  const std::string& frames(Connection::Mode mode) {
+    encode(mode);
+    return frames_[mode];
+  }
+
+  // The offset of the end of each message's frame within frames(mode).
+  const std::vector<size_t>& ends(Connection::Mode mode) {
+    encode(mode);
+    return ends_[mode];
+  }
+
+ private:
+  void encode(Connection::Mode mode) {
+    if (!ends_[mode].empty() || messages_.empty()) return;
+    for (const Message<message_type>& message : messages_) {
+      frames_[mode] += Connection::encode(mode, message);
+      ends_[mode].push_back(frames_[mode].length());
+    }
+  }
+
+  const std::vector<Message<message_type>>& messages_;
+  std::string frames_[2];
+  std::vector<size_t> ends_[2];
+};
@@ -0,0 +1,354 @@
+// Plays a capture recorded by a server with --capture back against a server,
+// and reports the throughput achieved and the latency of each kind of request.
+// Connections are opened, sent their frames and closed in the same order as
+// in the capture, either on the capture's schedule (optionally sped up) or as
+// fast as possible.
+//
+// Latency is measured from sending a request to receiving its reply on the
+// same connection: the echo of a SEND_MESSAGE, the final RECEIVE_HISTORY for a
+// REQUEST_HISTORY, the SEARCH_RESULTS for a SEARCH_HISTORY, and the HEARTBEAT
+// for a HEARTBEAT.
+
+#include "capture.h"
+#include "network.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <scrump/args.h>
+#include <scrump/json.h>
+#include <scrump/logging.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using namespace scrump;
+using namespace std;
+
+USAGE("Usage: replay --capture <path> [--host <host>] [--port <port>]\n"
+      "              [--speed <speed>]\n"
+      "\n"
+      "  path  - Capture file written by a server with --capture.\n"
+      "  speed - Playback speed relative to the capture, or 'max'.");
+
+OPTION(string, capture, "", "Capture file to replay.");
+OPTION(string, host, "127.0.0.1", "Host address of the server.");
+OPTION(int, port, 17994, "Port of the server.");
+OPTION(string, speed, "1",
+       "Playback speed relative to the capture, such as 1 or 10, or 'max' to "
+       "send every frame as fast as possible.");
+OPTION(int, drain_seconds, 5,
+       "Time to wait for outstanding replies after the last frame, in "
+       "seconds.");
+
+// The kinds of request whose latency is measured.
+enum RequestKind { SEND, HISTORY, SEARCH, PING, NUM_REQUEST_KINDS };
+const char* const REQUEST_NAMES[] = {"SEND_MESSAGE", "REQUEST_HISTORY",
+                                     "SEARCH_HISTORY", "HEARTBEAT"};
+
+typedef chrono::steady_clock Clock;
+
+// A record from the capture, with what to expect in reply to it.
+struct Step {
+  CaptureRecord record;
+  bool has_reply = false;
+  RequestKind kind;
+  string text;  // For SEND: the text which will be echoed back.
+};
+
+// Work out what reply a frame should get. Frames which do not parse are still
+// sent, but nothing is expected back.
+static void classify(Connection::Mode mode, Step* step) {
+  const string& frame = step->record.frame;
+  MessageType type;
+  Message<SEND_MESSAGE> send;
+  try {
+    if (mode == Connection::BINARY) {
+      const char* position = frame.data();
+      const char* end = position + frame.size();
+      uint64_t type_value, length;
+      if (!network::readVarUint(&position, end, &type_value) ||
+          !network::readVarUint(&position, end, &length) ||
+          length > static_cast<uint64_t>(end - position)) {
+        return;
+      }
+      type = static_cast<MessageType>(type_value);
+      if (type == SEND_MESSAGE &&
+          !network::readBinary(&position, position + length, &send)) {
+        return;
+      }
+    } else {
+      DataNode node = JSON::parse(frame);
+      DataNode::Object& object = node.asObject();
+      if (!fromString(object.at("type").asString(), &type)) return;
+      if (type == SEND_MESSAGE) network::decode(object.at("payload"), &send);
+    }
+  } catch (const exception&) {
+    return;
+  }
+  switch (type) {
+    case SEND_MESSAGE: step->kind = SEND; break;
+    case REQUEST_HISTORY: step->kind = HISTORY; break;
+    case SEARCH_HISTORY: step->kind = SEARCH; break;
+    case HEARTBEAT: step->kind = PING; break;
+    default: return;
+  }
+  step->has_reply = true;
+  step->text = move(send.text);
+}
+
+class Stats {
+ public:
+  void add(RequestKind kind, Clock::duration latency) {
+    unique_lock<mutex> lock(mutex_);
+    latencies_[kind].push_back(latency);
+  }
+
+  void received() { num_received_++; }
+  uint64_t numReceived() const { return num_received_; }
+
+  void print() {
+    unique_lock<mutex> lock(mutex_);
+    cout << "Latency (ms)         count      p50      p90      p99      max\n";
+    for (int kind = 0; kind < NUM_REQUEST_KINDS; kind++) {
+      vector<Clock::duration>& latencies = latencies_[kind];
+      if (latencies.empty()) continue;
+      sort(latencies.begin(), latencies.end());
+      auto percentile = [&](double p) {
+        size_t index = static_cast<size_t>(p * (latencies.size() - 1));
+        return chrono::duration<double, milli>(latencies[index]).count();
+      };
+      cout << left << setw(16) << REQUEST_NAMES[kind] << right << setw(10)
+           << latencies.size() << fixed << setprecision(2) << setw(9)
+           << percentile(0.5) << setw(9) << percentile(0.9) << setw(9)
+           << percentile(0.99) << setw(9) << percentile(1) << "\n";
+    }
+  }
+
+ private:
+  mutex mutex_;
+  vector<Clock::duration> latencies_[NUM_REQUEST_KINDS];
+  atomic<uint64_t> num_received_{0};
+};
+
+// One connection from the capture, with a thread which reads its replies.
+class Client {
+ public:
+  Client(Connection::Mode mode, Stats* stats);
+  ~Client();
+
+  // Send a frame, noting the reply that it should get.
+  void send(const Step& step);
+
+  // Close the connection, as the captured client did.
+  void close() { shutdown(connection_->fd(), SHUT_RDWR); }
+
+  size_t numPending();
+
+ private:
+  void replied(RequestKind kind);
+  void echoed(const string& text);
+
+  unique_ptr<Connection> connection_;
+  Stats& stats_;
+  thread reader_;
+
+  // Requests awaiting a reply, oldest first. Replies of each kind arrive in
+  // the order that their requests were sent.
+  mutex mutex_;
+  deque<Clock::time_point> pending_[NUM_REQUEST_KINDS];
+  deque<string> pending_texts_;  // For SEND, alongside its times.
+};
+
+Client::Client(Connection::Mode mode, Stats* stats) : stats_(*stats) {
+  StreamSocket socket;
+  socket.connect(options::host, options::port);
+  connection_.reset(new Connection(mode, move(socket)));
+  connection_->on<RECEIVE_MESSAGE>([this](ChatMessage&& message) {
+    stats_.received();
+    if (message.category == ChatMessage::CHAT_MESSAGE) echoed(message.text);
+  });
+  connection_->on<RECEIVE_HISTORY_PART>([](Message<RECEIVE_HISTORY_PART>&&) {});
+  connection_->on<RECEIVE_HISTORY>([this](Message<RECEIVE_HISTORY>&&) {
+    replied(HISTORY);
+  });
+  connection_->on<SEARCH_RESULTS>([this](Message<SEARCH_RESULTS>&&) {
+    replied(SEARCH);
+  });
+  connection_->on<HEARTBEAT>([this](Message<HEARTBEAT>&&) {
+    replied(PING);
+  });
+  reader_ = thread([this] {
+    try {
+      while (true) connection_->poll();
+    } catch (const exception&) {
+      // The connection was closed.
+    }
+  });
+}
+
+Client::~Client() {
+  close();
+  reader_.join();
+}
+
+void Client::send(const Step& step) {
+  if (step.has_reply) {
+    unique_lock<mutex> lock(mutex_);
+    pending_[step.kind].push_back(Clock::now());
+    if (step.kind == SEND) pending_texts_.push_back(step.text);
+  }
+  connection_->sendFrame(step.record.frame);
+}
+
+size_t Client::numPending() {
+  unique_lock<mutex> lock(mutex_);
+  size_t total = 0;
+  for (const auto& pending : pending_) total += pending.size();
+  return total;
+}
+
+void Client::replied(RequestKind kind) {
+  Clock::time_point now = Clock::now();
+  unique_lock<mutex> lock(mutex_);
+  if (pending_[kind].empty()) return;
+  stats_.add(kind, now - pending_[kind].front());
+  pending_[kind].pop_front();
+}
+
+void Client::echoed(const string& text) {
+  // Other users' messages are broadcast too, so only an echo of a pending
+  // message counts. Any older messages were not echoed, so are forgotten.
+  Clock::time_point now = Clock::now();
+  unique_lock<mutex> lock(mutex_);
+  auto match = find(pending_texts_.begin(), pending_texts_.end(), text);
+  if (match == pending_texts_.end()) return;
+  size_t count = match - pending_texts_.begin() + 1;
+  stats_.add(SEND, now - pending_[SEND][count - 1]);
+  pending_texts_.erase(pending_texts_.begin(), pending_texts_.begin() + count);
+  pending_[SEND].erase(pending_[SEND].begin(),
+                       pending_[SEND].begin() + count);
+}
+
+int scrump_main(int argc, char* args[]) {
+  double speed = 0;
+  if (options::speed != "max") {
+    try {
+      speed = stod(options::speed);
+    } catch (const exception&) {
+    }
+    if (!(speed > 0)) {
+      LOG(ERROR) << "Invalid speed '" << options::speed << "'.";
+      return 1;
+    }
+  }
+
+  // Load the whole capture first, so that reading it does not disturb the
+  // timing.
+  vector<Step> steps;
+  map<uint64_t, Connection::Mode> modes;
+  uint64_t num_frames = 0;
+  try {
+    CaptureReader reader(options::capture);
+    Step step;
+    while (reader.next(&step.record)) {
+      if (step.record.kind == CAPTURE_OPEN)
+        modes[step.record.connection] = step.record.mode;
+      step.has_reply = false;
+      if (step.record.kind == CAPTURE_FRAME) {
+        auto mode = modes.find(step.record.connection);
+        if (mode != modes.end()) classify(mode->second, &step);
+        num_frames++;
+      }
+      steps.push_back(move(step));
+    }
+  } catch (const exception& error) {
+    LOG(ERROR) << error.what();
+    return 1;
+  }
+  LOG(INFO) << "Loaded " << steps.size() << " records: " << modes.size()
+            << " connections, " << num_frames << " frames.";
+
+  Stats stats;
+  map<uint64_t, unique_ptr<Client>> clients;
+  uint64_t num_sent = 0, num_failed = 0, num_bytes = 0;
+  Clock::duration lag = Clock::duration::zero();
+  Clock::time_point start = Clock::now();
+  for (const Step& step : steps) {
+    if (speed > 0) {
+      Clock::time_point due = start + chrono::duration_cast<Clock::duration>(
+          chrono::duration<double, micro>(step.record.time / speed));
+      this_thread::sleep_until(due);
+      lag = max(lag, Clock::now() - due);
+    }
+    uint64_t id = step.record.connection;
+    try {
+      switch (step.record.kind) {
+        case CAPTURE_OPEN:
+          clients[id].reset(new Client(step.record.mode, &stats));
+          break;
+        case CAPTURE_FRAME: {
+          auto client = clients.find(id);
+          if (client == clients.end() || !client->second) {
+            num_failed++;
+            break;
+          }
+          client->second->send(step);
+          num_sent++;
+          num_bytes += step.record.frame.size();
+          break;
+        }
+        case CAPTURE_CLOSE: {
+          auto client = clients.find(id);
+          if (client != clients.end() && client->second)
+            client->second->close();
+          break;
+        }
+      }
+    } catch (const exception& error) {
+      // Frames for a connection which could not be opened are not sent.
+      LOG(ERROR) << "Connection " << id << ": " << error.what();
+      if (step.record.kind == CAPTURE_FRAME) num_failed++;
+      clients[id].reset();
+    }
+  }
+  double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+  // Wait for the replies to anything still outstanding.
+  size_t pending = 0;
+  Clock::time_point deadline =
+      Clock::now() + chrono::seconds(options::drain_seconds);
+  do {
+    pending = 0;
+    for (auto& client : clients)
+      if (client.second) pending += client.second->numPending();
+    if (pending == 0) break;
+    this_thread::sleep_for(chrono::milliseconds(10));
+  } while (Clock::now() < deadline);
+  for (auto& client : clients)
+    if (client.second) client.second->close();
+  clients.clear();
+
+  cout << "Sent " << num_sent << " frames (" << num_bytes / 1024 << " KiB) in "
+       << fixed << setprecision(2) << seconds << " s: " << setprecision(0)
+       << num_sent / seconds << " frames/s, "
+       << setprecision(2) << num_bytes / seconds / (1 << 20) << " MiB/s.\n";
+  cout << "Received " << stats.numReceived() << " messages ("
+       << setprecision(0) << stats.numReceived() / seconds << "/s).\n";
+  if (speed > 0) {
+    cout << "Fell behind the capture by up to " << setprecision(1)
+         << chrono::duration<double, milli>(lag).count() << " ms.\n";
+  }
+  if (num_failed > 0) cout << num_failed << " frames could not be sent.\n";
+  if (pending > 0) cout << pending << " requests got no reply.\n";
+  stats.print();
+  return 0;
+}
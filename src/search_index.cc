@@ -0,0 +1,144 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+static uint64_t readAt(const string& data, size_t* offset) {
+  const char* position = data.data() + *offset;
+  uint64_t value = 0;
+  network::readVarUint(&position, data.data() + data.length(), &value);
+  *offset = position - data.data();
+  return value;
+}
+
+PostingList::Iterator::Iterator(const PostingList& list) : list_(list) {
+  if (list_.size_ == 0) {
+    done_ = true;
+    return;
+  }
+  value_ = readAt(list_.data_, &offset_);
+}
+
+void PostingList::Iterator::seek(uint64_t message_id) {
+  if (done_ || value_ >= message_id) return;
+
+  // Jump to the last block which starts at or before message_id, if that is
+  // ahead of the current position.
+  auto block = upper_bound(
+      list_.skips_.begin(), list_.skips_.end(), message_id,
+      [](uint64_t id, const Skip& skip) { return id < skip.message_id; });
+  size_t block_index = (block - list_.skips_.begin()) - 1;
+  if (block_index * BLOCK_SIZE > index_) {
+    index_ = block_index * BLOCK_SIZE;
+    offset_ = list_.skips_[block_index].offset;
+    value_ = readAt(list_.data_, &offset_);
+  }
+
+  while (!done_ && value_ < message_id) next();
+}
+
+void PostingList::Iterator::next() {
+  if (++index_ >= list_.size_) {
+    done_ = true;
+    return;
+  }
+  uint64_t delta = readAt(list_.data_, &offset_);
+  value_ = index_ % BLOCK_SIZE == 0 ? delta : value_ + delta;
+}
+
+void PostingList::add(uint64_t message_id) {
+  if (size_ > 0 && message_id <= last_id_) return;
+  if (size_ % BLOCK_SIZE == 0) {
+    skips_.push_back({message_id, data_.length()});
+    network::appendVarUint(&data_, message_id);
+  } else {
+    network::appendVarUint(&data_, message_id - last_id_);
+  }
+  size_++;
+  last_id_ = message_id;
+}
+
+void SearchIndex::add(const ChatMessage& message) {
+  for (const string& term : terms(message.text))
+    terms_[term].add(message.message_id);
+  if (message.category == ChatMessage::CHAT_MESSAGE)
+    senders_[message.sender_name].add(message.message_id);
+}
+
+void SearchIndex::clear() {
+  terms_.clear();
+  senders_.clear();
+}
+
+vector<uint64_t> SearchIndex::search(const string& query,
+                                     const string& sender, uint64_t start_id,
+                                     uint64_t end_id, size_t max_results,
+                                     uint64_t* next_id) const {
+  *next_id = 0;
+  vector<uint64_t> results;
+
+  // Every list must match, so a missing term or sender means no results.
+  vector<const PostingList*> lists;
+  for (const string& term : terms(query)) {
+    auto i = terms_.find(term);
+    if (i == terms_.end()) return results;
+    lists.push_back(&i->second);
+  }
+  if (!sender.empty()) {
+    auto i = senders_.find(sender);
+    if (i == senders_.end()) return results;
+    lists.push_back(&i->second);
+  }
+  if (lists.empty() || max_results == 0) return results;
+
+  // Intersect the lists, driven by the shortest. Each list skips ahead to the
+  // current candidate, and any list which overshoots it sets a new candidate.
+  sort(lists.begin(), lists.end(),
+       [](const PostingList* a, const PostingList* b) {
+    return a->size() < b->size();
+  });
+  vector<PostingList::Iterator> iterators;
+  iterators.reserve(lists.size());
+  for (const PostingList* list : lists) iterators.emplace_back(*list);
+  uint64_t candidate = start_id;
+  while (true) {
+    bool matched = true;
+    for (PostingList::Iterator& iterator : iterators) {
+      iterator.seek(candidate);
+      if (iterator.done() || (end_id != 0 && iterator.value() >= end_id))
+        return results;
+      if (iterator.value() > candidate) {
+        candidate = iterator.value();
+        matched = false;
+        break;
+      }
+    }
+    if (!matched) continue;
+
+    results.push_back(candidate++);
+    if (results.size() == max_results) {
+      *next_id = candidate;
+      return results;
+    }
+  }
+}
+
+vector<string> SearchIndex::terms(const string& text) {
+  vector<string> output;
+  string term;
+  for (char c : text) {
+    unsigned char byte = c;
+    if (byte >= 0x80 || isalnum(byte)) {
+      term.push_back(byte < 0x80 ? tolower(byte) : c);
+    } else if (!term.empty()) {
+      output.push_back(move(term));
+      term.clear();
+    }
+  }
+  if (!term.empty()) output.push_back(move(term));
+  sort(output.begin(), output.end());
+  output.erase(unique(output.begin(), output.end()), output.end());
+  return output;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "network.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A sorted list of message IDs, stored as varuint deltas. Every BLOCK_SIZE
+// entries, an ID is stored in full and recorded in a skip list, so that a
+// reader can jump close to any ID without decoding everything before it.
+class PostingList {
+ public:
+  static const size_t BLOCK_SIZE = 64;
+
+  class Iterator {
+   public:
+    Iterator(const PostingList& list);
+
+    bool done() const { return done_; }
+    uint64_t value() const { return value_; }
+
+    // Advance to the first ID which is at least message_id.
+    void seek(uint64_t message_id);
+    void next();
+
+   private:
+    const PostingList& list_;
+    size_t offset_ = 0;  // Offset of the entry after the current one.
+    size_t index_ = 0;   // Index of the current entry.
+    uint64_t value_ = 0;
+    bool done_ = false;
+  };
+
+  // Append an ID. IDs must be added in increasing order, and duplicates of the
+  // last ID are ignored.
+  void add(uint64_t message_id);
+
+  size_t size() const { return size_; }
+
+ private:
+  struct Skip {
+    uint64_t message_id;  // First ID of the block.
+    size_t offset;        // Offset of the block in data_.
+  };
+
+  std::string data_;
+  std::vector<Skip> skips_;
+  size_t size_ = 0;
+  uint64_t last_id_ = 0;
+};
+
+// An inverted index over the message history, mapping each term and each
+// sender to the IDs of the messages which contain it. Terms are runs of
+// letters and digits, compared case-insensitively. Any byte outside of ASCII
+// is treated as a letter, so words in other scripts are kept whole.
+class SearchIndex {
+ public:
+  // Index a message. Messages must be added in ID order.
+  void add(const ChatMessage& message);
+
+  void clear();
+
+  // Find the IDs of messages in [start_id, end_id) which contain every term in
+  // query and, if sender is non-empty, were sent by sender. An end_id of 0
+  // means that there is no upper bound. At most max_results IDs are returned,
+  // in increasing order. If the results were cut short, *next_id is set to
+  // the start_id from which to continue. Otherwise, it is set to 0.
+  //
+  // A search with neither terms nor sender matches nothing.
+  std::vector<uint64_t> search(const std::string& query,
+                               const std::string& sender, uint64_t start_id,
+                               uint64_t end_id, size_t max_results,
+                               uint64_t* next_id) const;
+
+  // Split text into its distinct lowercase terms.
+  static std::vector<std::string> terms(const std::string& text);
+
+ private:
+  std::unordered_map<std::string, PostingList> terms_;
+  std::unordered_map<std::string, PostingList> senders_;
+};
@@ -1,68 +1,584 @@
+#include "capture.h"
+#include "handoff.h"
+#include "mpsc_queue.h"
 #include "network.h"
+#include "search_index.h"
+#include "shm_ring.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "unix_socket.h"
+#include "uring.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <poll.h>
+#include <pthread.h>
 #include <queue>
 #include <scrump/args.h>
 #include <scrump/logging.h>
+#include <set>
+#include <sstream>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 using namespace scrump;
 using namespace std;
 
 OPTION(string, host, "0.0.0.0", "Host address to bind to.");
 OPTION(int, port, 17994, "Port to bind to.");
+OPTION(string, peer_host, "127.0.0.1",
+       "Host address to accept connections from follower servers on. Peers "
+       "are not authenticated, so only bind this to a trusted network.");
+OPTION(int, peer_port, 0,
+       "Port to accept connections from follower servers on. 0 disables.");
+OPTION(string, leader, "",
+       "Peer address (host:port) of the server which sequences messages for "
+       "the cluster. If unset, this server sequences messages itself.");
+OPTION(string, unix_socket, "",
+       "Path of a Unix domain socket to also accept connections on. Local "
+       "connections can read broadcasts from a shared-memory ring instead.");
+OPTION(string, unix_socket_mode, "0600",
+       "Permissions of the Unix domain socket, in octal. Anyone who can "
+       "write to it can connect.");
+OPTION(int, shm_ring_size, 16 << 20,
+       "Size of the shared-memory ring for local readers, in bytes.");
+OPTION(string, io_backend, "auto",
+       "Backend for sending broadcasts: 'blocking' sends to each connection "
+       "in turn, 'io_uring' submits all sends in a batch, and 'auto' uses "
+       "io_uring if it is available. Neither waits for a slow connection.");
+OPTION(int, uring_entries, 1024,
+       "Number of sends that the io_uring backend can have in flight.");
+OPTION(int, stats_interval, 60,
+       "Interval between logging broadcast statistics, in seconds. 0 disables "
+       "the statistics.");
+OPTION(int, idle_timeout, 90,
+       "Disconnect connections which send nothing for this long, in seconds. "
+       "This only applies once a connection has sent a heartbeat, so clients "
+       "which never send them are not disconnected. 0 disables this.");
+OPTION(int, write_stall_timeout, 30,
+       "Disconnect connections which make no progress on receiving a message "
+       "for this long, in seconds. 0 disables this.");
+OPTION(int, heartbeat_interval, 30,
+       "Interval between heartbeats sent to the leader, in seconds.");
+OPTION(bool, connection_notices, true,
+       "Announce each user who connects or is disconnected by an error.");
+OPTION(int, connection_stack_size, 256 << 10,
+       "Stack size of each connection thread, in bytes.");
+OPTION(int, max_frame_size, 1 << 20,
+       "Disconnect users who send a message larger than this, in bytes.");
+OPTION(string, rate_limits, "SEND_MESSAGE:100:200:delay,IDENTIFY:1:5:drop",
+       "Comma-separated limits on how often each user may send each message "
+       "type, as TYPE:rate:burst:action. The rate is in messages per second, "
+       "burst is how many may be sent at once, and messages over the limit "
+       "are dropped or delayed, according to action.");
+OPTION(string, capture, "",
+       "Record every frame received from users to this file, for bin/replay. "
+       "The file is replaced whenever the server starts, except that a hot "
+       "restart with the same path carries on the previous server's "
+       "capture.");
+OPTION(string, handoff_socket, "",
+       "Path of a Unix domain socket for hot restarts. If a server is already "
+       "running with the same path, this server takes over its listeners, "
+       "connections and history instead of starting afresh.");
 
 typedef map<uint64_t, ChatMessage> Messages;
 
+// Maximum number of messages a follower requests from the leader at once.
+const uint64_t PEER_HISTORY_PAGE_SIZE = 1000;
+
+// Maximum number of messages from the leader to hold while waiting for an
+// earlier one. Beyond this, the follower reconnects and catches up instead.
+const size_t MAX_EARLY_MESSAGES = 10 * PEER_HISTORY_PAGE_SIZE;
+
+// Maximum number of messages returned by a single search.
+const uint64_t MAX_SEARCH_RESULTS = 1000;
+
+// Bulk replies are sent in pieces of roughly this many bytes, so that live
+// messages can be sent to the same connection in between.
+const size_t BULK_PART_SIZE = 16384;
+
+// Resolution of connection timeouts.
+const int64_t TIMER_TICK_MS = 100;
+
+// Maximum number of names listed in a notice about timed out connections.
+const size_t MAX_LISTED_NAMES = 10;
+
+// A hot restart is abandoned if the old server's connections take longer than
+// this to become idle, or the new server takes longer than this to respond.
+const chrono::seconds HANDOFF_TIMEOUT(30);
+
+static void setHandoffTimeout(int fd, chrono::seconds timeout) {
+  timeval value = {static_cast<time_t>(timeout.count()), 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &value, sizeof(value));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &value, sizeof(value));
+}
+
 typedef string Address;
 typedef string Username;
 
 struct User {
-  User(Socket socket);
+  // The connection header has already been read. Connections handed over by a
+  // previous server may also have received data which has not been parsed.
+  User(StreamSocket socket, Connection::Mode mode, string buffered,
+       string display_name, bool is_peer);
 
-  mutex name_mutex;
-  string display_name;
+  string display_name;  // Guarded by Server::names_mutex_.
 
+  bool is_peer = false;
   Connection connection;
+  uint64_t capture_id = 0;  // This connection's number in the capture.
+
+  // Checks for timeouts, and whether this connection was closed by them.
+  TimerWheel::Timer timer;
+  atomic<bool> timed_out{false};
+  atomic<bool> sends_heartbeats{false};  // Only then can it time out as idle.
 };
 
-User::User(Socket socket)
-    : display_name(socket.hostPort()), connection(move(socket)) {}
+User::User(StreamSocket socket, Connection::Mode mode, string buffered,
+           string display_name, bool is_peer)
+    : display_name(move(display_name)), is_peer(is_peer),
+      connection(mode, move(socket), move(buffered)) {}
 
 typedef map<Address, User*> Users;
 
+// Roughly the size of a message once encoded, ignoring any escaping.
+static size_t estimateSize(const ChatMessage& message) {
+  return message.sender_name.length() + message.text.length() + 64;
+}
+
+// Parse octal file permissions, such as --unix_socket_mode. Throws if they are
+// malformed.
+static mode_t parseMode(const string& text) {
+  size_t end = 0;
+  unsigned long mode = 0;
+  try {
+    mode = stoul(text, &end, 8);
+  } catch (const logic_error&) {
+  }
+  if (end == 0 || end != text.length() || mode > 0777) {
+    throw runtime_error("Invalid mode '" + text +
+                        "'. Expected octal permissions such as 0660.");
+  }
+  return mode;
+}
+
+// Parse the whole of some text as a finite number. Returns false if it is
+// malformed.
+static bool parseNumber(const string& text, double* value) {
+  size_t end = 0;
+  try {
+    *value = stod(text, &end);
+  } catch (const logic_error&) {
+    return false;
+  }
+  return end != 0 && end == text.length() && isfinite(*value);
+}
+
+typedef vector<pair<MessageType, RateLimit>> RateLimits;
+
+// Parse --rate_limits. Throws if it is malformed, or outside the range which
+// HandlerTable::limit() accepts.
+static RateLimits parseRateLimits(const string& text) {
+  RateLimits limits;
+  stringstream list(text);
+  string item;
+  while (getline(list, item, ',')) {
+    stringstream fields(item);
+    string type, rate, burst, action;
+    pair<MessageType, RateLimit> limit;
+    bool valid = getline(fields, type, ':') && getline(fields, rate, ':') &&
+                 getline(fields, burst, ':') && getline(fields, action) &&
+                 fromString(type, &limit.first) &&
+                 parseNumber(rate, &limit.second.rate) &&
+                 parseNumber(burst, &limit.second.burst) &&
+                 (action == "drop" || action == "delay");
+    if (!valid) {
+      throw runtime_error("Invalid rate limit '" + item +
+                          "'. Expected TYPE:rate:burst:drop|delay.");
+    }
+    double interval = 1e6 / limit.second.rate;
+    if (!(limit.second.rate > 0) || !(interval >= 1) ||
+        !(limit.second.burst >= 1) ||
+        !(limit.second.burst * interval <= network::MAX_REFILL_TIME)) {
+      throw runtime_error("Invalid rate limit '" + item +
+                          "'. The rate must be above 0 and at most 1000000, "
+                          "and the burst from 1 to 1e9 times the rate.");
+    }
+    limit.second.action = action == "drop" ? RateLimit::DROP : RateLimit::DELAY;
+    limits.push_back(limit);
+  }
+  return limits;
+}
+
+// Run a function on a detached thread with the given stack size. Stack pages
+// are only touched as they are used, so the size barely affects resident
+// memory, but all of it counts towards the kernel's commit limit when
+// overcommit is strict. There, the default of 8 MiB per thread refuses new
+// connections long before memory runs out. Connection threads need little
+// stack: the deepest recursion is parsing a JSON message, which is limited to
+// network::MAX_JSON_DEPTH levels.
+template <typename Function>
+static void startThread(Function&& function, size_t stack_size) {
+  typedef typename decay<Function>::type Body;
+  unique_ptr<Body> argument(new Body(forward<Function>(function)));
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, stack_size);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int result = pthread_create(
+      &thread, &attributes,
+      [](void* argument) -> void* {
+        unique_ptr<Body> body(static_cast<Body*>(argument));
+        (*body)();
+        return nullptr;
+      },
+      argument.get());
+  pthread_attr_destroy(&attributes);
+  if (result != 0)
+    throw runtime_error("Failed to start thread: " + string(strerror(result)));
+  argument.release();
+}
+
 class Server {
  public:
+  Server();
+
   void run();
 
-  void serve(Socket socket);
+  // Serve a newly accepted connection, once it has sent its header.
+  void serve(int fd, ListenerKind kind);
+  void serveAdopted(Address address, Slab<User>::Pointer user);
 
   void notify(string message);
   void send(string sender, string text);
 
  private:
+  // Queue a message to be assigned an ID and broadcast. This does not wait
+  // for the message to be sent.
   void addMessage(ChatMessage&& message);
 
-  mutex message_mutex_;
+  // Assign IDs to queued messages and commit them, a batch at a time.
+  void sequence();
+
+  // Store a batch of messages which have been assigned IDs in the history,
+  // and broadcast them.
+  void commit(vector<ChatMessage>* messages);
+
+  void sendHistory(Connection& connection,
+                   const Message<REQUEST_HISTORY>& request);
+  void sendSearchResults(Connection& connection,
+                         const Message<SEARCH_HISTORY>& request);
+
+  // Servers can form a cluster in which one server, the leader, assigns the
+  // IDs for every message. Followers relay new messages to the leader, and
+  // the leader broadcasts each sequenced message back to every follower, so
+  // all servers see the same messages in the same order.
+  void followLeader();
+  void relay(ChatMessage&& message);
+  void deliver(vector<ChatMessage>&& messages);
+
+  // Send messages to all connected users, without waiting for any of them.
+  // Frames which cannot be written at once are queued on their connection,
+  // and the connection is retried on each timer tick until it catches up.
+  // These must be called with users_mutex_ held.
+  void broadcast(const vector<ChatMessage>& messages);
+  void broadcastBatch(EncodedMessages<RECEIVE_MESSAGE>* encoded);
+  void post(const Address& address, User* user, const string& frame);
+  void flushBacklogged();
+
+  // Accept connections until the process exits. A hot restart parks the
+  // thread, and connections which arrive meanwhile wait in the listener's
+  // backlog for whichever server carries on.
+  void acceptConnections(int listener, ListenerKind kind);
+
+  // Read a connection header, leaving anything after it unread. Returns false
+  // if the connection closes first. A hot restart parks the thread, and the
+  // connection is handed over with its header still unread.
+  bool readHeader(int fd, ListenerKind kind, string* header);
+
+  // Local connections arrive on a Unix domain socket. These can either be
+  // ordinary connections, or readers of the shared-memory ring, which receive
+  // every broadcast without the server sending to them individually.
+  void serveRingReader(StreamSocket socket);
+
+  void logStats();
+
+  // System calls made sending broadcasts, by either backend. The server only
+  // uses post() and flush() for broadcasts and what they leave queued, so
+  // every write that Connection counts is part of one.
+  uint64_t numBroadcastSyscalls() const {
+    return Connection::numWrites() + num_uring_syscalls_;
+  }
+
+  // Reply to a "STATS\n" header with the counts which logStats() reports.
+  void sendStats(StreamSocket& socket);
+
+  // Connections which receive nothing for too long, or which stall while
+  // being sent to, are shut down by a timer. Their users are announced in a
+  // single notice per tick rather than individually.
+  void watchConnections();
+  int64_t checkConnection(User* user, int64_t now);
+  void heartbeatLeader(int64_t now);
+
+  // Track connections, so that they can be handed over.
+  void addUser(const Address& address, User* user);
+  void removeUser(const Address& address, User* user);
+  void addRingReader(int fd);
+  void removeRingReader(int fd);
+
+  // Start a thread which must stop for a hot restart, which it does by calling
+  // park() whenever interrupt_fd_ is readable. A hot restart waits for every
+  // such thread to either park or finish. These threads are started with a
+  // small stack, since there is one for every connection.
+  template <typename Function>
+  void startActiveThread(Function&& function) {
+    {
+      unique_lock<mutex> handoff_lock(handoff_mutex_);
+      num_active_++;
+    }
+    try {
+      startThread([this, function = forward<Function>(function)]() mutable {
+        function();
+        finishActive();
+      }, options::connection_stack_size);
+    } catch (...) {
+      finishActive();
+      throw;
+    }
+  }
+  void finishActive();
+
+  // Handle messages from a connection until it fails. Users and peers share
+  // a handler table each, which finds the User through the connection's
+  // context.
+  void setUpHandlers();
+  void handleUser(const Address& address, User* user);
+  void handlePeer(const Address& address, User* user);
+
+  // A hot restart replaces a running server with a new process, without
+  // dropping any connections. The old server parks every active thread once it
+  // has finished with any message already received, stops sequencing, and
+  // sends its listeners, connections, history and unsequenced messages to the
+  // new server. Once the new server confirms that it has
+  // everything, the old server exits. If anything fails, the old server
+  // carries on as before.
+  bool takeOver();
+  void acceptHandoffs();
+  void handOff(int fd);
+  void sendState(int fd, const vector<ChatMessage>& pending);
+
+  // Called by active threads when interrupted for a hot restart. Returns if
+  // the restart fails.
+  void park();
+
+  unique_ptr<StreamSocket> listener_, peer_listener_;
+  int unix_listener_ = -1;
+  TimerWheel timers_{TIMER_TICK_MS, network::monotonicMilliseconds()};
+  vector<string> timed_out_names_;  // Guarded by names_mutex_.
+
+  unique_ptr<Uring> uring_;  // Null if using the blocking backend.
+  unique_ptr<ShmRingWriter> ring_;  // Null if there is no Unix socket.
+  unique_ptr<CaptureWriter> capture_;  // Null unless capturing traffic.
+  atomic<uint64_t> num_broadcasts_{0}, num_uring_syscalls_{0};
+
+  // Messages waiting to be sequenced. The sequencer only sleeps when this is
+  // empty, so producers only need to wake it when they push the first message.
+  MpscQueue<ChatMessage> ingest_;
+  mutex ingest_mutex_;
+  condition_variable ingest_available_;
+
+  // Held while assigning IDs and committing messages, so that a hot restart
+  // can stop both.
+  mutex sequence_mutex_;
+
+  // The next ID and any early messages belong to the sequencer thread or, on a
+  // follower, to the thread which follows the leader.
   uint64_t next_id_ = 0;
+  Messages early_messages_;  // Sequenced messages received out of order.
+
+  mutex message_mutex_;
   Messages messages_;
+  SearchIndex index_;  // Indexes messages_.
+
+  mutex leader_mutex_;
+  Connection* leader_ = nullptr;  // Null if not connected to the leader.
+  vector<ChatMessage> pending_relays_;
 
   mutex users_mutex_;
   Users users_;
+  set<User*> backlogged_;  // Users with frames queued. Guarded as users_.
+
+  // Users are allocated together, rather than each on its own thread's stack.
+  Slab<User> user_slab_;
+  mutex names_mutex_;  // Guards every user's display_name.
+  HandlerTable user_handlers_, peer_handlers_;
+  vector<MessageType> limited_types_;  // Types limited in user_handlers_.
+
+  // Readable while a hot restart is in progress, to interrupt connections.
+  int interrupt_fd_ = -1;
+
+  mutex handoff_mutex_;
+  condition_variable handoff_changed_;
+  bool handing_off_ = false;
+  size_t num_active_ = 0;  // Threads started by startActiveThread().
+  size_t num_parked_ = 0;
+  set<int> ring_readers_;
+  map<int, ListenerKind> fresh_connections_;  // Parked before their header.
+
+  // State taken over from a previous server, which is started by run().
+  vector<pair<Address, Slab<User>::Pointer>> adopted_users_;
+  vector<int> adopted_ring_readers_;
+  vector<pair<int, ListenerKind>> adopted_fresh_;
+  vector<ChatMessage> adopted_pending_;
+  struct AdoptedCapture {  // fd is -1 unless the previous server captured.
+    int fd = -1;
+    string path;
+    uint64_t last_connection;
+    int64_t last_time;
+  } adopted_capture_;
 };
 
+Server::Server() {
+  setUpHandlers();
+  if (options::io_backend == "blocking") return;
+  try {
+    uring_.reset(new Uring(options::uring_entries));
+    LOG(INFO) << "Using io_uring for broadcasts.";
+  } catch (const exception& error) {
+    LOG(WARNING) << "io_uring is unavailable (" << error.what()
+                 << "). Falling back to blocking sends.";
+  }
+}
+
 void Server::run() {
-  LOG(VERBOSE) << "Binding to " << options::host << ":" << options::port;
-  Socket socket;
-  socket.bind(options::host, options::port);
+  // Listeners taken over from a previous server are kept as they are, even if
+  // the options for this server differ.
+  bool restarted = false;
+  if (!options::handoff_socket.empty()) {
+    interrupt_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (interrupt_fd_ < 0)
+      throw runtime_error("Failed to create eventfd: " +
+                          string(strerror(errno)));
+    restarted = takeOver();
+  }
+
+  if (!listener_) {
+    LOG(VERBOSE) << "Binding to " << options::host << ":" << options::port;
+    listener_.reset(new StreamSocket);
+    listener_->bind(options::host, options::port);
+
+    LOG(VERBOSE) << "Listening for incoming connections..";
+    listener_->listen();
+  }
+  if (!peer_listener_ && options::peer_port != 0) {
+    peer_listener_.reset(new StreamSocket);
+    peer_listener_->bind(options::peer_host, options::peer_port);
+    peer_listener_->listen();
+  }
+  if (unix_listener_ == -1 && !options::unix_socket.empty()) {
+    unix_listener_ = listenUnix(options::unix_socket, SOCK_STREAM,
+                                parseMode(options::unix_socket_mode));
+  }
+  // Listeners are polled before accepting, so that the accepting thread can
+  // also be interrupted. A connection can be reset in between, so accepting
+  // must not block.
+  for (int listener : {listener_->fd(),
+                       peer_listener_ ? peer_listener_->fd() : -1,
+                       unix_listener_}) {
+    if (listener != -1) fcntl(listener, F_SETFL, O_NONBLOCK);
+  }
+  if (unix_listener_ != -1 && !ring_)
+    ring_.reset(new ShmRingWriter(options::shm_ring_size));
+  if (adopted_capture_.fd != -1 && adopted_capture_.path != options::capture) {
+    // The previous capture ends here, so connections are opened afresh in
+    // any new one.
+    close(adopted_capture_.fd);
+    adopted_capture_.fd = -1;
+    for (auto& adopted : adopted_users_) adopted.second->capture_id = 0;
+  }
+  if (adopted_capture_.fd != -1) {
+    capture_.reset(new CaptureWriter(adopted_capture_.fd,
+                                     adopted_capture_.last_connection,
+                                     adopted_capture_.last_time));
+  } else if (!options::capture.empty()) {
+    capture_.reset(new CaptureWriter(options::capture));
+  }
+  if (capture_) {
+    user_handlers_.onFrame(
+        [this](Connection& connection, const char* data, size_t length) {
+      User* user = static_cast<User*>(connection.context());
+      capture_->frame(user->capture_id, data, length);
+    });
+  }
 
-  LOG(VERBOSE) << "Listening for incoming connections..";
-  socket.listen();
+  if (options::stats_interval > 0) thread(&Server::logStats, this).detach();
+  startActiveThread([this] { watchConnections(); });
+  if (options::leader.empty()) thread(&Server::sequence, this).detach();
+  if (peer_listener_) {
+    LOG(INFO) << "Accepting peer connections.";
+    startActiveThread([this] {
+      acceptConnections(peer_listener_->fd(), PEER_LISTENER);
+    });
+  }
+  if (!options::leader.empty()) thread(&Server::followLeader, this).detach();
+  if (unix_listener_ != -1) {
+    LOG(INFO) << "Accepting local connections.";
+    startActiveThread([this] {
+      acceptConnections(unix_listener_, UNIX_LISTENER);
+    });
+  }
+
+  for (auto& adopted : adopted_users_) {
+    startActiveThread([this, address = move(adopted.first),
+                       user = move(adopted.second)]() mutable {
+      serveAdopted(move(address), move(user));
+    });
+  }
+  adopted_users_.clear();
+  for (int fd : adopted_ring_readers_)
+    startActiveThread([this, fd] { serveRingReader(StreamSocket(fd)); });
+  adopted_ring_readers_.clear();
+  for (const auto& fresh : adopted_fresh_) {
+    int fd = fresh.first;
+    ListenerKind kind = fresh.second;
+    startActiveThread([this, fd, kind] { serve(fd, kind); });
+  }
+  adopted_fresh_.clear();
+  for (ChatMessage& message : adopted_pending_) addMessage(move(message));
+  adopted_pending_.clear();
 
-  LOG(INFO) << "Server started on " << options::host << ":" << options::port;
-  while (true) thread(&Server::serve, this, socket.accept()).detach();
+  // This thread accepts TCP connections, so it is counted as active before a
+  // hot restart can start.
+  {
+    unique_lock<mutex> handoff_lock(handoff_mutex_);
+    num_active_++;
+  }
+  if (!options::handoff_socket.empty())
+    thread(&Server::acceptHandoffs, this).detach();
+
+  if (restarted) {
+    LOG(INFO) << "Server restarted.";
+  } else {
+    LOG(INFO) << "Server started on " << options::host << ":"
+              << options::port;
+  }
+  acceptConnections(listener_->fd(), TCP_LISTENER);
 }
 
 void Server::notify(string text) {
@@ -83,105 +599,1182 @@ void Server::send(string sender, string text) {
 }
 
 void Server::addMessage(ChatMessage&& message) {
-  // Store the message in the messages list.
-  unique_lock<mutex> message_lock(message_mutex_);
-  
-  uint64_t message_id = message.message_id = next_id_++;
+  // Followers leave sequencing to the leader.
+  if (!options::leader.empty()) return relay(move(message));
+
+  if (ingest_.push(move(message))) {
+    unique_lock<mutex> lock(ingest_mutex_);
+    ingest_available_.notify_one();
+  }
+}
+
+void Server::sequence() {
+  vector<ChatMessage> batch;
+  while (true) {
+    {
+      unique_lock<mutex> lock(ingest_mutex_);
+      ingest_available_.wait(lock, [this] { return !ingest_.empty(); });
+    }
+
+    // Everything which has been queued since the last batch is sequenced and
+    // sent together.
+    unique_lock<mutex> sequence_lock(sequence_mutex_);
+    ingest_.popAll(&batch);
+    for (ChatMessage& message : batch) message.message_id = next_id_++;
+    try {
+      commit(&batch);
+    } catch (const exception& error) {
+      // Nothing else sequences messages, so this thread must not die.
+      LOG(ERROR) << "Failed to commit messages: " << error.what();
+    }
+    batch.clear();
+  }
+}
+
+void Server::commit(vector<ChatMessage>* messages) {
+  // Store the messages in the message history. This happens first so that any
+  // message a user has received can also be found in the history.
+  {
+    unique_lock<mutex> message_lock(message_mutex_);
+    for (const ChatMessage& message : *messages) {
+      messages_.emplace(message.message_id, message);
+      index_.add(message);
+    }
+  }
+
+  // Forward the messages to all connected users.
+  unique_lock<mutex> users_lock(users_mutex_);
+  broadcast(*messages);
+}
+
+void Server::sendHistory(Connection& connection,
+                         const Message<REQUEST_HISTORY>& request) {
+  // Lock the message list and extract the requested messages.
+  Message<RECEIVE_HISTORY> history;
+  {
+    unique_lock<mutex> lock(message_mutex_);
+    auto begin = messages_.lower_bound(request.start_id);
+    auto i = begin;
+    if (request.newest) {
+      // Step back from the end to the first of the newest num_messages.
+      i = messages_.end();
+      for (uint64_t n = 0; n < request.num_messages && i != begin; n++) i--;
+    }
+
+    while (history.messages.size() < request.num_messages &&
+           i != messages_.end()) {
+      history.messages.push_back(i->second);
+      i++;
+    }
+  }
+
+  // Send everything but the last piece as RECEIVE_HISTORY_PART messages, if
+  // the requester understands them. Otherwise the reply is sent whole.
+  if (!request.accepts_parts) {
+    connection.send(history, Connection::BULK);
+    return;
+  }
+  vector<ChatMessage>& messages = history.messages;
+  size_t start = 0, size = 0;
+  for (size_t i = 0; i + 1 < messages.size(); i++) {
+    size += estimateSize(messages[i]);
+    if (size < BULK_PART_SIZE) continue;
+    Message<RECEIVE_HISTORY_PART> part;
+    part.messages.assign(make_move_iterator(messages.begin() + start),
+                         make_move_iterator(messages.begin() + i + 1));
+    connection.send(part, Connection::BULK);
+    start = i + 1;
+    size = 0;
+  }
+  messages.erase(messages.begin(), messages.begin() + start);
+  connection.send(history, Connection::BULK);
+}
+
+void Server::sendSearchResults(Connection& connection,
+                               const Message<SEARCH_HISTORY>& request) {
+  Message<SEARCH_RESULTS> results;
+  {
+    unique_lock<mutex> lock(message_mutex_);
+    vector<uint64_t> ids = index_.search(
+        request.query, request.sender, request.start_id, request.end_id,
+        min(request.num_messages, MAX_SEARCH_RESULTS), &results.next_id);
+
+    // Results already have their own paging, so a large page is cut short
+    // rather than split.
+    size_t size = 0;
+    for (uint64_t id : ids) {
+      if (size >= BULK_PART_SIZE) {
+        results.next_id = id;
+        break;
+      }
+      results.messages.push_back(messages_.at(id));
+      size += estimateSize(results.messages.back());
+    }
+  }
+
+  connection.send(results, Connection::BULK);
+}
+
+void Server::handlePeer(const Address& address, User* peer) {
+  peer->connection.setHandlers(&peer_handlers_);
+  peer->connection.setContext(peer);
+  peer->connection.setInterrupt(interrupt_fd_);
+
+  try {
+    while (true) {
+      try {
+        peer->connection.poll();
+      } catch (const interrupted_error&) {
+        park();
+      }
+    }
+  } catch (const exception& error) {
+    removeUser(address, peer);
+    LOG(ERROR) << "Lost connection to peer " << address << ": "
+               << error.what();
+  }
+}
+
+void Server::followLeader() {
+  size_t colon = options::leader.rfind(':');
+  string host = options::leader.substr(0, colon);
+  int port = stoi(options::leader.substr(colon + 1));
+
+  const chrono::milliseconds min_delay(500), max_delay(30000);
+  chrono::milliseconds delay = min_delay;
+  while (true) {
+    try {
+      StreamSocket socket;
+      socket.connect(host, port);
+      Connection connection(Connection::BINARY, move(socket));
+      LOG(INFO) << "Connected to leader at " << options::leader;
+      delay = min_delay;
+
+      auto request = [&connection](uint64_t start_id) {
+        Message<REQUEST_HISTORY> message;
+        message.start_id = start_id;
+        message.num_messages = PEER_HISTORY_PAGE_SIZE;
+        message.accepts_parts = 1;
+        connection.send(message);
+      };
+
+      // Catch up from the newest message which has already been received.
+      // That message is requested again so that it can be compared with the
+      // leader's copy: if they differ, the leader's history has been reset
+      // since (for instance, by a restart) and the local history is stale.
+      bool verified = next_id_ == 0;
+      uint64_t start_id = verified ? 0 : next_id_ - 1;
+
+      connection.on<RECEIVE_MESSAGE>([this](ChatMessage&& message) {
+        vector<ChatMessage> messages;
+        messages.push_back(move(message));
+        deliver(move(messages));
+      });
+      connection.on<HEARTBEAT>([](Message<HEARTBEAT>&&) {});
+
+      // Pieces of a history reply are gathered until the whole reply is in.
+      vector<ChatMessage> parts;
+      connection.on<RECEIVE_HISTORY_PART>(
+          [&](Message<RECEIVE_HISTORY_PART>&& part) {
+        move(part.messages.begin(), part.messages.end(), back_inserter(parts));
+      });
+      connection.on<RECEIVE_HISTORY>(
+          [&](Message<RECEIVE_HISTORY>&& history) {
+        vector<ChatMessage> messages;
+        messages.swap(parts);
+        move(history.messages.begin(), history.messages.end(),
+             back_inserter(messages));
+        if (!verified) {
+          verified = true;
+          unique_lock<mutex> sequence_lock(sequence_mutex_);
+          unique_lock<mutex> message_lock(message_mutex_);
+          auto i = messages_.find(start_id);
+          if (messages.empty() || i == messages_.end() ||
+              !(messages.front() == i->second)) {
+            LOG(WARNING) << "Leader history differs from local history. "
+                            "Discarding local history.";
+            messages_.clear();
+            index_.clear();
+            message_lock.unlock();
+            early_messages_.clear();
+            next_id_ = 0;
+            request(0);
+            return;
+          }
+        }
+
+        // A full page means that there may be more to fetch.
+        bool more = messages.size() >= PEER_HISTORY_PAGE_SIZE;
+        uint64_t next_id = messages.empty() ? 0 : messages.back().message_id;
+        deliver(move(messages));
+        if (more) request(next_id + 1);
+      });
+
+      request(start_id);
+
+      try {
+        // Start relaying messages, including any that were queued while
+        // disconnected. Each is only dropped from the queue once it has been
+        // sent, so that none are sent twice if this fails part way.
+        {
+          unique_lock<mutex> leader_lock(leader_mutex_);
+          leader_ = &connection;
+          Message<RELAY_MESSAGE> message;
+          auto pending = pending_relays_.begin();
+          try {
+            for (; pending != pending_relays_.end(); pending++) {
+              message.message = *pending;
+              connection.send(message);
+            }
+          } catch (...) {
+            pending_relays_.erase(pending_relays_.begin(), pending);
+            throw;
+          }
+          pending_relays_.clear();
+        }
+
+        while (true) connection.poll();
+      } catch (...) {
+        unique_lock<mutex> leader_lock(leader_mutex_);
+        leader_ = nullptr;
+        throw;
+      }
+    } catch (const exception& error) {
+      LOG(ERROR) << "Lost connection to leader " << options::leader << ": "
+                 << error.what();
+    }
+
+    this_thread::sleep_for(delay);
+    delay = min(delay * 2, max_delay);
+  }
+}
+
+void Server::relay(ChatMessage&& message) {
+  unique_lock<mutex> leader_lock(leader_mutex_);
+  if (leader_ == nullptr) {
+    // Hold the message until the leader is reachable again.
+    pending_relays_.push_back(move(message));
+    return;
+  }
+  Message<RELAY_MESSAGE> relay;
+  relay.message = move(message);
+  try {
+    leader_->send(relay);
+  } catch (const exception& error) {
+    // Part of the message may have been sent, so nothing more can be sent on
+    // this connection: later messages would be read as the rest of it. The
+    // message is sent again once reconnected.
+    LOG(WARNING) << "Failed to relay message to leader: " << error.what();
+    pending_relays_.push_back(move(relay.message));
+    shutdown(leader_->fd(), SHUT_RDWR);
+    leader_ = nullptr;
+  }
+}
+
+void Server::deliver(vector<ChatMessage>&& messages) {
+  unique_lock<mutex> sequence_lock(sequence_mutex_);
+  for (ChatMessage& message : messages) {
+    if (message.message_id < next_id_) continue;  // Already delivered.
+    uint64_t message_id = message.message_id;
+    early_messages_.emplace(message_id, move(message));
+  }
+  if (early_messages_.size() > MAX_EARLY_MESSAGES) {
+    // The missing messages are fetched again after reconnecting.
+    early_messages_.clear();
+    throw runtime_error("Too many messages received out of order.");
+  }
+
+  // Commit every message up to the next gap in the sequence.
+  vector<ChatMessage> batch;
+  auto i = early_messages_.begin();
+  while (i != early_messages_.end() && i->first == next_id_) {
+    next_id_++;
+    batch.push_back(move(i->second));
+    i = early_messages_.erase(i);
+  }
+  if (!batch.empty()) commit(&batch);
+}
+
+void Server::broadcast(const vector<ChatMessage>& messages) {
+  num_broadcasts_ += messages.size();
+  EncodedMessages<RECEIVE_MESSAGE> encoded(messages);
+
+  // The ring holds one message per record.
+  if (ring_) {
+    const string& frames = encoded.frames(Connection::BINARY);
+    const vector<size_t>& ends = encoded.ends(Connection::BINARY);
+    for (size_t i = 0, start = 0; i < ends.size(); start = ends[i++]) {
+      if (!ring_->publish(frames.data() + start, ends[i] - start)) {
+        LOG(WARNING) << "Message " << messages[i].message_id
+                     << " is too large for the shared-memory ring.";
+      }
+    }
+  }
+
+  // Each user is sent the whole batch at once.
+  if (uring_) return broadcastBatch(&encoded);
+  for (auto& user : users_) {
+    post(user.first, user.second,
+         encoded.frames(user.second->connection.mode()));
+  }
+}
+
+void Server::broadcastBatch(EncodedMessages<RECEIVE_MESSAGE>* encoded) {
+  // Connections which nobody else is writing to, and which have nothing
+  // queued, are sent to in a single batch. The rest are posted to.
+  vector<unique_lock<mutex>> locks;
+  vector<Uring::Send> sends;
+  vector<pair<const Address*, User*>> senders;
+  locks.reserve(users_.size());
+  sends.reserve(users_.size());
+  senders.reserve(users_.size());
+  for (auto& user : users_) {
+    Connection& connection = user.second->connection;
+    const string& frame = encoded->frames(connection.mode());
+    unique_lock<mutex> lock = connection.tryLockWriter();
+    if (!lock.owns_lock()) {
+      post(user.first, user.second, frame);
+      continue;
+    }
+    locks.push_back(move(lock));
+    sends.push_back({connection.fd(), frame.data(), frame.length(), 0, 0});
+    senders.emplace_back(&user.first, user.second);
+  }
+
+  num_uring_syscalls_ += uring_->trySendAll(&sends);
+  for (size_t i = 0; i < sends.size(); i++) {
+    const Uring::Send& send = sends[i];
+    User* user = senders[i].second;
+    if (send.error != 0) {
+      // As in post(), the connection is no longer usable.
+      LOG(WARNING) << "Failed to send to " << *senders[i].first << ": "
+                   << strerror(send.error);
+      shutdown(send.fd, SHUT_RDWR);
+    } else if (send.sent < send.length) {
+      user->connection.queue(send.data + send.sent, send.length - send.sent);
+      backlogged_.insert(user);
+    }
+  }
+}
+
+void Server::post(const Address& address, User* user, const string& frame) {
+  try {
+    if (!user->connection.post(frame)) backlogged_.insert(user);
+  } catch (const exception& error) {
+    // A failed send may leave a partial frame on the connection, so it cannot
+    // be used any further. Shutting it down wakes the reader so that the user
+    // is removed.
+    LOG(WARNING) << "Failed to send to " << address << ": " << error.what();
+    shutdown(user->connection.fd(), SHUT_RDWR);
+  }
+}
 
-  // Forward the message to all connected users.
+void Server::flushBacklogged() {
   unique_lock<mutex> users_lock(users_mutex_);
-  for (auto& user : users_) user.second->connection.send(message);
-  
-  // Store the message in the message history.
-  messages_.emplace(message_id, move(message));
+  auto user = backlogged_.begin();
+  while (user != backlogged_.end()) {
+    Connection& connection = (*user)->connection;
+    try {
+      if (!connection.flush()) {
+        user++;
+        continue;
+      }
+    } catch (const exception& error) {
+      LOG(WARNING) << "Failed to send queued messages: " << error.what();
+      shutdown(connection.fd(), SHUT_RDWR);
+    }
+    user = backlogged_.erase(user);
+  }
+}
+
+void Server::logStats() {
+  uint64_t last_broadcasts = 0, last_syscalls = 0;
+  map<MessageType, pair<uint64_t, uint64_t>> last_limited;  // Dropped, delayed.
+  while (true) {
+    this_thread::sleep_for(chrono::seconds(options::stats_interval));
+    uint64_t broadcasts = num_broadcasts_, syscalls = numBroadcastSyscalls();
+    uint64_t delta_broadcasts = broadcasts - last_broadcasts;
+    uint64_t delta_syscalls = syscalls - last_syscalls;
+    if (delta_broadcasts > 0) {
+      LOG(INFO) << delta_broadcasts << " broadcasts, " << delta_syscalls
+                << " send syscalls ("
+                << static_cast<double>(delta_syscalls) / delta_broadcasts
+                << " per broadcast).";
+    }
+    last_broadcasts = broadcasts;
+    last_syscalls = syscalls;
+
+    for (MessageType type : limited_types_) {
+      uint64_t dropped = user_handlers_.numDropped(type);
+      uint64_t delayed = user_handlers_.numDelayed(type);
+      pair<uint64_t, uint64_t>& last = last_limited[type];
+      if (dropped != last.first || delayed != last.second) {
+        LOG(INFO) << toString(type) << " over its rate limit: "
+                  << dropped - last.first << " dropped, "
+                  << delayed - last.second << " delayed.";
+      }
+      last = {dropped, delayed};
+    }
+  }
+}
+
+void Server::watchConnections() {
+  int64_t last_heartbeat = network::monotonicMilliseconds();
+  pollfd interrupt = {interrupt_fd_, POLLIN, 0};
+  while (true) {
+    // Waiting on interrupt_fd_ rather than sleeping lets a hot restart park
+    // this thread, so that no timer fires once connections are handed over.
+    if (::poll(&interrupt, 1, TIMER_TICK_MS) > 0) {
+      park();
+      continue;
+    }
+    int64_t now = network::monotonicMilliseconds();
+    timers_.advance(now);
+    flushBacklogged();
+
+    // Connections are also checked when they are added, on other threads.
+    vector<string> timed_out;
+    {
+      unique_lock<mutex> lock(names_mutex_);
+      timed_out.swap(timed_out_names_);
+    }
+    if (!timed_out.empty()) {
+      string names;
+      size_t listed = min(timed_out.size(), MAX_LISTED_NAMES);
+      for (size_t i = 0; i < listed; i++) {
+        if (i > 0) names += i + 1 < timed_out.size() ? ", " : " and ";
+        names += timed_out[i];
+      }
+      if (listed < timed_out.size())
+        names += " and " + to_string(timed_out.size() - listed) + " others";
+      notify(names + " timed out.");
+    }
+
+    if (!options::leader.empty() &&
+        now - last_heartbeat >= options::heartbeat_interval * 1000) {
+      last_heartbeat = now;
+      heartbeatLeader(now);
+    }
+  }
+}
+
+int64_t Server::checkConnection(User* user, int64_t now) {
+  const int64_t idle_ms = options::idle_timeout * 1000;
+  const int64_t stall_ms = options::write_stall_timeout * 1000;
+  Connection& connection = user->connection;
+  int64_t last_receive = connection.lastReceive();
+  int64_t send_started = connection.sendStarted();
+  bool heartbeats = user->sends_heartbeats;
+  bool idle = idle_ms > 0 && heartbeats && now - last_receive >= idle_ms;
+  bool stalled =
+      stall_ms > 0 && send_started != 0 && now - send_started >= stall_ms;
+  if (idle || stalled) {
+    // Shutting the connection down wakes its thread, and any blocked sender.
+    user->timed_out = true;
+    shutdown(connection.fd(), SHUT_RDWR);
+    if (!user->is_peer) {
+      unique_lock<mutex> lock(names_mutex_);
+      timed_out_names_.push_back(user->display_name);
+    }
+    return 0;
+  }
+
+  // Check again at the next deadline. A send which starts in the meantime is
+  // therefore noticed at most one stall timeout late, and a connection which
+  // starts sending heartbeats at most one idle timeout late.
+  int64_t next = INT64_MAX;
+  if (idle_ms > 0) next = heartbeats ? last_receive + idle_ms : now + idle_ms;
+  if (stall_ms > 0) {
+    int64_t start = send_started != 0 ? send_started : max(now, last_receive);
+    next = min(next, start + stall_ms);
+  }
+  return next;
+}
+
+void Server::heartbeatLeader(int64_t now) {
+  unique_lock<mutex> leader_lock(leader_mutex_);
+  if (leader_ == nullptr) return;
+  if (options::idle_timeout > 0 &&
+      now - leader_->lastReceive() >= options::idle_timeout * 1000) {
+    LOG(WARNING) << "Leader stopped responding.";
+    shutdown(leader_->fd(), SHUT_RDWR);
+    return;
+  }
+  try {
+    leader_->send(Message<HEARTBEAT>());
+  } catch (const exception& error) {
+    LOG(WARNING) << "Failed to send heartbeat to leader: " << error.what();
+    shutdown(leader_->fd(), SHUT_RDWR);
+  }
+}
+
+void Server::acceptConnections(int listener, ListenerKind kind) {
+  pollfd fds[] = {{listener, POLLIN, 0}, {interrupt_fd_, POLLIN, 0}};
+  while (true) {
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      throw runtime_error("Failed to wait for connections: " +
+                          string(strerror(errno)));
+    }
+    if (fds[1].revents & POLLIN) {
+      park();
+      continue;
+    }
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+          errno == ECONNABORTED) {
+        continue;
+      }
+      throw runtime_error("Failed to accept connection: " +
+                          string(strerror(errno)));
+    }
+    try {
+      startActiveThread([this, fd, kind] { serve(fd, kind); });
+    } catch (const exception& error) {
+      LOG(ERROR) << error.what();
+      close(fd);
+    }
+  }
+}
+
+bool Server::readHeader(int fd, ListenerKind kind, string* header) {
+  // Headers are short, so one which is this long without a newline is invalid.
+  const size_t MAX_HEADER_SIZE = 16;
+
+  // Once part of a header has arrived the connection stays readable, so the
+  // rest is waited for by polling.
+  const int PARTIAL_HEADER_POLL_MS = 10;
+
+  char data[MAX_HEADER_SIZE];
+  pollfd fds[] = {{fd, POLLIN, 0}, {interrupt_fd_, POLLIN, 0}};
+  bool partial = false;
+  while (true) {
+    int result = partial ? ::poll(fds + 1, 1, PARTIAL_HEADER_POLL_MS)
+                         : ::poll(fds, 2, -1);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (fds[1].revents & POLLIN) {
+      {
+        unique_lock<mutex> handoff_lock(handoff_mutex_);
+        fresh_connections_.emplace(fd, kind);
+      }
+      park();
+      unique_lock<mutex> handoff_lock(handoff_mutex_);
+      fresh_connections_.erase(fd);
+      continue;
+    }
+
+    // The header is peeked at until it is complete, so that a connection
+    // handed over part way through still has all of it.
+    ssize_t length = recv(fd, data, sizeof(data), MSG_PEEK | MSG_DONTWAIT);
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+    if (length <= 0) return false;
+    const char* end = static_cast<const char*>(memchr(data, '\n', length));
+    if (end == nullptr) {
+      if (static_cast<size_t>(length) == sizeof(data)) {
+        header->assign(data, length);
+        return true;
+      }
+      partial = true;
+      continue;
+    }
+    header->assign(data, end - data);
+    return recv(fd, data, end - data + 1, 0) == end - data + 1;
+  }
 }
 
-void Server::serve(Socket socket) {
-  // Read the connection header.
-  LOG(INFO) << "Accepted incoming connection from " << socket.hostPort();
-  notify(socket.hostPort() + " has connected.");
+void Server::serve(int fd, ListenerKind kind) {
+  StreamSocket socket(fd);
+  Address address =
+      kind == UNIX_LISTENER ? "local:" + to_string(fd) : socket.hostPort();
+  bool is_peer = kind == PEER_LISTENER;
+  LOG(INFO) << "Accepted " << (is_peer ? "peer" : "incoming")
+            << " connection from " << address;
 
-  // Create the user struct.
-  string address = socket.hostPort();
-  User user(move(socket));
+  string header;
+  if (!readHeader(fd, kind, &header)) return;
+  Connection::Mode mode;
+  if (header == "BINARY") {
+    mode = Connection::BINARY;
+  } else if (header == "JSON") {
+    mode = Connection::JSON;
+  } else if (header == "SHM" && kind == UNIX_LISTENER) {
+    // Ring readers identify themselves with a header of "SHM\n".
+    addRingReader(fd);
+    LOG(INFO) << "Accepted shared-memory ring reader.";
+    try {
+      sendDescriptors(fd, "SHM\n", ring_->readerDescriptors());
+    } catch (const exception& error) {
+      LOG(ERROR) << "Failed to serve ring reader: " << error.what();
+      shutdown(fd, SHUT_RDWR);
+    }
+    return serveRingReader(move(socket));
+  } else if (header == "STATS" && kind == UNIX_LISTENER) {
+    return sendStats(socket);
+  } else {
+    LOG(ERROR) << "Invalid connection type from " << address << ".";
+    try {
+      socket.send("Invalid connection type.");
+    } catch (const exception&) {
+    }
+    return;
+  }
+  LOG(INFO) << "Connection mode is " << header;
+
+  // Peers receive every broadcast, just like users.
+  Slab<User>::Pointer user = user_slab_.create(
+      move(socket), mode, "", is_peer ? "peer " + address : address, is_peer);
+  addUser(address, user.get());
+  if (is_peer) return handlePeer(address, user.get());
+  if (options::connection_notices) notify(address + " has connected.");
+  handleUser(address, user.get());
+}
+
+void Server::sendStats(StreamSocket& socket) {
+  stringstream stats;
+  stats << "STATS " << num_broadcasts_ << " " << numBroadcastSyscalls() << " "
+        << (uring_ ? "io_uring" : "blocking") << "\n";
+  try {
+    socket.send(stats.str());
+  } catch (const exception& error) {
+    LOG(WARNING) << "Failed to send statistics: " << error.what();
+  }
+}
+
+void Server::serveRingReader(StreamSocket socket) {
+  // The reader needs nothing more, but the connection is kept open until it
+  // is closed so that the reader can detect the server going away.
+  pollfd fds[] = {{socket.fd(), POLLIN, 0}, {interrupt_fd_, POLLIN, 0}};
+  char buffer[256];
+  while (true) {
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      park();
+      continue;
+    }
+    ssize_t length = recv(socket.fd(), buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (length == 0 ||
+        (length < 0 && errno != EAGAIN && errno != EINTR)) {
+      break;
+    }
+  }
+  removeRingReader(socket.fd());
+}
+
+void Server::serveAdopted(Address address, Slab<User>::Pointer user) {
+  addUser(address, user.get());
+
+  // Anything the previous server had queued is sent on the next tick.
   {
     unique_lock<mutex> users_lock(users_mutex_);
-    users_.emplace(address, &user);
+    backlogged_.insert(user.get());
+  }
+  if (user->is_peer) {
+    handlePeer(address, user.get());
+  } else {
+    handleUser(address, user.get());
   }
+}
+
+void Server::setUpHandlers() {
+  auto user_of = [](Connection& connection) {
+    return static_cast<User*>(connection.context());
+  };
 
-  user.connection.on<IDENTIFY>([this, &user](Message<IDENTIFY>&& message) {
+  user_handlers_.on<IDENTIFY>(
+      [this, user_of](Connection& connection, Message<IDENTIFY>&& message) {
     // Update the stored name.
+    User* user = user_of(connection);
     string old_name, new_name;
     {
-      unique_lock<mutex> lock(user.name_mutex);
-      old_name = move(user.display_name);
+      unique_lock<mutex> lock(names_mutex_);
+      old_name = move(user->display_name);
       new_name = message.display_name;
-      user.display_name = move(message.display_name);
+      user->display_name = move(message.display_name);
     }
 
     // Send the name update message.
     notify(old_name + " is now known as " + new_name + ".");
   });
 
-  user.connection.on<SEND_MESSAGE>(
-      [this, &user](Message<SEND_MESSAGE>&& message) {
+  user_handlers_.on<SEND_MESSAGE>(
+      [this, user_of](Connection& connection,
+                      Message<SEND_MESSAGE>&& message) {
     // Fetch the user display name.
     string sender;
     {
-      unique_lock<mutex> lock(user.name_mutex);
-      sender = user.display_name;
+      unique_lock<mutex> lock(names_mutex_);
+      sender = user_of(connection)->display_name;
     }
 
     // Send the message.
     send(move(sender), move(message.text));
   });
 
-  user.connection.on<REQUEST_HISTORY>(
-      [this, &user](Message<REQUEST_HISTORY>&& message) {
-    // Lock the message list and extract the requested messages.
-    Message<RECEIVE_HISTORY> history;
-    {
-      unique_lock<mutex> lock(message_mutex_);
-      auto i = messages_.lower_bound(message.start_id);
-      
-      while (history.messages.size() < message.num_messages &&
-             i != messages_.end()) {
-        history.messages.push_back(i->second);
-        i++;
-      }
-    }
+  user_handlers_.on<REQUEST_HISTORY>(
+      [this](Connection& connection, Message<REQUEST_HISTORY>&& message) {
+    sendHistory(connection, message);
+  });
+
+  user_handlers_.on<SEARCH_HISTORY>(
+      [this](Connection& connection, Message<SEARCH_HISTORY>&& message) {
+    sendSearchResults(connection, message);
+  });
+
+  user_handlers_.on<HEARTBEAT>(
+      [user_of](Connection& connection, Message<HEARTBEAT>&& message) {
+    user_of(connection)->sends_heartbeats = true;
+    connection.send(message);
+  });
+
+  // Limit users, so that one cannot flood every other with broadcasts.
+  for (const auto& limit : parseRateLimits(options::rate_limits)) {
+    user_handlers_.limit(limit.first, limit.second);
+    limited_types_.push_back(limit.first);
+  }
+
+  peer_handlers_.on<RELAY_MESSAGE>(
+      [this](Connection&, Message<RELAY_MESSAGE>&& message) {
+    addMessage(move(message.message));
+  });
+
+  peer_handlers_.on<REQUEST_HISTORY>(
+      [this](Connection& connection, Message<REQUEST_HISTORY>&& message) {
+    sendHistory(connection, message);
+  });
 
-    // Send the response.
-    user.connection.send(history);
+  peer_handlers_.on<HEARTBEAT>(
+      [user_of](Connection& connection, Message<HEARTBEAT>&& message) {
+    user_of(connection)->sends_heartbeats = true;
+    connection.send(message);
   });
+}
+
+void Server::handleUser(const Address& address, User* user) {
+  user->connection.setHandlers(&user_handlers_);
+  user->connection.setContext(user);
+  user->connection.setInterrupt(interrupt_fd_);
+  user->connection.setMaxFrameSize(options::max_frame_size);
+  // Connections handed over along with the capture are already open in it.
+  if (capture_ && user->capture_id == 0)
+    user->capture_id = capture_->open(user->connection.mode());
 
   try {
-    while (true) user.connection.poll();
+    while (true) {
+      try {
+        user->connection.poll();
+      } catch (const interrupted_error&) {
+        park();
+      }
+    }
   } catch (const exception& error) {
     // Remove the user from the users list.
-    {
-      unique_lock<mutex> users_lock(users_mutex_);
-      users_.erase(address);
+    removeUser(address, user);
+    if (capture_) capture_->close(user->capture_id);
+    if (user->timed_out) {
+      LOG(INFO) << "Connection to " << address << " timed out.";
+      return;
     }
 
+    LOG(ERROR) << "Exception thrown in connection to " << address << ": "
+               << error.what();
+    if (!options::connection_notices) return;
+
     // Notify the other users.
     string name;
     {
-      unique_lock<mutex> user_lock(user.name_mutex);
-      name = user.display_name;
+      unique_lock<mutex> lock(names_mutex_);
+      name = user->display_name;
     }
-
-    LOG(ERROR) << "Exception thrown in connection to " << address << ": "
-               << error.what();
     notify(name + " forcefully disconnected (an exception was thrown).");
     return;
   }
 }
 
+void Server::addUser(const Address& address, User* user) {
+  {
+    unique_lock<mutex> users_lock(users_mutex_);
+    users_.emplace(address, user);
+  }
+
+  if (options::idle_timeout > 0 || options::write_stall_timeout > 0) {
+    user->timer.setCallback([this, user](int64_t now) {
+      return checkConnection(user, now);
+    });
+    int64_t now = network::monotonicMilliseconds();
+    timers_.schedule(&user->timer, checkConnection(user, now));
+  }
+}
+
+void Server::removeUser(const Address& address, User* user) {
+  timers_.cancel(&user->timer);
+  unique_lock<mutex> users_lock(users_mutex_);
+  users_.erase(address);
+  backlogged_.erase(user);
+}
+
+void Server::addRingReader(int fd) {
+  unique_lock<mutex> handoff_lock(handoff_mutex_);
+  ring_readers_.insert(fd);
+}
+
+void Server::removeRingReader(int fd) {
+  unique_lock<mutex> handoff_lock(handoff_mutex_);
+  ring_readers_.erase(fd);
+}
+
+void Server::finishActive() {
+  unique_lock<mutex> handoff_lock(handoff_mutex_);
+  num_active_--;
+  handoff_changed_.notify_all();
+}
+
+void Server::park() {
+  unique_lock<mutex> handoff_lock(handoff_mutex_);
+  num_parked_++;
+  handoff_changed_.notify_all();
+  handoff_changed_.wait(handoff_lock, [this] { return !handing_off_; });
+  num_parked_--;
+}
+
+bool Server::takeOver() {
+  int fd;
+  try {
+    fd = connectUnix(options::handoff_socket, SOCK_SEQPACKET);
+  } catch (const exception& error) {
+    LOG(INFO) << "No running server to take over from (" << error.what()
+              << ").";
+    return false;
+  }
+  LOG(INFO) << "Taking over from the running server.";
+
+  // The old server may spend up to HANDOFF_TIMEOUT waiting for its own
+  // connections before it sends anything.
+  setHandoffTimeout(fd, 2 * HANDOFF_TIMEOUT);
+
+  map<uint64_t, string> buffered, queued;
+  uint64_t num_connections = 0;
+  bool done = false;
+  while (!done) {
+    vector<int> descriptors;
+    string data = receiveHandoffRecord(fd, &descriptors);
+    if (data.empty())
+      throw runtime_error("The running server abandoned the hot restart.");
+    HandoffReader record(data);
+    uint64_t type = record.readVarUint();
+    size_t expected_descriptors = 0;
+    switch (type) {
+      case HANDOFF_LISTENER: {
+        expected_descriptors = 1;
+        if (descriptors.size() != 1) break;
+        switch (record.readVarUint()) {
+          case TCP_LISTENER:
+            listener_.reset(new StreamSocket(descriptors[0]));
+            break;
+          case PEER_LISTENER:
+            peer_listener_.reset(new StreamSocket(descriptors[0]));
+            break;
+          case UNIX_LISTENER: unix_listener_ = descriptors[0]; break;
+          default: throw runtime_error("Unknown listener in handoff.");
+        }
+        break;
+      }
+      case HANDOFF_RING:
+        expected_descriptors = 2;
+        if (descriptors.size() == 2)
+          ring_.reset(ShmRingWriter::attach(descriptors[0], descriptors[1]));
+        break;
+      case HANDOFF_RING_READERS:
+        expected_descriptors = descriptors.size();
+        adopted_ring_readers_.insert(adopted_ring_readers_.end(),
+                                     descriptors.begin(), descriptors.end());
+        ring_readers_.insert(descriptors.begin(), descriptors.end());
+        break;
+      case HANDOFF_CONNECTIONS:
+        expected_descriptors = descriptors.size();
+        for (int connection : descriptors) {
+          bool is_peer = record.readVarUint() != 0;
+          uint64_t mode = record.readVarUint();
+          Address address = record.readString();
+          string display_name = record.readString();
+          uint64_t capture_id = record.readVarUint();
+          if (mode != Connection::BINARY && mode != Connection::JSON)
+            throw runtime_error("Unknown connection mode in handoff.");
+
+          // Local addresses are named after their descriptor, which has
+          // changed.
+          if (address.compare(0, 6, "local:") == 0)
+            address = "local:" + to_string(connection);
+
+          Slab<User>::Pointer user = user_slab_.create(
+              StreamSocket(connection), static_cast<Connection::Mode>(mode),
+              move(buffered[num_connections]), move(display_name), is_peer);
+          user->capture_id = capture_id;
+          const string& data = queued[num_connections];
+          if (!data.empty()) user->connection.queue(data.data(), data.size());
+          buffered.erase(num_connections);
+          queued.erase(num_connections++);
+          adopted_users_.emplace_back(move(address), move(user));
+        }
+        break;
+      case HANDOFF_BUFFERED:
+      case HANDOFF_QUEUED: {
+        uint64_t index = record.readVarUint();
+        (type == HANDOFF_BUFFERED ? buffered : queued)[index] +=
+            record.readString();
+        break;
+      }
+      case HANDOFF_NEXT_ID:
+        next_id_ = record.readVarUint();
+        break;
+      case HANDOFF_HISTORY:
+      case HANDOFF_PENDING: {
+        bool history = type == HANDOFF_HISTORY;
+        while (!record.done()) {
+          ChatMessage message = record.readMessage();
+          if (history) {
+            index_.add(message);
+            messages_.emplace(message.message_id, move(message));
+          } else {
+            adopted_pending_.push_back(move(message));
+          }
+        }
+        break;
+      }
+      case HANDOFF_FRESH:
+        expected_descriptors = descriptors.size();
+        for (int connection : descriptors) {
+          uint64_t kind = record.readVarUint();
+          if (kind > UNIX_LISTENER)
+            throw runtime_error("Unknown listener in handoff.");
+          adopted_fresh_.emplace_back(connection,
+                                      static_cast<ListenerKind>(kind));
+        }
+        break;
+      case HANDOFF_CAPTURE:
+        expected_descriptors = 1;
+        if (descriptors.size() != 1) break;
+        adopted_capture_.fd = descriptors[0];
+        adopted_capture_.path = record.readString();
+        adopted_capture_.last_connection = record.readVarUint();
+        adopted_capture_.last_time = record.readVarUint();
+        break;
+      case HANDOFF_END:
+        done = true;
+        break;
+      default:
+        throw runtime_error("Unknown record in handoff.");
+    }
+    if (descriptors.size() != expected_descriptors)
+      throw runtime_error("Unexpected descriptors in handoff.");
+  }
+  if (!listener_) throw runtime_error("Handoff did not include a listener.");
+
+  // Once this is sent, the old server exits.
+  sendDescriptors(fd, "READY", {});
+  close(fd);
+  LOG(INFO) << "Took over " << adopted_users_.size() << " connections and "
+            << messages_.size() << " messages.";
+  return true;
+}
+
+void Server::acceptHandoffs() {
+  int listener = listenUnix(options::handoff_socket, SOCK_SEQPACKET);
+  LOG(INFO) << "Accepting hot restarts on " << options::handoff_socket;
+  while (true) {
+    int fd = acceptUnix(listener);
+    handOff(fd);
+    close(fd);
+  }
+}
+
+void Server::handOff(int fd) {
+  LOG(INFO) << "A new server is taking over.";
+  setHandoffTimeout(fd, HANDOFF_TIMEOUT);
+
+  // Interrupt every active thread, and wait for them all to stop. Nothing is
+  // accepted or timed out from here on.
+  unique_lock<mutex> handoff_lock(handoff_mutex_);
+  handing_off_ = true;
+  uint64_t value = 1;
+  if (write(interrupt_fd_, &value, sizeof(value)) < 0)
+    LOG(ERROR) << "Failed to interrupt connections: " << strerror(errno);
+  bool idle = handoff_changed_.wait_for(handoff_lock, HANDOFF_TIMEOUT, [this] {
+    return num_parked_ == num_active_;
+  });
+
+  vector<ChatMessage> pending;
+  try {
+    if (!idle) throw runtime_error("Timed out waiting for connections.");
+
+    // Nothing is sequenced or relayed from here on. Messages which have been
+    // queued but not sequenced are left for the new server.
+    unique_lock<mutex> sequence_lock(sequence_mutex_);
+    unique_lock<mutex> leader_lock(leader_mutex_);
+    ingest_.popAll(&pending);
+    // Every connection is parked, so nothing more is recorded here, and the
+    // new server carries on from the end of the file.
+    if (capture_) capture_->flush();
+    sendState(fd, pending);
+
+    vector<int> descriptors;
+    if (receiveDescriptors(fd, &descriptors) != "READY")
+      throw runtime_error("The new server did not confirm the handoff.");
+    LOG(INFO) << "Handed over to the new server. Exiting.";
+    _exit(0);
+  } catch (const exception& error) {
+    LOG(ERROR) << "Hot restart failed: " << error.what();
+  }
+
+  // Carry on as before.
+  for (ChatMessage& message : pending) ingest_.push(move(message));
+  if (!pending.empty()) {
+    unique_lock<mutex> ingest_lock(ingest_mutex_);
+    ingest_available_.notify_one();
+  }
+  if (read(interrupt_fd_, &value, sizeof(value)) < 0)
+    LOG(ERROR) << "Failed to reset interrupt: " << strerror(errno);
+  handing_off_ = false;
+  handoff_changed_.notify_all();
+}
+
+void Server::sendState(int fd, const vector<ChatMessage>& pending) {
+  HandoffWriter writer(fd);
+
+  auto sendListener = [&writer](ListenerKind kind, int listener) {
+    writer.start(HANDOFF_LISTENER);
+    writer.addVarUint(kind);
+    writer.addDescriptor(listener);
+    writer.send();
+  };
+  sendListener(TCP_LISTENER, listener_->fd());
+  if (peer_listener_) sendListener(PEER_LISTENER, peer_listener_->fd());
+  if (unix_listener_ != -1) sendListener(UNIX_LISTENER, unix_listener_);
+
+  if (ring_) {
+    writer.start(HANDOFF_RING);
+    for (int fd : ring_->descriptors()) writer.addDescriptor(fd);
+    writer.send();
+  }
+  auto reader = ring_readers_.begin();
+  while (reader != ring_readers_.end()) {
+    writer.start(HANDOFF_RING_READERS);
+    while (reader != ring_readers_.end() &&
+           writer.numDescriptors() < MAX_DESCRIPTORS) {
+      writer.addDescriptor(*reader++);
+    }
+    writer.send();
+  }
+
+  // Connections go in batches, after any data they have received but not yet
+  // parsed.
+  {
+    unique_lock<mutex> users_lock(users_mutex_);
+    vector<pair<Address, User*>> users(users_.begin(), users_.end());
+    for (size_t i = 0; i < users.size(); i++) {
+      Connection& connection = users[i].second->connection;
+      auto sendData = [&](HandoffRecord type, const string& data) {
+        for (size_t j = 0; j < data.length(); j += HANDOFF_RECORD_SIZE) {
+          writer.start(type);
+          writer.addVarUint(i);
+          writer.addString(data.substr(j, HANDOFF_RECORD_SIZE));
+          writer.send();
+        }
+      };
+      sendData(HANDOFF_BUFFERED, connection.buffered());
+      sendData(HANDOFF_QUEUED, connection.queued());
+    }
+    size_t i = 0;
+    while (i < users.size()) {
+      writer.start(HANDOFF_CONNECTIONS);
+      while (i < users.size() && writer.size() < HANDOFF_RECORD_SIZE &&
+             writer.numDescriptors() < MAX_DESCRIPTORS) {
+        User* user = users[i].second;
+        unique_lock<mutex> name_lock(names_mutex_);
+        writer.addVarUint(user->is_peer);
+        writer.addVarUint(user->connection.mode());
+        writer.addString(users[i].first);
+        writer.addString(user->display_name);
+        writer.addVarUint(user->capture_id);
+        writer.addDescriptor(user->connection.fd());
+        i++;
+      }
+      writer.send();
+    }
+  }
+  auto fresh = fresh_connections_.begin();
+  while (fresh != fresh_connections_.end()) {
+    writer.start(HANDOFF_FRESH);
+    while (fresh != fresh_connections_.end() &&
+           writer.numDescriptors() < MAX_DESCRIPTORS) {
+      writer.addVarUint(fresh->second);
+      writer.addDescriptor(fresh->first);
+      fresh++;
+    }
+    writer.send();
+  }
+
+  if (capture_) {
+    writer.start(HANDOFF_CAPTURE);
+    writer.addString(options::capture);
+    writer.addVarUint(capture_->lastConnection());
+    writer.addVarUint(capture_->lastTime());
+    writer.addDescriptor(capture_->fd());
+    writer.send();
+  }
+
+  writer.start(HANDOFF_NEXT_ID);
+  writer.addVarUint(next_id_);
+  writer.send();
+
+  {
+    unique_lock<mutex> message_lock(message_mutex_);
+    vector<ChatMessage> history;
+    history.reserve(messages_.size());
+    for (const auto& entry : messages_) history.push_back(entry.second);
+    message_lock.unlock();
+    writer.sendMessages(HANDOFF_HISTORY, history.data(),
+                        history.data() + history.size());
+  }
+  writer.sendMessages(HANDOFF_PENDING, pending.data(),
+                      pending.data() + pending.size());
+  writer.sendMessages(HANDOFF_PENDING, pending_relays_.data(),
+                      pending_relays_.data() + pending_relays_.size());
+
+  writer.start(HANDOFF_END);
+  writer.send();
+}
+
 int scrump_main(int argc, char* args[]) {
-  Server server;
+  if (options::io_backend != "blocking" && options::io_backend != "io_uring" &&
+      options::io_backend != "auto") {
+    LOG(ERROR) << "Invalid I/O backend '" << options::io_backend << "'.";
+    return 1;
+  }
+  if (!options::leader.empty()) {
+    size_t colon = options::leader.rfind(':');
+    if (colon == string::npos || colon + 1 == options::leader.length() ||
+        options::leader.find_first_not_of("0123456789", colon + 1) !=
+            string::npos) {
+      LOG(ERROR) << "Invalid leader address '" << options::leader
+                 << "'. Expected host:port.";
+      return 1;
+    }
+  }
 
-  server.run();
+  try {
+    Server server;
+    server.run();
+  } catch (const exception& error) {
+    LOG(ERROR) << error.what();
+    return 1;
+  }
 
   return 0;
 }
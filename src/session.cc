@@ -0,0 +1,108 @@
+#include "session.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace std;
+
+Session::Session(Connection* connection, HistoryCache* cache,
+                 size_t page_size, size_t tail_size, DisplayFunction display,
+                 ErrorFunction error)
+    : connection_(*connection), cache_(*cache),
+      page_size_(max<size_t>(page_size, 1)), tail_size_(tail_size),
+      display_(move(display)), error_(move(error)) {
+  connection_.on<RECEIVE_HISTORY_PART>(
+      [this](Message<RECEIVE_HISTORY_PART>&& part) {
+    move(part.messages.begin(), part.messages.end(),
+         back_inserter(history_parts_));
+  });
+  connection_.on<RECEIVE_HISTORY>(
+      [this](Message<RECEIVE_HISTORY>&& history) {
+    // Put any earlier pieces of the reply in front.
+    move(history.messages.begin(), history.messages.end(),
+         back_inserter(history_parts_));
+    history.messages.swap(history_parts_);
+    history_parts_.clear();
+    onHistory(move(history));
+  });
+  connection_.on<RECEIVE_MESSAGE>([this](ChatMessage&& message) {
+    onMessage(move(message));
+  });
+  connection_.on<HEARTBEAT>([](Message<HEARTBEAT>&&) {});
+}
+
+void Session::start() {
+  if (cache_.empty()) {
+    // There is nothing to check the server's history against.
+    verified_ = true;
+    requestTail();
+    return;
+  }
+  // The newest cached message is requested again so that it can be compared
+  // with the server's copy.
+  requestHistory(cache_.lastId());
+}
+
+void Session::requestHistory(uint64_t start_id) {
+  Message<REQUEST_HISTORY> request;
+  request.start_id = start_id;
+  request.num_messages = page_size_;
+  request.accepts_parts = 1;
+  connection_.send(request);
+}
+
+void Session::requestTail() {
+  fetching_tail_ = true;
+  Message<REQUEST_HISTORY> request;
+  request.start_id = 0;
+  request.num_messages = tail_size_;
+  request.accepts_parts = 1;
+  request.newest = 1;
+  connection_.send(request);
+}
+
+void Session::onHistory(Message<RECEIVE_HISTORY>&& history) {
+  const vector<ChatMessage>& messages = history.messages;
+  if (!verified_) {
+    verified_ = true;
+    // If the server's copy of the newest cached message differs, the server's
+    // history has been reset since the cache was written (for instance, by a
+    // restart). The cached messages are unrelated to the current ones.
+    ChatMessage newest;
+    if (cache_.get(cache_.lastId(), &newest) &&
+        (messages.empty() || !(messages.front() == newest))) {
+      error_("Server history has changed. Discarding cache.");
+      cache_.clear();
+      requestTail();
+      return;
+    }
+  }
+
+  for (const ChatMessage& message : messages) display(message);
+
+  // A full page of the gap means that there may be more to fetch. The tail
+  // always comes in a single reply.
+  if (!fetching_tail_ && !messages.empty() &&
+      messages.size() >= page_size_) {
+    requestHistory(messages.back().message_id + 1);
+    return;
+  }
+
+  // The history is in. Display any live messages which were held back.
+  fetching_tail_ = false;
+  catching_up_ = false;
+  for (const ChatMessage& message : held_messages_) display(message);
+  held_messages_.clear();
+}
+
+void Session::onMessage(ChatMessage&& message) {
+  if (catching_up_) {
+    held_messages_.push_back(move(message));
+  } else {
+    display(message);
+  }
+}
+
+void Session::display(const ChatMessage& message) {
+  if (cache_.add(message)) display_(message);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "history_cache.h"
+#include "network.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Catches up on messages that were missed while disconnected. History is
+// requested in pages starting from the newest cached message, so only the gap
+// is transferred. Without a usable cache, only the newest tail_size messages
+// are fetched rather than the whole history. Live messages which arrive in the
+// meantime are held back until the history is in so that everything is
+// displayed in order.
+class Session {
+ public:
+  using DisplayFunction = std::function<void(const ChatMessage&)>;
+  using ErrorFunction = std::function<void(const std::string&)>;
+
+  // Messages are passed to display the first time they are received, and
+  // local errors to error. page_size limits each request for the gap.
+  Session(Connection* connection, HistoryCache* cache, size_t page_size,
+          size_t tail_size, DisplayFunction display, ErrorFunction error);
+
+  // Send the first history request.
+  void start();
+
+ private:
+  void requestHistory(uint64_t start_id);
+  void requestTail();
+  void onHistory(Message<RECEIVE_HISTORY>&& history);
+  void onMessage(ChatMessage&& message);
+
+  // Display a message unless it has been displayed before.
+  void display(const ChatMessage& message);
+
+  Connection& connection_;
+  HistoryCache& cache_;
+  const size_t page_size_;
+  const size_t tail_size_;
+  const DisplayFunction display_;
+  const ErrorFunction error_;
+
+  bool verified_ = false;  // Set once the cache has been checked for validity.
+  bool fetching_tail_ = false;  // The request in progress is for the tail.
+  std::vector<ChatMessage> history_parts_;  // Of the history reply in progress.
+  bool catching_up_ = true;
+  std::vector<ChatMessage> held_messages_;
+};
@@ -0,0 +1,297 @@
+#include "shm_ring.h"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "Shared memory atomics must be lock-free.");
+
+static const uint64_t MAGIC = 0x474e495254414843;  // "CHATRING"
+
+// Each record starts with its length, followed by the frame, padded to a
+// multiple of 8 bytes. A record which would not fit before the end of the
+// buffer is instead placed at the start, and a WRAP marker is left behind.
+static const uint32_t WRAP = 0xFFFFFFFF;
+static const size_t RECORD_HEADER_SIZE = 8;
+
+// Number of times that a reader checks for new frames before sleeping.
+static const int SPIN_COUNT = 1000;
+
+// Longest time that a reader sleeps before checking again. Other readers can
+// write the count of sleeping readers, so a reader cannot rely on being woken.
+static const timespec MAX_SLEEP = {0, 100 * 1000 * 1000};
+
+struct RingHeader {
+  uint64_t magic;
+  uint64_t capacity;
+
+  // Total number of bytes ever written. Advanced after each record is written.
+  atomic<uint64_t> write_position;
+
+  // Incremented after each record is written, for readers to wait on.
+  atomic<uint32_t> sequence;
+  uint32_t reserved;
+};
+
+static const size_t DATA_OFFSET = 64;
+static_assert(sizeof(RingHeader) <= DATA_OFFSET, "RingHeader is too large.");
+
+static runtime_error systemError(const string& message) {
+  return runtime_error(message + ": " + strerror(errno));
+}
+
+static size_t recordSize(size_t frame_size) {
+  return (RECORD_HEADER_SIZE + frame_size + 7) & ~size_t{7};
+}
+
+static long futex(const atomic<uint32_t>* address, int operation,
+                  uint32_t value, const timespec* timeout = nullptr) {
+  return syscall(SYS_futex, reinterpret_cast<const uint32_t*>(address),
+                 operation, value, timeout, nullptr, 0);
+}
+
+// Map the whole of a piece of shared memory, returning its size.
+static void* map(int fd, int protection, size_t* size) {
+  struct stat info;
+  if (fstat(fd, &info) < 0) throw systemError("Failed to stat shared memory");
+  *size = info.st_size;
+  void* memory = mmap(nullptr, *size, protection, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) throw systemError("Failed to map shared memory");
+  return memory;
+}
+
+// Map the count of sleeping readers.
+static atomic<uint32_t>* mapWaiters(int fd) {
+  size_t size;
+  void* memory = map(fd, PROT_READ | PROT_WRITE, &size);
+  if (size != sizeof(atomic<uint32_t>)) {
+    munmap(memory, size);
+    throw runtime_error("Shared memory is not a count of readers.");
+  }
+  return static_cast<atomic<uint32_t>*>(memory);
+}
+
+ShmRingWriter::ShmRingWriter(size_t capacity) {
+  capacity_ = 4096;
+  while (capacity_ < capacity) capacity_ *= 2;
+
+  fd_ = memfd_create("chat-ring", MFD_CLOEXEC);
+  if (fd_ < 0) throw systemError("Failed to create shared memory");
+  size_t size = DATA_OFFSET + capacity_;
+  if (ftruncate(fd_, size) < 0) {
+    close(fd_);
+    throw systemError("Failed to size shared memory");
+  }
+  void* memory =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (memory == MAP_FAILED) {
+    close(fd_);
+    throw systemError("Failed to map shared memory");
+  }
+
+  header_ = new(memory) RingHeader;
+  header_->magic = MAGIC;
+  header_->capacity = capacity_;
+  header_->write_position = 0;
+  header_->sequence = 0;
+  data_ = static_cast<char*>(memory) + DATA_OFFSET;
+
+  waiters_fd_ = memfd_create("chat-ring-waiters", MFD_CLOEXEC);
+  if (waiters_fd_ < 0 ||
+      ftruncate(waiters_fd_, sizeof(atomic<uint32_t>)) < 0) {
+    runtime_error error = systemError("Failed to create shared memory");
+    if (waiters_fd_ >= 0) close(waiters_fd_);
+    munmap(memory, size);
+    close(fd_);
+    throw error;
+  }
+  try {
+    init();
+  } catch (...) {
+    close(waiters_fd_);
+    munmap(memory, size);
+    close(fd_);
+    throw;
+  }
+}
+
+// Map an existing ring, checking that it really is one.
+static RingHeader* mapRing(int fd, int protection, size_t* capacity) {
+  size_t size;
+  void* memory = map(fd, protection, &size);
+  RingHeader* header = static_cast<RingHeader*>(memory);
+  *capacity = size >= DATA_OFFSET ? header->capacity : 0;
+  if (size < DATA_OFFSET || header->magic != MAGIC ||
+      DATA_OFFSET + *capacity != size) {
+    munmap(memory, size);
+    throw runtime_error("Shared memory is not a message ring.");
+  }
+  return header;
+}
+
+ShmRingWriter* ShmRingWriter::attach(int fd, int waiters_fd) {
+  ShmRingWriter* writer = new ShmRingWriter;
+  writer->fd_ = fd;
+  writer->waiters_fd_ = waiters_fd;
+  try {
+    writer->header_ = mapRing(fd, PROT_READ | PROT_WRITE, &writer->capacity_);
+  } catch (...) {
+    close(fd);
+    close(waiters_fd);
+    delete writer;
+    throw;
+  }
+  writer->data_ = reinterpret_cast<char*>(writer->header_) + DATA_OFFSET;
+  try {
+    writer->init();
+  } catch (...) {
+    delete writer;
+    throw;
+  }
+  return writer;
+}
+
+void ShmRingWriter::init() {
+  waiters_ = mapWaiters(waiters_fd_);
+
+  // Reopening the ring read-only gives a descriptor which cannot be mapped
+  // for writing.
+  string path = "/proc/self/fd/" + to_string(fd_);
+  read_only_fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (read_only_fd_ < 0) {
+    munmap(waiters_, sizeof(atomic<uint32_t>));
+    throw systemError("Failed to reopen shared memory");
+  }
+}
+
+ShmRingWriter::~ShmRingWriter() {
+  munmap(header_, DATA_OFFSET + capacity_);
+  if (read_only_fd_ >= 0) {
+    munmap(waiters_, sizeof(atomic<uint32_t>));
+    close(read_only_fd_);
+  }
+  close(fd_);
+  close(waiters_fd_);
+}
+
+bool ShmRingWriter::publish(const char* frame, size_t length) {
+  size_t size = recordSize(length);
+  if (size > capacity_ / 4) return false;
+
+  uint64_t position = header_->write_position.load(memory_order_relaxed);
+  size_t offset = position & (capacity_ - 1);
+  if (capacity_ - offset < size) {
+    memcpy(data_ + offset, &WRAP, sizeof(WRAP));
+    position += capacity_ - offset;
+    offset = 0;
+  }
+
+  uint32_t record_length = length;
+  memcpy(data_ + offset, &record_length, sizeof(record_length));
+  memcpy(data_ + offset + RECORD_HEADER_SIZE, frame, length);
+  header_->write_position.store(position + size);
+
+  // Only wake readers if some are asleep, so that the writer makes no system
+  // calls while every reader is keeping up.
+  header_->sequence.fetch_add(1);
+  if (waiters_->load() > 0) futex(&header_->sequence, FUTEX_WAKE, INT_MAX);
+  return true;
+}
+
+ShmRingReader::ShmRingReader(int fd, int waiters_fd)
+    : fd_(fd), waiters_fd_(waiters_fd) {
+  try {
+    header_ = mapRing(fd_, PROT_READ, &capacity_);
+  } catch (...) {
+    close(fd_);
+    close(waiters_fd_);
+    throw;
+  }
+  try {
+    waiters_ = mapWaiters(waiters_fd_);
+  } catch (...) {
+    munmap(const_cast<RingHeader*>(header_), DATA_OFFSET + capacity_);
+    close(fd_);
+    close(waiters_fd_);
+    throw;
+  }
+  data_ = reinterpret_cast<const char*>(header_) + DATA_OFFSET;
+  position_ = header_->write_position.load();
+}
+
+ShmRingReader::~ShmRingReader() {
+  munmap(const_cast<RingHeader*>(header_), DATA_OFFSET + capacity_);
+  munmap(waiters_, sizeof(atomic<uint32_t>));
+  close(fd_);
+  close(waiters_fd_);
+}
+
+void ShmRingReader::next(string* frame) {
+  // Records behind this limit may be being overwritten. Records are at most a
+  // quarter of the ring, and wrapping skips less than one record, so the
+  // writer can be up to half of the ring ahead of its published position.
+  const uint64_t limit = capacity_ / 2;
+  while (true) {
+    uint64_t write_position = header_->write_position.load();
+    if (position_ == write_position) {
+      wait();
+      continue;
+    }
+    if (write_position - position_ > limit) {
+      position_ = write_position;
+      overruns_++;
+      continue;
+    }
+
+    size_t offset = position_ & (capacity_ - 1);
+    uint32_t length;
+    memcpy(&length, data_ + offset, sizeof(length));
+    if (length == WRAP) {
+      position_ += capacity_ - offset;
+      continue;
+    }
+    if (recordSize(length) > capacity_ / 4) {
+      // The header was overwritten while it was being read.
+      position_ = write_position;
+      overruns_++;
+      continue;
+    }
+    frame->assign(data_ + offset + RECORD_HEADER_SIZE, length);
+
+    // Check that the writer did not reach this record during the copy.
+    atomic_thread_fence(memory_order_acquire);
+    write_position = header_->write_position.load();
+    if (write_position - position_ > limit) {
+      position_ = write_position;
+      overruns_++;
+      continue;
+    }
+
+    position_ += recordSize(length);
+    return;
+  }
+}
+
+void ShmRingReader::wait() {
+  for (int i = 0; i < SPIN_COUNT; i++) {
+    if (header_->write_position.load() != position_) return;
+  }
+
+  uint32_t sequence = header_->sequence.load();
+  waiters_->fetch_add(1);
+  if (header_->write_position.load() == position_)
+    futex(&header_->sequence, FUTEX_WAIT, sequence, &MAX_SLEEP);
+  waiters_->fetch_sub(1);
+}
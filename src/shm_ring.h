@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct RingHeader;
+
+// A ring buffer of frames in shared memory, with a single writer and any
+// number of readers in other processes. The writer never waits for readers:
+// each frame is copied into the ring once, and readers follow along at their
+// own pace without any system calls while frames are available.
+//
+// Frames may be at most a quarter of the ring's capacity. A reader which falls
+// more than half of the ring behind the writer has been overtaken, and skips
+// ahead to the newest frame.
+//
+// Readers are given a read-only descriptor for the ring, so that they cannot
+// corrupt it for each other. The only shared state that they write is a count
+// of sleeping readers, which is kept in a second, separate piece of shared
+// memory.
+class ShmRingWriter {
+ public:
+  // Create a ring with room for at least capacity bytes of frames.
+  ShmRingWriter(size_t capacity);
+
+  // Take over writing to an existing ring from another process, taking
+  // ownership of the descriptors from its descriptors(). That process must no
+  // longer be writing.
+  static ShmRingWriter* attach(int fd, int waiters_fd);
+
+  ~ShmRingWriter();
+
+  ShmRingWriter(const ShmRingWriter&) = delete;
+  ShmRingWriter& operator=(const ShmRingWriter&) = delete;
+
+  // Writable descriptors for the ring and the count of sleeping readers, for
+  // passing to attach() in another process.
+  std::vector<int> descriptors() const { return {fd_, waiters_fd_}; }
+
+  // Descriptors to pass to a ShmRingReader: a read-only one for the ring, and
+  // one for the count of sleeping readers.
+  std::vector<int> readerDescriptors() const {
+    return {read_only_fd_, waiters_fd_};
+  }
+
+  // Append a frame to the ring. Returns false if the frame is too large. This
+  // must not be called concurrently.
+  bool publish(const char* frame, size_t length);
+
+ private:
+  ShmRingWriter() = default;
+
+  // Map the count of sleeping readers, and open the read-only descriptor.
+  void init();
+
+  int fd_, waiters_fd_, read_only_fd_ = -1;
+  size_t capacity_;
+  RingHeader* header_;
+  char* data_;
+  std::atomic<uint32_t>* waiters_;
+};
+
+class ShmRingReader {
+ public:
+  // Attach to a ring, taking ownership of the descriptors from the writer's
+  // readerDescriptors(). Reading starts from the newest frame.
+  ShmRingReader(int fd, int waiters_fd);
+  ~ShmRingReader();
+
+  ShmRingReader(const ShmRingReader&) = delete;
+  ShmRingReader& operator=(const ShmRingReader&) = delete;
+
+  // Wait for the next frame.
+  void next(std::string* frame);
+
+  // Number of times that this reader has been overtaken by the writer.
+  uint64_t overruns() const { return overruns_; }
+
+ private:
+  void wait();
+
+  int fd_, waiters_fd_;
+  size_t capacity_;
+  const RingHeader* header_;
+  const char* data_;
+  std::atomic<uint32_t>* waiters_;
+
+  uint64_t position_;
+  uint64_t overruns_ = 0;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Allocates objects of a single type from large chunks, rather than
+// individually from the heap. Freed slots are reused before any new chunk is
+// allocated, and chunks are never returned. This avoids the per-allocation
+// overhead and fragmentation of many small, long-lived objects.
+template <typename T>
+class Slab {
+ public:
+  class Deleter {
+   public:
+    Deleter(Slab* slab = nullptr) : slab_(slab) {}
+    void operator()(T* object) const { slab_->destroy(object); }
+
+   private:
+    Slab* slab_;
+  };
+  typedef std::unique_ptr<T, Deleter> Pointer;
+
+  Slab() = default;
+  Slab(const Slab&) = delete;
+  Slab& operator=(const Slab&) = delete;
+
+  template <typename... Args>
+  Pointer create(Args&&... args);
+
+  // Number of objects which currently exist.
+  std::size_t size() const;
+
+ private:
+  static const std::size_t CHUNK_SIZE = 256;
+
+  union Slot {
+    Slot* next;  // The next free slot, if this one is free.
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type object;
+  };
+
+  void* allocate();
+  void destroy(T* object);
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Slot[]>> chunks_;
+  Slot* free_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+template <typename T>
+template <typename... Args>
+typename Slab<T>::Pointer Slab<T>::create(Args&&... args) {
+  void* memory = allocate();
+  try {
+    return Pointer(new (memory) T(std::forward<Args>(args)...), Deleter(this));
+  } catch (...) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Slot* slot = static_cast<Slot*>(memory);
+    slot->next = free_;
+    free_ = slot;
+    size_--;
+    throw;
+  }
+}
+
+template <typename T>
+std::size_t Slab<T>::size() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return size_;
+}
+
+template <typename T>
+void* Slab<T>::allocate() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (free_ == nullptr) {
+    Slot* chunk = new Slot[CHUNK_SIZE];
+    chunks_.emplace_back(chunk);
+    for (std::size_t i = 0; i < CHUNK_SIZE; i++) {
+      chunk[i].next = free_;
+      free_ = &chunk[i];
+    }
+  }
+  Slot* slot = free_;
+  free_ = slot->next;
+  size_++;
+  return slot;
+}
+
+template <typename T>
+void Slab<T>::destroy(T* object) {
+  object->~T();
+  std::unique_lock<std::mutex> lock(mutex_);
+  Slot* slot = reinterpret_cast<Slot*>(object);
+  slot->next = free_;
+  free_ = slot;
+  size_--;
+}
@@ -0,0 +1,147 @@
+#include "stream_socket.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+using scrump::socket_error;
+
+static socket_error systemError(const string& message) {
+  return socket_error(message + ": " + strerror(errno));
+}
+
+// Resolve host:port, calling attempt for each address in turn until it
+// returns a descriptor.
+template <typename Attempt>
+static int resolve(const string& host, int port, int flags, Attempt attempt) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  addrinfo* addresses;
+  int result = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints,
+                           &addresses);
+  if (result != 0) {
+    throw socket_error("Failed to resolve " + host + ": " +
+                       gai_strerror(result));
+  }
+  int fd = -1;
+  int error = 0;
+  for (addrinfo* address = addresses; address && fd < 0;
+       address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                address->ai_protocol);
+    if (fd < 0) {
+      error = errno;
+      continue;
+    }
+    if (!attempt(fd, address)) {
+      error = errno;
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  errno = error;
+  return fd;
+}
+
+StreamSocket::StreamSocket(StreamSocket&& other) : fd_(other.fd_) {
+  other.fd_ = -1;
+}
+
+StreamSocket& StreamSocket::operator=(StreamSocket&& other) {
+  if (this != &other) {
+    if (fd_ >= 0) close(fd_);
+    fd_ = other.fd_;
+    other.fd_ = -1;
+  }
+  return *this;
+}
+
+StreamSocket::~StreamSocket() {
+  if (fd_ >= 0) close(fd_);
+}
+
+void StreamSocket::bind(const string& host, int port) {
+  int fd = resolve(host, port, AI_PASSIVE, [](int fd, addrinfo* address) {
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    return ::bind(fd, address->ai_addr, address->ai_addrlen) == 0;
+  });
+  if (fd < 0) {
+    throw systemError("Failed to bind to " + host + ":" +
+                      to_string(port));
+  }
+  *this = StreamSocket(fd);
+}
+
+void StreamSocket::listen() {
+  if (::listen(fd_, SOMAXCONN) < 0) throw systemError("Failed to listen");
+}
+
+void StreamSocket::connect(const string& host, int port) {
+  int fd = resolve(host, port, 0, [](int fd, addrinfo* address) {
+    int result;
+    do {
+      result = ::connect(fd, address->ai_addr, address->ai_addrlen);
+    } while (result < 0 && errno == EINTR);
+    return result == 0;
+  });
+  if (fd < 0) {
+    throw systemError("Failed to connect to " + host + ":" +
+                      to_string(port));
+  }
+  *this = StreamSocket(fd);
+}
+
+string StreamSocket::hostPort() const {
+  sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (getpeername(fd_, reinterpret_cast<sockaddr*>(&address), &length) < 0)
+    return "unknown";
+  char host[INET6_ADDRSTRLEN];
+  switch (address.ss_family) {
+    case AF_INET: {
+      const sockaddr_in& ipv4 = reinterpret_cast<sockaddr_in&>(address);
+      inet_ntop(AF_INET, &ipv4.sin_addr, host, sizeof(host));
+      return string(host) + ":" + to_string(ntohs(ipv4.sin_port));
+    }
+    case AF_INET6: {
+      const sockaddr_in6& ipv6 = reinterpret_cast<sockaddr_in6&>(address);
+      inet_ntop(AF_INET6, &ipv6.sin6_addr, host, sizeof(host));
+      return "[" + string(host) + "]:" + to_string(ntohs(ipv6.sin6_port));
+    }
+    case AF_UNIX:
+      return "local";
+    default:
+      return "unknown";
+  }
+}
+
+void StreamSocket::send(const string& data) {
+  const char* position = data.data();
+  size_t remaining = data.size();
+  while (remaining > 0) {
+    ssize_t sent = ::send(fd_, position, remaining, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      throw systemError("Failed to send");
+    }
+    position += sent;
+    remaining -= sent;
+  }
+}
+
+size_t StreamSocket::receive(char* data, size_t length) {
+  while (true) {
+    ssize_t received = recv(fd_, data, length, 0);
+    if (received >= 0) return received;
+    if (errno != EINTR) throw systemError("Failed to receive");
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <scrump/socket.h>
+#include <string>
+
+// An owned stream socket descriptor: a TCP socket, or a Unix domain stream
+// socket. Connections need the descriptor itself to
+// poll, shut down and hand over, which scrump::Socket does not expose.
+// Failures throw scrump::socket_error.
+class StreamSocket {
+ public:
+  StreamSocket() = default;
+
+  // Take ownership of an open descriptor.
+  explicit StreamSocket(int fd) : fd_(fd) {}
+
+  StreamSocket(StreamSocket&& other);
+  StreamSocket& operator=(StreamSocket&& other);
+  ~StreamSocket();
+
+  StreamSocket(const StreamSocket&) = delete;
+  StreamSocket& operator=(const StreamSocket&) = delete;
+
+  int fd() const { return fd_; }
+
+  // Server side: bind to host:port and listen. The server accepts
+  // connections on fd() itself.
+  void bind(const std::string& host, int port);
+  void listen();
+
+  // Client side.
+  void connect(const std::string& host, int port);
+
+  // The address of the other end, as "host:port", or "local" for a Unix
+  // domain socket.
+  std::string hostPort() const;
+
+  // Send all of data, blocking until it has been sent.
+  void send(const std::string& data);
+
+  // Receive up to length bytes. Returns 0 at the end of the stream.
+  size_t receive(char* data, size_t length);
+
+ private:
+  int fd_ = -1;
+};
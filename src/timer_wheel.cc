@@ -0,0 +1,99 @@
+#include "timer_wheel.h"
+
+using namespace std;
+
+TimerWheel::TimerWheel(int64_t tick_ms, int64_t now)
+    : tick_ms_(tick_ms), current_(now / tick_ms) {
+  for (auto& level : slots_) {
+    for (Timer& slot : level) slot.previous_ = slot.next_ = &slot;
+  }
+}
+
+void TimerWheel::schedule(Timer* timer, int64_t time) {
+  unique_lock<mutex> lock(mutex_);
+  if (timer->next_ != nullptr) unlink(timer);
+  timer->expiry_ = (time + tick_ms_ - 1) / tick_ms_;
+  insert(timer);
+}
+
+void TimerWheel::cancel(Timer* timer) {
+  unique_lock<mutex> lock(mutex_);
+  if (timer->next_ != nullptr) unlink(timer);
+}
+
+void TimerWheel::advance(int64_t now) {
+  uint64_t target = now / tick_ms_;
+  unique_lock<mutex> lock(mutex_);
+  while (current_ <= target) {
+    uint64_t tick = current_;
+
+    // At the start of each revolution of a wheel, the next slot of the
+    // coarser wheel above it is moved down.
+    if ((tick & (SLOTS - 1)) == 0) {
+      for (int level = 1; level < LEVELS && cascade(level) == 0; level++) {
+        continue;
+      }
+    }
+
+    // Timers which are rescheduled by their callbacks must not land in the
+    // slot being processed, so the wheel moves on before they run.
+    Timer expired;
+    expired.previous_ = expired.next_ = &expired;
+    splice(&slots_[0][tick & (SLOTS - 1)], &expired);
+    current_ = tick + 1;
+    while (expired.next_ != &expired) {
+      Timer* timer = expired.next_;
+      unlink(timer);
+      int64_t next = timer->callback_(now);
+      if (next != 0) {
+        timer->expiry_ = (next + tick_ms_ - 1) / tick_ms_;
+        insert(timer);
+      }
+    }
+  }
+}
+
+void TimerWheel::insert(Timer* timer) {
+  if (timer->expiry_ < current_) timer->expiry_ = current_;
+  uint64_t delta = timer->expiry_ - current_;
+  int level = 0;
+  while (level < LEVELS - 1 && delta >= SLOTS << (level * LEVEL_BITS))
+    level++;
+  uint64_t range = SLOTS << (level * LEVEL_BITS);
+  if (delta >= range) timer->expiry_ = current_ + range - 1;
+
+  Timer* slot =
+      &slots_[level][(timer->expiry_ >> (level * LEVEL_BITS)) & (SLOTS - 1)];
+  timer->next_ = slot;
+  timer->previous_ = slot->previous_;
+  slot->previous_->next_ = timer;
+  slot->previous_ = timer;
+}
+
+void TimerWheel::unlink(Timer* timer) {
+  timer->previous_->next_ = timer->next_;
+  timer->next_->previous_ = timer->previous_;
+  timer->previous_ = timer->next_ = nullptr;
+}
+
+uint64_t TimerWheel::cascade(int level) {
+  uint64_t index = (current_ >> (level * LEVEL_BITS)) & (SLOTS - 1);
+  Timer timers;
+  timers.previous_ = timers.next_ = &timers;
+  splice(&slots_[level][index], &timers);
+  while (timers.next_ != &timers) {
+    Timer* timer = timers.next_;
+    unlink(timer);
+    insert(timer);
+  }
+  return index;
+}
+
+void TimerWheel::splice(Timer* from, Timer* to) {
+  if (from->next_ == from) return;
+  to->next_ = from->next_;
+  to->previous_ = from->previous_;
+  to->next_->previous_ = to;
+  to->previous_->next_ = to;
+  from->previous_ = from->next_ = from;
+}
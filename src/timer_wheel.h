@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// A hierarchical timing wheel, for very large numbers of timers which are
+// mostly rescheduled or cancelled before they expire. Scheduling and
+// cancelling a timer are O(1), and each tick only visits the timers which are
+// due then, plus an amortised O(1) share of moving timers down from the
+// coarser levels.
+//
+// There are LEVELS wheels of SLOTS slots each. A timer which is due within
+// SLOTS ticks goes directly into a slot of the finest wheel. Timers due later
+// go into a coarser wheel, and are moved down a level each time the finer
+// wheel completes a revolution. Timers due beyond the coarsest wheel are
+// capped to the furthest time it can hold.
+class TimerWheel {
+ public:
+  // Called when a timer expires, with the current time. Returns the time at
+  // which the timer should next expire, or 0 to leave it unscheduled. This is
+  // called with the wheel locked, so it must not block or use the wheel.
+  typedef std::function<int64_t(int64_t now)> Callback;
+
+  class Timer {
+   public:
+    Timer(Callback callback = Callback()) : callback_(std::move(callback)) {}
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    // Must not be called while the timer is scheduled.
+    void setCallback(Callback callback) { callback_ = std::move(callback); }
+
+   private:
+    friend class TimerWheel;
+
+    Callback callback_;
+    Timer* previous_ = nullptr;
+    Timer* next_ = nullptr;  // Null if the timer is not scheduled.
+    uint64_t expiry_ = 0;    // In ticks.
+  };
+
+  // Times are in milliseconds, from the same clock as now.
+  TimerWheel(int64_t tick_ms, int64_t now);
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Schedule a timer to expire at the given time, replacing any previous
+  // schedule. Expiry is rounded up to a whole tick.
+  void schedule(Timer* timer, int64_t time);
+
+  // Unschedule a timer. Once this returns, the timer's callback is not
+  // running, and will not run until the timer is scheduled again.
+  void cancel(Timer* timer);
+
+  // Run every timer which has expired by now.
+  void advance(int64_t now);
+
+ private:
+  static const int LEVEL_BITS = 6;
+  static const uint64_t SLOTS = uint64_t{1} << LEVEL_BITS;
+  static const int LEVELS = 4;
+
+  void insert(Timer* timer);
+  void unlink(Timer* timer);
+
+  // Move every timer from the list from onto the empty list to.
+  static void splice(Timer* from, Timer* to);
+
+  // Move every timer in the given slot into a finer wheel. Returns the slot.
+  uint64_t cascade(int level);
+
+  std::mutex mutex_;
+  const int64_t tick_ms_;
+  uint64_t current_;  // The next tick to process.
+
+  // Each slot is a circular list with a sentinel node.
+  Timer slots_[LEVELS][SLOTS];
+};
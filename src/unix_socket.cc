@@ -0,0 +1,141 @@
+#include "unix_socket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+static runtime_error systemError(const string& message) {
+  return runtime_error(message + ": " + strerror(errno));
+}
+
+static sockaddr_un address(const string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.length() >= sizeof(address.sun_path))
+    throw runtime_error("Unix socket path is too long: " + path);
+  strcpy(address.sun_path, path.c_str());
+  return address;
+}
+
+int listenUnix(const string& path, int type, mode_t mode) {
+  sockaddr_un listen_address = address(path);
+  int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw systemError("Failed to create Unix socket");
+  unlink(path.c_str());
+
+  // The file is created by bind() with the socket's own permissions, less the
+  // umask. The umask is shared by every thread, so it is not changed: instead
+  // the permissions are set again once the file exists, before it is usable.
+  if (fchmod(fd, mode) < 0 ||
+      bind(fd, reinterpret_cast<sockaddr*>(&listen_address),
+           sizeof(listen_address)) < 0 ||
+      chmod(path.c_str(), mode) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    throw systemError("Failed to listen on " + path);
+  }
+  return fd;
+}
+
+int connectUnix(const string& path, int type) {
+  sockaddr_un connect_address = address(path);
+  int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw systemError("Failed to create Unix socket");
+  if (connect(fd, reinterpret_cast<sockaddr*>(&connect_address),
+              sizeof(connect_address)) < 0) {
+    close(fd);
+    throw systemError("Failed to connect to " + path);
+  }
+  return fd;
+}
+
+int acceptUnix(int listener) {
+  while (true) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd >= 0) return fd;
+    if (errno != EINTR && errno != ECONNABORTED)
+      throw systemError("Failed to accept Unix socket connection");
+  }
+}
+
+void sendDescriptors(int socket, const string& data,
+                     const vector<int>& descriptors) {
+  if (data.empty()) throw runtime_error("Cannot send descriptors alone.");
+  if (descriptors.size() > MAX_DESCRIPTORS)
+    throw runtime_error("Too many descriptors in one message.");
+
+  iovec io = {const_cast<char*>(data.data()), data.length()};
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &io;
+  message.msg_iovlen = 1;
+
+  size_t payload_size = descriptors.size() * sizeof(int);
+  vector<char> control(CMSG_SPACE(payload_size));
+  if (!descriptors.empty()) {
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(payload_size);
+    memcpy(CMSG_DATA(header), descriptors.data(), payload_size);
+  }
+
+  // The descriptors are attached to the first byte, so only the remainder of
+  // the data may need to be resent after a short write.
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0) throw systemError("Failed to send descriptors");
+  size_t offset = sent;
+  while (offset < data.length()) {
+    sent = send(socket, data.data() + offset, data.length() - offset,
+                MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0) throw systemError("Failed to send descriptors");
+    offset += sent;
+  }
+}
+
+string receiveDescriptors(int socket, vector<int>* descriptors) {
+  char buffer[MAX_MESSAGE_SIZE];
+  iovec io = {buffer, sizeof(buffer)};
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &io;
+  message.msg_iovlen = 1;
+  vector<char> control(CMSG_SPACE(MAX_DESCRIPTORS * sizeof(int)));
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+
+  ssize_t received;
+  do {
+    received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received < 0) throw systemError("Failed to receive descriptors");
+
+  for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int* received_descriptors =
+        reinterpret_cast<const int*>(CMSG_DATA(header));
+    descriptors->insert(descriptors->end(), received_descriptors,
+                        received_descriptors + count);
+  }
+  if (message.msg_flags & MSG_CTRUNC)
+    throw runtime_error("Received descriptors were truncated.");
+  if (message.msg_flags & MSG_TRUNC)
+    throw runtime_error("Received message was truncated.");
+  return string(buffer, received);
+}
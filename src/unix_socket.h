@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <vector>
+
+// Helpers for Unix domain stream sockets, which StreamSocket does not cover.
+// All of these throw std::runtime_error on failure.
+
+// Create a listening socket at the given path, replacing any stale socket. The
+// socket file is created with the given permissions, regardless of the umask.
+int listenUnix(const std::string& path, int type = SOCK_STREAM,
+               mode_t mode = 0600);
+
+// Connect to the listening socket at the given path.
+int connectUnix(const std::string& path, int type = SOCK_STREAM);
+
+// Accept a connection on a listening socket.
+int acceptUnix(int listener);
+
+// The maximum number of descriptors which can be sent in one message.
+const size_t MAX_DESCRIPTORS = 253;
+
+// The largest message which receiveDescriptors() can receive whole, for
+// sockets which preserve message boundaries.
+const size_t MAX_MESSAGE_SIZE = 65536;
+
+// Send some data, along with copies of the given descriptors. The data must be
+// non-empty, since the descriptors are attached to it.
+void sendDescriptors(int socket, const std::string& data,
+                     const std::vector<int>& descriptors);
+
+// Receive a message sent by sendDescriptors(). Received descriptors are
+// appended to *descriptors. Returns the data, which is empty at end of stream.
+// For stream sockets, this may return less or more than one message's data.
+std::string receiveDescriptors(int socket, std::vector<int>* descriptors);
@@ -0,0 +1,165 @@
+#include "uring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <linux/io_uring.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+static runtime_error systemError(const string& message) {
+  return runtime_error(message + ": " + strerror(errno));
+}
+
+static unsigned* field(void* ring, uint32_t offset) {
+  return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+}
+
+Uring::Uring(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) throw systemError("io_uring_setup failed");
+  entries_ = params.sq_entries;
+
+  // Check that sends are supported by this kernel.
+  const unsigned num_ops = IORING_OP_LAST;
+  vector<char> probe_data(
+      sizeof(io_uring_probe) + num_ops * sizeof(io_uring_probe_op), 0);
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_data.data());
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+              num_ops) < 0 ||
+      probe->last_op < IORING_OP_SEND ||
+      !(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED)) {
+    close(fd_);
+    throw runtime_error("io_uring does not support IORING_OP_SEND.");
+  }
+
+  // Map the rings.
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    close(fd_);
+    throw systemError("Failed to map io_uring submission queue");
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+      close(fd_);
+      throw systemError("Failed to map io_uring completion queue");
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    munmap(sq_ring_, sq_ring_size_);
+    close(fd_);
+    throw systemError("Failed to map io_uring submission entries");
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_tail_ = field(sq_ring_, params.sq_off.tail);
+  sq_mask_ = field(sq_ring_, params.sq_off.ring_mask);
+  sq_array_ = field(sq_ring_, params.sq_off.array);
+  cq_head_ = field(cq_ring_, params.cq_off.head);
+  cq_tail_ = field(cq_ring_, params.cq_off.tail);
+  cq_mask_ = field(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(
+      static_cast<char*>(cq_ring_) + params.cq_off.cqes);
+}
+
+Uring::~Uring() {
+  munmap(sqes_, sqes_size_);
+  if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+  munmap(sq_ring_, sq_ring_size_);
+  close(fd_);
+}
+
+int Uring::trySendAll(vector<Send>* sends) {
+  deque<uint64_t> queued;
+  for (uint64_t i = 0; i < sends->size(); i++) {
+    (*sends)[i].sent = 0;
+    (*sends)[i].error = 0;
+    if ((*sends)[i].length > 0) queued.push_back(i);
+  }
+
+  int syscalls = 0;
+  unsigned in_flight = 0, unsubmitted = 0;
+  while (!queued.empty() || in_flight > 0) {
+    // Fill the submission queue.
+    while (!queued.empty() && in_flight < entries_) {
+      push((*sends)[queued.front()], queued.front());
+      queued.pop_front();
+      in_flight++;
+      unsubmitted++;
+    }
+
+    // Submit everything and wait for all of it to complete.
+    int submitted = enter(unsubmitted, in_flight);
+    syscalls++;
+    if (submitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      throw systemError("io_uring_enter failed");
+    }
+    unsubmitted -= submitted;
+
+    // Reap the completions. A short send or EAGAIN means that the socket is
+    // full, so only interrupted sends are resubmitted.
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+      Send& send = (*sends)[cqe.user_data];
+      in_flight--;
+      if (cqe.res == -EINTR) {
+        queued.push_back(cqe.user_data);
+      } else if (cqe.res >= 0) {
+        send.sent = cqe.res;
+      } else if (cqe.res != -EAGAIN) {
+        send.error = -cqe.res;
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  return syscalls;
+}
+
+void Uring::push(const Send& send, uint64_t index) {
+  unsigned tail = *sq_tail_;
+  unsigned slot = tail & *sq_mask_;
+  io_uring_sqe& sqe = sqes_[slot];
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_SEND;
+  sqe.fd = send.fd;
+  sqe.addr = reinterpret_cast<uint64_t>(send.data);
+  sqe.len = send.length;
+  sqe.msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+  sqe.user_data = index;
+  sq_array_[slot] = slot;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+int Uring::enter(unsigned to_submit, unsigned min_complete) {
+  return syscall(__NR_io_uring_enter, fd_, to_submit, min_complete,
+                 IORING_ENTER_GETEVENTS, nullptr, 0);
+}
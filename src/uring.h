@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// A minimal io_uring instance for sending many buffers with few system calls.
+// This talks to the kernel directly rather than depending on liburing. It is
+// not thread-safe: callers must serialize access to each instance.
+class Uring {
+ public:
+  struct Send {
+    int fd;
+    const char* data;
+    size_t length;
+    size_t sent;  // Set to the number of bytes sent.
+    int error;  // Set to 0 on success or an errno value on failure.
+  };
+
+  // Throws if io_uring is unavailable or does not support sends.
+  Uring(unsigned entries);
+  ~Uring();
+
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+
+  // Send as much of every buffer as its socket accepts without blocking, so
+  // a full socket gets a short send rather than holding up the others.
+  // Returns the number of system calls made.
+  int trySendAll(std::vector<Send>* sends);
+
+ private:
+  void push(const Send& send, uint64_t index);
+  int enter(unsigned to_submit, unsigned min_complete);
+
+  int fd_ = -1;
+  unsigned entries_ = 0;
+
+  // Submission queue.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  // Completion queue. This may share its mapping with the submission queue.
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+};
@@ -0,0 +1,89 @@
+// Measures the throughput of network::readVarUint(). This encodes a buffer of
+// random varuints with a mix of lengths, then decodes it repeatedly, both with
+// readVarUint() and with a plain byte-at-a-time loop for comparison.
+
+#include "network.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <scrump/args.h>
+#include <scrump/logging.h>
+#include <string>
+
+using namespace scrump;
+using namespace std;
+
+USAGE("Usage: varint_benchmark [--values <n>] [--max_bytes <n>]");
+
+OPTION(int, values, 1 << 20, "Number of varuints in the buffer.");
+OPTION(int, max_bytes, 5,
+       "Longest varuint to generate, in bytes. Lengths from 1 up to this are "
+       "equally likely.");
+OPTION(int, rounds, 100, "Number of times to decode the buffer.");
+
+// The straightforward decoder, for comparison.
+static bool readVarUintByBytes(const char** position, const char* end,
+                               uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *position < end; shift += 7) {
+    unsigned char byte = *(*position)++;
+    *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+typedef bool (*Decoder)(const char** position, const char* end,
+                        uint64_t* value);
+
+static void run(const char* name, Decoder decode, const string& buffer,
+                uint64_t expected_sum) {
+  auto start = chrono::steady_clock::now();
+  uint64_t sum = 0;
+  for (int round = 0; round < options::rounds; round++) {
+    const char* position = buffer.data();
+    const char* end = position + buffer.size();
+    uint64_t value;
+    while (position < end) {
+      if (!decode(&position, end, &value))
+        throw runtime_error(string(name) + " failed to decode the buffer.");
+      sum += value;
+    }
+  }
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (sum != expected_sum * options::rounds)
+    throw runtime_error(string(name) + " decoded the wrong values.");
+
+  double values = static_cast<double>(options::values) * options::rounds;
+  double bytes = static_cast<double>(buffer.size()) * options::rounds;
+  cout << setw(8) << name << ": " << fixed << setprecision(1) << setw(8)
+       << values / seconds / 1e6 << " M values/s, " << setw(8)
+       << bytes / seconds / (1 << 20) << " MiB/s\n";
+}
+
+int scrump_main(int argc, char* args[]) {
+  if (options::max_bytes < 1 || options::max_bytes > 10)
+    throw runtime_error("--max_bytes must be from 1 to 10.");
+
+  mt19937_64 random(1);
+  uniform_int_distribution<int> length(1, options::max_bytes);
+  string buffer;
+  uint64_t sum = 0;
+  for (int i = 0; i < options::values; i++) {
+    // A value which takes exactly the chosen number of bytes.
+    int bits = min(7 * length(random), 64);
+    uint64_t value = random() >> (64 - bits);
+    value |= uint64_t{1} << (bits - 1);
+    network::appendVarUint(&buffer, value);
+    sum += value;
+  }
+  cout << options::values << " varuints, " << buffer.size() << " bytes\n";
+
+  run("bytes", readVarUintByBytes, buffer, sum);
+  run("network", network::readVarUint, buffer, sum);
+  return 0;
+}
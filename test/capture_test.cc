@@ -0,0 +1,83 @@
+#include "capture.h"
+#include "test.h"
+
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+int main() {
+  char path[] = "/tmp/capture_test.XXXXXX";
+  int temporary = mkstemp(path);
+  CHECK(temporary >= 0);
+  close(temporary);
+  CHECK(unlink(path) == 0);
+
+  // Frames of any content, and one larger than the reader reads at once.
+  vector<string> frames = {"", string("a\0b\nc", 5), string(3 << 20, 'x')};
+  {
+    CaptureWriter writer(path);
+    CHECK(writer.open(Connection::JSON) == 1);
+    CHECK(writer.open(Connection::BINARY) == 2);
+    for (const string& frame : frames)
+      writer.frame(2, frame.data(), frame.size());
+    writer.close(1);
+  }
+  struct stat status;
+  CHECK(stat(path, &status) == 0);
+  CHECK((status.st_mode & 0777) == 0600);
+  {
+    CaptureReader reader(path);
+    CaptureRecord record;
+    int64_t time = 0;
+    auto next = [&] {
+      CHECK(reader.next(&record));
+      CHECK(record.time >= time);
+      time = record.time;
+    };
+    next();
+    CHECK(record.kind == CAPTURE_OPEN && record.connection == 1);
+    CHECK(record.mode == Connection::JSON);
+    next();
+    CHECK(record.kind == CAPTURE_OPEN && record.connection == 2);
+    CHECK(record.mode == Connection::BINARY);
+    for (const string& frame : frames) {
+      next();
+      CHECK(record.kind == CAPTURE_FRAME && record.connection == 2);
+      CHECK(record.frame == frame);
+    }
+    next();
+    CHECK(record.kind == CAPTURE_CLOSE && record.connection == 1);
+    CHECK(!reader.next(&record));
+  }
+
+  // Opening the file by name replaces it. A second writer then carries on
+  // from the first, as after a hot restart, sharing its file offset as a
+  // descriptor passed between processes does.
+  {
+    CaptureWriter first(path);
+    CHECK(first.open(Connection::JSON) == 1);
+    first.frame(1, "first", 5);
+    first.flush();
+    CaptureWriter second(dup(first.fd()), first.lastConnection(),
+                         first.lastTime());
+    second.frame(1, "second", 6);
+    CHECK(second.open(Connection::BINARY) == 2);
+  }
+  {
+    CaptureReader reader(path);
+    CaptureRecord record;
+    CHECK(reader.next(&record) && record.kind == CAPTURE_OPEN);
+    CHECK(reader.next(&record) && record.frame == "first");
+    int64_t time = record.time;
+    CHECK(reader.next(&record) && record.frame == "second");
+    CHECK(record.connection == 1 && record.time >= time);
+    CHECK(reader.next(&record) && record.kind == CAPTURE_OPEN);
+    CHECK(record.connection == 2 && record.mode == Connection::BINARY);
+    CHECK(!reader.next(&record));
+  }
+  unlink(path);
+}
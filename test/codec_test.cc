@@ -0,0 +1,137 @@
+#include "network.h"
+#include "test.h"
+
+#include <scrump/json.h>
+#include <string>
+
+using namespace std;
+
+static ChatMessage makeMessage(uint64_t id, ChatMessage::Category category,
+                               string sender_name, string text) {
+  ChatMessage message;
+  message.message_id = id;
+  message.category = category;
+  message.sender_name = move(sender_name);
+  message.text = move(text);
+  return message;
+}
+
+// Messages have no operator==, so two are compared by their binary encoding,
+// which covers every field.
+template <typename T>
+static void checkRoundTrip(const T& message) {
+  string payload = network::serialize(message);
+  CHECK(payload.size() == network::encodedSize(message));
+
+  const char* position = payload.data();
+  const char* end = payload.data() + payload.size();
+  T binary;
+  CHECK(network::readBinary(&position, end, &binary));
+  CHECK(position == end);
+  CHECK(network::serialize(binary) == payload);
+
+  string text = scrump::JSON::stringify(network::encode(message));
+  T json;
+  network::decode(scrump::JSON::parse(text), &json);
+  CHECK(network::serialize(json) == payload);
+}
+
+// Every proper prefix of a payload must be rejected rather than read past.
+template <typename T>
+static void checkTruncation(const T& message) {
+  string payload = network::serialize(message);
+  for (size_t length = 0; length < payload.size(); length++) {
+    const char* position = payload.data();
+    T decoded;
+    CHECK(!network::readBinary(&position, payload.data() + length, &decoded));
+  }
+}
+
+int main() {
+  ChatMessage chat =
+      makeMessage(1234567, ChatMessage::CHAT_MESSAGE, "alice", "hello");
+  ChatMessage notice = makeMessage(0, ChatMessage::NOTICE, "", "bob left.");
+
+  Message<IDENTIFY> identify;
+  identify.display_name = "alice";
+  checkRoundTrip(identify);
+
+  Message<SEND_MESSAGE> send_message;
+  send_message.text = string(1000, 'x');
+  checkRoundTrip(send_message);
+
+  checkRoundTrip(chat);
+  checkRoundTrip(notice);
+  checkTruncation(chat);
+
+  Message<REQUEST_HISTORY> request_history;
+  request_history.start_id = 100;
+  request_history.num_messages = 50;
+  request_history.accepts_parts = 1;
+  checkRoundTrip(request_history);
+
+  Message<RECEIVE_HISTORY> receive_history;
+  receive_history.messages = {chat, notice, chat};
+  checkRoundTrip(receive_history);
+  checkRoundTrip(Message<RECEIVE_HISTORY>());
+
+  Message<RELAY_MESSAGE> relay;
+  relay.message = chat;
+  checkRoundTrip(relay);
+
+  Message<SEARCH_HISTORY> search_history;
+  search_history.query = "hello world";
+  search_history.sender = "alice";
+  search_history.start_id = 1;
+  search_history.end_id = UINT64_MAX;
+  search_history.num_messages = 10;
+  checkRoundTrip(search_history);
+  checkTruncation(search_history);
+
+  Message<SEARCH_RESULTS> search_results;
+  search_results.messages = {notice, chat};
+  search_results.next_id = 1ull << 63;
+  checkRoundTrip(search_results);
+  checkTruncation(search_results);
+
+  checkRoundTrip(Message<HEARTBEAT>());
+
+  Message<RECEIVE_HISTORY_PART> part;
+  part.messages = {chat};
+  checkRoundTrip(part);
+
+  // An optional field which is absent, as it is from older clients, decodes
+  // as zero from either encoding.
+  {
+    string payload;
+    network::appendVarUint(&payload, 100);
+    network::appendVarUint(&payload, 50);
+    const char* position = payload.data();
+    Message<REQUEST_HISTORY> decoded;
+    decoded.accepts_parts = 1;
+    CHECK(network::readBinary(&position, payload.data() + payload.size(),
+                              &decoded));
+    CHECK(decoded.start_id == 100 && decoded.num_messages == 50);
+    CHECK(decoded.accepts_parts == 0);
+
+    decoded.accepts_parts = 1;
+    network::decode(
+        scrump::JSON::parse("{\"start_id\": 100, \"num_messages\": 50}"),
+        &decoded);
+    CHECK(decoded.start_id == 100 && decoded.num_messages == 50);
+    CHECK(decoded.accepts_parts == 0);
+  }
+
+  // A category which is not in the schema is invalid.
+  {
+    string payload;
+    network::appendVarUint(&payload, 1);
+    network::appendVarUint(&payload, 2);
+    network::appendVarUint(&payload, 0);
+    network::appendVarUint(&payload, 0);
+    const char* position = payload.data();
+    ChatMessage decoded;
+    CHECK(!network::readBinary(&position, payload.data() + payload.size(),
+                               &decoded));
+  }
+}
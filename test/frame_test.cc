@@ -0,0 +1,114 @@
+#include "network.h"
+#include "test.h"
+
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A binary SEND_MESSAGE frame with the given payload length field, followed by
+// the payload itself.
+static string frame(uint64_t length, const string& payload) {
+  string data;
+  network::appendVarUint(&data, SEND_MESSAGE);
+  network::appendVarUint(&data, length);
+  return data + payload;
+}
+
+static string sendMessagePayload(const string& text) {
+  Message<SEND_MESSAGE> message;
+  message.text = text;
+  return network::serialize(message);
+}
+
+// Receive data on a connection of the given mode, as if it had arrived after
+// the header, then the end of the stream. Counts the messages handled, and
+// returns what the connection threw, or "" if it handled every message.
+static string receive(Connection::Mode mode, const string& data,
+                      size_t max_frame_size, int* num_handled) {
+  int sockets[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  StreamSocket peer(sockets[1]);
+  peer.send(data);
+  CHECK(shutdown(sockets[1], SHUT_WR) == 0);
+
+  Connection connection(mode, StreamSocket(sockets[0]), "");
+  connection.setMaxFrameSize(max_frame_size);
+  connection.on<SEND_MESSAGE>(
+      [num_handled](Message<SEND_MESSAGE>&&) { ++*num_handled; });
+  try {
+    while (true) connection.poll();
+  } catch (const exception& error) {
+    return error.what();
+  }
+}
+
+static bool contains(const string& text, const string& part) {
+  return text.find(part) != string::npos;
+}
+
+int main() {
+  string payload = sendMessagePayload(string(100, 'x'));
+  int num_handled;
+
+  // A frame of exactly the limit is accepted, and the stream then ends.
+  num_handled = 0;
+  CHECK(contains(receive(Connection::BINARY,
+                         frame(payload.size(), payload), payload.size(),
+                         &num_handled),
+                 "severed"));
+  CHECK(num_handled == 1);
+
+  // A frame over the limit is rejected from its header alone, without
+  // waiting for the payload.
+  num_handled = 0;
+  CHECK(contains(receive(Connection::BINARY, frame(payload.size(), ""),
+                         payload.size() - 1, &num_handled),
+                 "exceeds the limit"));
+  CHECK(num_handled == 0);
+  num_handled = 0;
+  CHECK(contains(receive(Connection::BINARY, frame(UINT64_MAX, ""),
+                         network::DEFAULT_MAX_FRAME_SIZE, &num_handled),
+                 "exceeds the limit"));
+  CHECK(num_handled == 0);
+
+  // A frame which ends part way through is never handled, wherever it ends.
+  string whole = frame(payload.size(), payload);
+  for (size_t length = 0; length < whole.size(); length++) {
+    num_handled = 0;
+    CHECK(contains(receive(Connection::BINARY, whole.substr(0, length),
+                           network::DEFAULT_MAX_FRAME_SIZE, &num_handled),
+                   "severed"));
+    CHECK(num_handled == 0);
+  }
+
+  // A header which never ends is rejected.
+  num_handled = 0;
+  CHECK(contains(receive(Connection::BINARY, string(100, '\x80'),
+                         network::DEFAULT_MAX_FRAME_SIZE, &num_handled),
+                 "Bad frame header"));
+
+  // A payload which is shorter than its fields claim is malformed, even
+  // though the frame is complete.
+  num_handled = 0;
+  CHECK(contains(receive(Connection::BINARY,
+                         frame(10, payload.substr(0, 10)) + whole,
+                         network::DEFAULT_MAX_FRAME_SIZE, &num_handled),
+                 "Malformed"));
+  CHECK(num_handled == 0);
+
+  // JSON lines are limited in the same way.
+  string line =
+      JSONConnection::encode(Message<SEND_MESSAGE>{string(100, 'x')});
+  num_handled = 0;
+  CHECK(contains(receive(Connection::JSON, line, line.size(), &num_handled),
+                 "severed"));
+  CHECK(num_handled == 1);
+  num_handled = 0;
+  CHECK(contains(receive(Connection::JSON, line, line.size() / 2,
+                         &num_handled),
+                 "exceeds the limit"));
+  CHECK(num_handled == 0);
+}
@@ -0,0 +1,95 @@
+#include "handoff.h"
+#include "test.h"
+
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static ChatMessage makeMessage(uint64_t id, string text) {
+  ChatMessage message;
+  message.message_id = id;
+  message.category = ChatMessage::CHAT_MESSAGE;
+  message.sender_name = "alice";
+  message.text = move(text);
+  return message;
+}
+
+int main() {
+  int sockets[2];
+  CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == 0);
+  int pipe_fds[2];
+  CHECK(pipe(pipe_fds) == 0);
+
+  // Records which used to exceed a single packet: a history with a 1 MiB
+  // message amongst small ones, and a connection with a long name.
+  vector<ChatMessage> history;
+  for (uint64_t id = 0; id < 1000; id++)
+    history.push_back(makeMessage(id, "message " + to_string(id)));
+  history[500].text = string(1 << 20, 'x');
+  string long_name(100000, 'n');
+
+  thread writer_thread([&] {
+    HandoffWriter writer(sockets[0]);
+    writer.sendMessages(HANDOFF_HISTORY, history.data(),
+                        history.data() + history.size());
+    writer.start(HANDOFF_CONNECTIONS);
+    writer.addVarUint(0);
+    writer.addString(long_name);
+    writer.addDescriptor(pipe_fds[0]);
+    writer.send();
+    writer.start(HANDOFF_END);
+    writer.send();
+    close(sockets[0]);
+  });
+
+  vector<ChatMessage> received;
+  vector<int> descriptors;
+  uint64_t type;
+  do {
+    string data = receiveHandoffRecord(sockets[1], &descriptors);
+    CHECK(!data.empty());
+    HandoffReader record(data);
+    type = record.readVarUint();
+    if (type == HANDOFF_HISTORY) {
+      CHECK(descriptors.empty());
+      while (!record.done()) received.push_back(record.readMessage());
+    } else if (type == HANDOFF_CONNECTIONS) {
+      CHECK(record.readVarUint() == 0);
+      CHECK(record.readString() == long_name);
+      CHECK(record.done());
+      CHECK(descriptors.size() == 1);
+    } else {
+      CHECK(type == HANDOFF_END);
+    }
+  } while (type != HANDOFF_END);
+  CHECK(receiveHandoffRecord(sockets[1], &descriptors).empty());
+  writer_thread.join();
+
+  CHECK(received.size() == history.size());
+  for (size_t i = 0; i < history.size(); i++)
+    CHECK(received[i] == history[i]);
+
+  // The descriptor is a working copy of the pipe.
+  CHECK(write(pipe_fds[1], "x", 1) == 1);
+  char byte;
+  CHECK(read(descriptors[0], &byte, 1) == 1 && byte == 'x');
+
+  // A truncated message is rejected rather than misread.
+  string record;
+  network::appendVarUint(&record, HANDOFF_HISTORY);
+  network::appendVarUint(&record, 100);
+  record += "short";
+  HandoffReader truncated(record);
+  truncated.readVarUint();
+  bool threw = false;
+  try {
+    truncated.readMessage();
+  } catch (const exception&) {
+    threw = true;
+  }
+  CHECK(threw);
+  return 0;
+}
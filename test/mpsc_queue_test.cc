@@ -0,0 +1,86 @@
+#include "mpsc_queue.h"
+#include "test.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+int main() {
+  // Values come out in the order they went in, appended to the output.
+  {
+    MpscQueue<int> queue;
+    CHECK(queue.empty());
+    CHECK(queue.push(1));
+    CHECK(!queue.push(2));
+    CHECK(!queue.push(3));
+    CHECK(!queue.empty());
+    vector<int> values = {0};
+    queue.popAll(&values);
+    CHECK((values == vector<int>{0, 1, 2, 3}));
+    CHECK(queue.empty());
+    queue.popAll(&values);
+    CHECK(values.size() == 4);
+    CHECK(queue.push(4));
+  }
+
+  // Values left in the queue are destroyed with it, and move-only values are
+  // moved rather than copied.
+  {
+    shared_ptr<int> shared = make_shared<int>(0);
+    {
+      MpscQueue<unique_ptr<shared_ptr<int>>> queue;
+      for (int i = 0; i < 10; i++)
+        queue.push(unique_ptr<shared_ptr<int>>(new shared_ptr<int>(shared)));
+      vector<unique_ptr<shared_ptr<int>>> values;
+      queue.popAll(&values);
+      CHECK(values.size() == 10 && shared.use_count() == 11);
+      queue.push(move(values[0]));
+      values.clear();
+      CHECK(shared.use_count() == 2);
+    }
+    CHECK(shared.use_count() == 1);
+  }
+
+  // Many producers and one consumer: every value arrives once, and each
+  // producer's values arrive in the order it pushed them.
+  {
+    const int num_producers = 4;
+    const uint64_t num_values = 100000;
+    MpscQueue<pair<int, uint64_t>> queue;
+    atomic<int> num_empty_pushes{0};
+    vector<thread> producers;
+    for (int producer = 0; producer < num_producers; producer++) {
+      producers.emplace_back([&, producer] {
+        for (uint64_t i = 0; i < num_values; i++) {
+          if (queue.push({producer, i})) num_empty_pushes++;
+        }
+      });
+    }
+
+    vector<uint64_t> next(num_producers, 0);
+    uint64_t num_received = 0;
+    int num_pops = 0;
+    vector<pair<int, uint64_t>> values;
+    while (num_received < num_producers * num_values) {
+      values.clear();
+      queue.popAll(&values);
+      if (!values.empty()) num_pops++;
+      for (const auto& value : values) {
+        CHECK(value.second == next[value.first]);
+        next[value.first]++;
+      }
+      num_received += values.size();
+      this_thread::yield();
+    }
+    for (thread& producer : producers) producer.join();
+    CHECK(queue.empty());
+
+    // Each batch the consumer took was started by a push to an empty queue.
+    CHECK(num_empty_pushes == num_pops);
+  }
+}
@@ -0,0 +1,121 @@
+#include "network.h"
+#include "test.h"
+
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+static bool rejects(const RateLimit& limit) {
+  HandlerTable handlers;
+  handlers.on<SEND_MESSAGE>([](Connection&, Message<SEND_MESSAGE>&&) {});
+  try {
+    handlers.limit(SEND_MESSAGE, limit);
+  } catch (const invalid_argument&) {
+    return true;
+  }
+  return false;
+}
+
+// A connection which has received the given number of SEND_MESSAGE frames.
+struct Receiver {
+  Receiver(Connection::Mode mode, int num_frames) {
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    peer = StreamSocket(sockets[1]);
+    connection.reset(new Connection(mode, StreamSocket(sockets[0]), ""));
+    string frames;
+    for (int i = 0; i < num_frames; i++) {
+      frames += Connection::encode(
+          mode, Message<SEND_MESSAGE>{"message " + to_string(i)});
+    }
+    peer.send(frames);
+  }
+
+  StreamSocket peer;
+  unique_ptr<Connection> connection;
+};
+
+int main() {
+  // Limits whose buckets would overflow, or which make no sense.
+  CHECK(rejects({0, 1, RateLimit::DROP}));
+  CHECK(rejects({-1, 1, RateLimit::DROP}));
+  CHECK(rejects({NAN, 1, RateLimit::DROP}));
+  CHECK(rejects({INFINITY, 1, RateLimit::DROP}));
+  CHECK(rejects({2e6, 1, RateLimit::DROP}));
+  CHECK(rejects({1, 0.5, RateLimit::DROP}));
+  CHECK(rejects({1, NAN, RateLimit::DROP}));
+  CHECK(rejects({1, 1e300, RateLimit::DROP}));
+  CHECK(rejects({1e-300, 1, RateLimit::DROP}));
+  CHECK(!rejects({1e6, 1, RateLimit::DROP}));
+  CHECK(!rejects({1, 1e9, RateLimit::DROP}));
+
+  // Tables may not be changed once used, so each case has its own.
+  int num_handled = 0;
+  auto makeHandlers = [&num_handled](const RateLimit& limit) {
+    unique_ptr<HandlerTable> handlers(new HandlerTable);
+    handlers->on<SEND_MESSAGE>([&num_handled](Connection&,
+                                              Message<SEND_MESSAGE>&&) {
+      num_handled++;
+    });
+    handlers->limit(SEND_MESSAGE, limit);
+    return handlers;
+  };
+
+  // A burst is admitted at once, and the rest of it is dropped, for either
+  // mode.
+  unique_ptr<HandlerTable> handlers = makeHandlers({1, 5, RateLimit::DROP});
+  for (Connection::Mode mode : {Connection::BINARY, Connection::JSON}) {
+    num_handled = 0;
+    Receiver receiver(mode, 10);
+    receiver.connection->setHandlers(handlers.get());
+    for (int i = 0; i < 10; i++) receiver.connection->poll();
+    CHECK(num_handled == 5);
+  }
+  CHECK(handlers->numDropped(SEND_MESSAGE) == 10);
+
+  // Delayed messages are all handled, at the rate once the burst is used.
+  handlers = makeHandlers({100, 2, RateLimit::DELAY});
+  {
+    num_handled = 0;
+    Receiver receiver(Connection::BINARY, 7);
+    receiver.connection->setHandlers(handlers.get());
+    int64_t start = network::monotonicMicroseconds();
+    for (int i = 0; i < 7; i++) receiver.connection->poll();
+    CHECK(num_handled == 7);
+    CHECK(network::monotonicMicroseconds() - start >= 5 * 10000);
+    CHECK(handlers->numDelayed(SEND_MESSAGE) == 5);
+  }
+
+  // A delay is cut short by an interrupt, leaving the message to be polled
+  // again, and not yet counted as delayed.
+  handlers = makeHandlers({0.001, 1, RateLimit::DELAY});
+  for (Connection::Mode mode : {Connection::BINARY, Connection::JSON}) {
+    num_handled = 0;
+    int interrupt[2];
+    CHECK(pipe(interrupt) == 0);
+    Receiver receiver(mode, 2);
+    receiver.connection->setHandlers(handlers.get());
+    receiver.connection->setInterrupt(interrupt[0]);
+    receiver.connection->poll();
+    CHECK(num_handled == 1);
+    string buffered = receiver.connection->buffered();
+    CHECK(write(interrupt[1], "x", 1) == 1);
+    bool interrupted = false;
+    try {
+      receiver.connection->poll();
+    } catch (const interrupted_error&) {
+      interrupted = true;
+    }
+    CHECK(interrupted && num_handled == 1);
+    CHECK(receiver.connection->buffered() == buffered);
+    CHECK(!buffered.empty());
+    close(interrupt[0]);
+    close(interrupt[1]);
+  }
+  CHECK(handlers->numDelayed(SEND_MESSAGE) == 0);
+}
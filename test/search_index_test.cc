@@ -0,0 +1,132 @@
+#include "search_index.h"
+#include "test.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The IDs of matching messages, found by checking every one.
+static vector<uint64_t> searchAll(const vector<ChatMessage>& messages,
+                                  const string& query, const string& sender,
+                                  uint64_t start_id, uint64_t end_id) {
+  vector<uint64_t> results;
+  vector<string> query_terms = SearchIndex::terms(query);
+  if (query_terms.empty() && sender.empty()) return results;
+  for (const ChatMessage& message : messages) {
+    if (message.message_id < start_id) continue;
+    if (end_id != 0 && message.message_id >= end_id) continue;
+    if (!sender.empty() && (message.category != ChatMessage::CHAT_MESSAGE ||
+                            message.sender_name != sender)) {
+      continue;
+    }
+    vector<string> terms = SearchIndex::terms(message.text);
+    bool matched = true;
+    for (const string& term : query_terms)
+      matched = matched && binary_search(terms.begin(), terms.end(), term);
+    if (matched) results.push_back(message.message_id);
+  }
+  return results;
+}
+
+int main() {
+  CHECK((SearchIndex::terms("Hello, hello WORLD! x2 caf\xC3\xA9") ==
+         vector<string>{"caf\xC3\xA9", "hello", "world", "x2"}));
+  CHECK(SearchIndex::terms(" ,.!").empty());
+
+  // Posting lists agree with a plain sorted list, both when stepped through
+  // and when seeking, across many blocks.
+  mt19937_64 random(1);
+  {
+    PostingList list;
+    vector<uint64_t> ids;
+    uint64_t id = 0;
+    for (int i = 0; i < 10000; i++) {
+      id += 1 + random() % (i % 7 == 0 ? 100000 : 10);
+      ids.push_back(id);
+      list.add(id);
+      list.add(id);  // Duplicates are ignored.
+    }
+    CHECK(list.size() == ids.size());
+
+    PostingList::Iterator all(list);
+    for (uint64_t expected : ids) {
+      CHECK(!all.done() && all.value() == expected);
+      all.next();
+    }
+    CHECK(all.done());
+
+    for (int round = 0; round < 100; round++) {
+      PostingList::Iterator iterator(list);
+      uint64_t target = 0;
+      while (true) {
+        target += random() % (round % 2 ? 1000 : 1000000);
+        iterator.seek(target);
+        auto expected = lower_bound(ids.begin(), ids.end(), target);
+        if (expected == ids.end()) {
+          CHECK(iterator.done());
+          break;
+        }
+        CHECK(!iterator.done() && iterator.value() == *expected);
+      }
+    }
+  }
+
+  // Searches agree with checking every message, including when they are
+  // continued page by page.
+  const vector<string> words = {"apple", "banana", "cherry", "date",
+                                "elder", "fig",    "grape",  "honeydew"};
+  const vector<string> senders = {"alice", "bob", "carol"};
+  vector<ChatMessage> messages;
+  SearchIndex index;
+  uint64_t id = 0;
+  for (int i = 0; i < 5000; i++) {
+    ChatMessage message;
+    id += 1 + random() % 3;
+    message.message_id = id;
+    message.category = random() % 10 == 0 ? ChatMessage::NOTICE
+                                          : ChatMessage::CHAT_MESSAGE;
+    if (message.category == ChatMessage::CHAT_MESSAGE)
+      message.sender_name = senders[random() % senders.size()];
+    for (int j = random() % 6; j > 0; j--) {
+      // Lower words are much more common.
+      message.text += words[random() % (1 + random() % words.size())];
+      message.text += random() % 2 ? " " : ", ";
+    }
+    index.add(message);
+    messages.push_back(message);
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    string query;
+    for (int j = random() % 4; j > 0; j--)
+      query += (random() % 2 ? "" : "!") + words[random() % words.size()] + " ";
+    string sender = random() % 2 ? senders[random() % senders.size()] : "";
+    if (i % 100 == 0) sender = "nobody";
+    uint64_t start_id = random() % 2 ? 0 : random() % id;
+    uint64_t end_id = random() % 2 ? 0 : start_id + random() % id;
+    size_t max_results = 1 + random() % 300;
+
+    vector<uint64_t> expected =
+        searchAll(messages, query, sender, start_id, end_id);
+    vector<uint64_t> results;
+    uint64_t next_id = start_id;
+    do {
+      vector<uint64_t> page = index.search(query, sender, next_id, end_id,
+                                           max_results, &next_id);
+      CHECK(page.size() <= max_results);
+      CHECK(next_id == 0 || page.size() == max_results);
+      if (next_id != 0) CHECK(next_id == page.back() + 1);
+      results.insert(results.end(), page.begin(), page.end());
+    } while (next_id != 0);
+    CHECK(results == expected);
+  }
+
+  index.clear();
+  uint64_t next_id;
+  CHECK(index.search("apple", "", 0, 0, 10, &next_id).empty());
+  CHECK(next_id == 0);
+}
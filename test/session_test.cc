@@ -0,0 +1,175 @@
+#include "history_cache.h"
+#include "network.h"
+#include "session.h"
+#include "test.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+const uint64_t HISTORY_SIZE = 100000;
+const size_t PAGE_SIZE = 100;
+const size_t TAIL_SIZE = 50;
+
+static ChatMessage makeMessage(uint64_t id, const string& text) {
+  ChatMessage message;
+  message.message_id = id;
+  message.category = ChatMessage::CHAT_MESSAGE;
+  message.sender_name = "alice";
+  message.text = text;
+  return message;
+}
+
+// Plays the server's side of a session against a history of messages, and
+// records the requests that it receives.
+class FakeServer {
+ public:
+  FakeServer(StreamSocket socket, const map<uint64_t, ChatMessage>& history)
+      : connection_(Connection::BINARY, move(socket), ""),
+        history_(history) {
+    connection_.on<REQUEST_HISTORY>(
+        [this](Message<REQUEST_HISTORY>&& request) {
+      requests.push_back(request);
+      reply(request);
+    });
+  }
+
+  // Handle the next request, which must already have been sent.
+  void poll() { connection_.poll(); }
+
+  // Returns true if the session has sent anything which is not yet handled.
+  bool pending() {
+    pollfd entry = {connection_.fd(), POLLIN, 0};
+    return ::poll(&entry, 1, 0) == 1;
+  }
+
+  vector<Message<REQUEST_HISTORY>> requests;
+
+ private:
+  // Replies as the real server does, with everything in a single piece.
+  void reply(const Message<REQUEST_HISTORY>& request) {
+    Message<RECEIVE_HISTORY> history;
+    auto begin = history_.lower_bound(request.start_id);
+    auto i = begin;
+    if (request.newest) {
+      i = history_.end();
+      for (uint64_t n = 0; n < request.num_messages && i != begin; n++) i--;
+    }
+    for (; i != history_.end() &&
+           history.messages.size() < request.num_messages;
+         i++) {
+      history.messages.push_back(i->second);
+    }
+    connection_.send(history);
+  }
+
+  Connection connection_;
+  const map<uint64_t, ChatMessage>& history_;
+};
+
+// Runs a session until its history requests are answered, and returns the
+// requests made. Every message displayed is appended to displayed.
+static vector<Message<REQUEST_HISTORY>> run(
+    HistoryCache* cache, const map<uint64_t, ChatMessage>& history,
+    vector<ChatMessage>* displayed, vector<string>* errors) {
+  int sockets[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+  FakeServer server(StreamSocket(sockets[1]), history);
+  Connection client(Connection::BINARY, StreamSocket(sockets[0]), "");
+  Session session(
+      &client, cache, PAGE_SIZE, TAIL_SIZE,
+      [displayed](const ChatMessage& message) {
+        displayed->push_back(message);
+      },
+      [errors](const string& text) { errors->push_back(text); });
+
+  session.start();
+  while (server.pending()) {
+    server.poll();
+    client.poll();
+  }
+  return server.requests;
+}
+
+int main() {
+  char path[] = "/tmp/session_test.XXXXXX";
+  int temporary = mkstemp(path);
+  CHECK(temporary >= 0);
+  close(temporary);
+  CHECK(unlink(path) == 0);
+
+  map<uint64_t, ChatMessage> history;
+  for (uint64_t id = 0; id < HISTORY_SIZE; id++)
+    history.emplace(id, makeMessage(id, "message " + to_string(id)));
+
+  // With nothing cached, only the newest messages are requested, in one
+  // request, however long the history is.
+  {
+    HistoryCache cache(path, 1000);
+    vector<ChatMessage> displayed;
+    vector<string> errors;
+    vector<Message<REQUEST_HISTORY>> requests =
+        run(&cache, history, &displayed, &errors);
+    CHECK(requests.size() == 1);
+    CHECK(requests[0].newest == 1);
+    CHECK(requests[0].num_messages == TAIL_SIZE);
+    CHECK(errors.empty());
+    CHECK(displayed.size() == TAIL_SIZE);
+    CHECK(displayed.front().message_id == HISTORY_SIZE - TAIL_SIZE);
+    CHECK(displayed.back().message_id == HISTORY_SIZE - 1);
+    CHECK(cache.recent(HISTORY_SIZE).size() == TAIL_SIZE);
+  }
+
+  // Once the cache is verified, the gap after it is filled in pages.
+  const uint64_t GAP = 3 * PAGE_SIZE + 10;
+  for (uint64_t id = HISTORY_SIZE; id < HISTORY_SIZE + GAP; id++)
+    history.emplace(id, makeMessage(id, "message " + to_string(id)));
+  {
+    HistoryCache cache(path, 1000);
+    vector<ChatMessage> displayed;
+    vector<string> errors;
+    vector<Message<REQUEST_HISTORY>> requests =
+        run(&cache, history, &displayed, &errors);
+    CHECK(requests.size() == 4);
+    CHECK(requests[0].start_id == HISTORY_SIZE - 1);
+    for (const Message<REQUEST_HISTORY>& request : requests) {
+      CHECK(request.newest == 0);
+      CHECK(request.num_messages == PAGE_SIZE);
+    }
+    CHECK(errors.empty());
+    CHECK(displayed.size() == GAP);
+    CHECK(displayed.front().message_id == HISTORY_SIZE);
+    CHECK(displayed.back().message_id == HISTORY_SIZE + GAP - 1);
+  }
+
+  // If the server's history no longer matches the cache, the cache is dropped
+  // and again only the newest messages are fetched.
+  map<uint64_t, ChatMessage> replaced;
+  for (uint64_t id = 0; id < HISTORY_SIZE; id++)
+    replaced.emplace(id, makeMessage(id, "replaced " + to_string(id)));
+  {
+    HistoryCache cache(path, 1000);
+    vector<ChatMessage> displayed;
+    vector<string> errors;
+    vector<Message<REQUEST_HISTORY>> requests =
+        run(&cache, replaced, &displayed, &errors);
+    CHECK(requests.size() == 2);
+    CHECK(requests[0].newest == 0);
+    CHECK(requests[1].newest == 1);
+    CHECK(requests[1].num_messages == TAIL_SIZE);
+    CHECK(errors.size() == 1);
+    CHECK(displayed.size() == TAIL_SIZE);
+    CHECK(displayed.front().text ==
+          "replaced " + to_string(HISTORY_SIZE - TAIL_SIZE));
+    CHECK(cache.recent(HISTORY_SIZE).size() == TAIL_SIZE);
+  }
+
+  unlink(path);
+}
@@ -0,0 +1,144 @@
+#include "shm_ring.h"
+#include "test.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// A frame which can be checked for tearing: its number, then a length which
+// varies with the number, filled with the number's low byte.
+static string makeFrame(uint64_t number) {
+  string frame(sizeof(number), '\0');
+  memcpy(&frame[0], &number, sizeof(number));
+  frame.append(number * 37 % 300, static_cast<char>(number));
+  return frame;
+}
+
+static uint64_t checkFrame(const string& frame) {
+  uint64_t number;
+  CHECK(frame.size() >= sizeof(number));
+  memcpy(&number, frame.data(), sizeof(number));
+  CHECK(frame.size() == sizeof(number) + number * 37 % 300);
+  for (size_t i = sizeof(number); i < frame.size(); i++)
+    CHECK(frame[i] == static_cast<char>(number));
+  return number;
+}
+
+static ShmRingReader* attachReader(const ShmRingWriter& writer) {
+  vector<int> descriptors = writer.readerDescriptors();
+  return new ShmRingReader(dup(descriptors[0]), dup(descriptors[1]));
+}
+
+int main() {
+  // Frames come out as they went in, across many wraps of the ring.
+  {
+    ShmRingWriter writer(4096);
+    unique_ptr<ShmRingReader> reader(attachReader(writer));
+    string frame;
+    for (uint64_t number = 0; number < 10000; number++) {
+      CHECK(writer.publish(makeFrame(number).data(),
+                           makeFrame(number).size()));
+      reader->next(&frame);
+      CHECK(checkFrame(frame) == number);
+    }
+    CHECK(reader->overruns() == 0);
+
+    // Frames larger than a quarter of the ring are refused.
+    string large(1024, 'x');
+    CHECK(!writer.publish(large.data(), large.size()));
+  }
+
+  // Readers cannot map the ring for writing.
+  {
+    ShmRingWriter writer(4096);
+    int fd = writer.readerDescriptors()[0];
+    void* memory =
+        mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    CHECK(memory == MAP_FAILED && errno == EACCES);
+  }
+
+  // A reader which falls more than half of the ring behind skips ahead to
+  // the newest frame. Frames are published until it has one, since it waits
+  // for the next frame after skipping.
+  {
+    ShmRingWriter writer(4096);
+    unique_ptr<ShmRingReader> reader(attachReader(writer));
+    uint64_t number = 0;
+    for (; number < 100; number++) {
+      string published = makeFrame(number);
+      CHECK(writer.publish(published.data(), published.size()));
+    }
+    string frame;
+    atomic<bool> done{false};
+    thread reader_thread([&] {
+      reader->next(&frame);
+      done = true;
+    });
+    while (!done) {
+      string published = makeFrame(number++);
+      CHECK(writer.publish(published.data(), published.size()));
+      this_thread::yield();
+    }
+    reader_thread.join();
+    CHECK(reader->overruns() == 1);
+    CHECK(checkFrame(frame) >= 100);
+  }
+
+  // A writer which takes over from another carries on the same ring.
+  {
+    unique_ptr<ShmRingWriter> writer(new ShmRingWriter(4096));
+    unique_ptr<ShmRingReader> reader(attachReader(*writer));
+    string frame;
+    CHECK(writer->publish(makeFrame(1).data(), makeFrame(1).size()));
+    vector<int> descriptors = writer->descriptors();
+    unique_ptr<ShmRingWriter> next(
+        ShmRingWriter::attach(dup(descriptors[0]), dup(descriptors[1])));
+    writer.reset();
+    CHECK(next->publish(makeFrame(2).data(), makeFrame(2).size()));
+    reader->next(&frame);
+    CHECK(checkFrame(frame) == 1);
+    reader->next(&frame);
+    CHECK(checkFrame(frame) == 2);
+  }
+
+  // A reader racing the writer on a small ring may be overtaken, but never
+  // returns a torn frame or goes backwards.
+  {
+    ShmRingWriter writer(4096);
+    unique_ptr<ShmRingReader> reader(attachReader(writer));
+    const uint64_t num_frames = 200000;
+    atomic<bool> done{false};
+    thread reader_thread([&] {
+      string frame;
+      uint64_t last = 0;
+      bool first = true;
+      while (true) {
+        reader->next(&frame);
+        uint64_t number = checkFrame(frame);
+        CHECK(first || number > last);
+        first = false;
+        last = number;
+        if (number >= num_frames) break;
+      }
+      done = true;
+    });
+    uint64_t number = 0;
+    while (!done) {
+      // Once every frame is out, keep publishing so that a reader which was
+      // overtaken at the end still sees a final one.
+      if (number > num_frames) this_thread::yield();
+      string frame = makeFrame(number++);
+      CHECK(writer.publish(frame.data(), frame.size()));
+    }
+    reader_thread.join();
+  }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+// Each test is a standalone program, built and run by "make test". It exits
+// with a non-zero status at the first check which fails.
+#define CHECK(condition)                                                  \
+  do {                                                                    \
+    if (!(condition)) {                                                   \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition   \
+                << ") failed.\n";                                         \
+      std::exit(1);                                                       \
+    }                                                                     \
+  } while (false)
@@ -0,0 +1,99 @@
+#include "test.h"
+#include "timer_wheel.h"
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+const int64_t TICK_MS = 10;
+
+int main() {
+  mt19937_64 random(1);
+
+  // Timers at every scale up to the coarsest wheel each fire on the first
+  // tick which reaches their time, and cancelled ones never fire.
+  {
+    const int64_t start = 123456789;
+    TimerWheel wheel(TICK_MS, start);
+    const int num_timers = 20000;
+    vector<unique_ptr<TimerWheel::Timer>> timers;
+    vector<int64_t> due(num_timers), fired(num_timers, 0);
+    vector<bool> cancelled(num_timers);
+    int64_t last_due = 0;
+    for (int i = 0; i < num_timers; i++) {
+      timers.emplace_back(new TimerWheel::Timer([&fired, i](int64_t now) {
+        CHECK(fired[i] == 0);
+        fired[i] = now;
+        return 0;
+      }));
+      // Delays of up to 2^25 ms, about 3.4 million ticks, spread across
+      // every level of the wheel.
+      int64_t delay = random() % (int64_t{1} << (random() % 26));
+      due[i] = start + delay;
+      last_due = max(last_due, due[i]);
+      wheel.schedule(timers[i].get(), due[i]);
+      cancelled[i] = random() % 10 == 0;
+    }
+    for (int i = 0; i < num_timers; i++) {
+      if (cancelled[i]) wheel.cancel(timers[i].get());
+    }
+    // Rescheduling replaces the previous time.
+    for (int i = 0; i < num_timers; i += 7) {
+      if (cancelled[i]) continue;
+      due[i] = start + random() % (int64_t{1} << 20);
+      wheel.schedule(timers[i].get(), due[i]);
+    }
+
+    for (int64_t now = start; now <= last_due + TICK_MS; now += TICK_MS)
+      wheel.advance(now);
+    for (int i = 0; i < num_timers; i++) {
+      if (cancelled[i]) {
+        CHECK(fired[i] == 0);
+      } else {
+        // Expiry is rounded up to a whole tick, and the timer fires on the
+        // first advance() which reaches that tick.
+        int64_t tick = (due[i] + TICK_MS - 1) / TICK_MS;
+        CHECK(fired[i] == start + max<int64_t>(tick - start / TICK_MS, 0) *
+                                      TICK_MS);
+      }
+    }
+  }
+
+  // Advancing many ticks at once runs every timer due in between, in order
+  // of expiry, and a callback can reschedule its own timer.
+  {
+    TimerWheel wheel(TICK_MS, 0);
+    vector<int64_t> fired;
+    TimerWheel::Timer periodic([&fired](int64_t now) {
+      fired.push_back(now);
+      return fired.size() < 100 ? fired.size() * 1000 : 0;
+    });
+    wheel.schedule(&periodic, 0);
+    wheel.advance(50000);
+    CHECK(fired.size() == 51);
+    wheel.advance(200000);
+    CHECK(fired.size() == 100);
+    wheel.advance(300000);
+    CHECK(fired.size() == 100);
+  }
+
+  // Timers beyond the coarsest wheel are capped to the furthest time it can
+  // hold, rather than lost.
+  {
+    TimerWheel wheel(TICK_MS, 0);
+    int64_t fired = 0;
+    TimerWheel::Timer timer([&fired](int64_t now) {
+      fired = now;
+      return 0;
+    });
+    const int64_t range = int64_t{1} << 24;  // Ticks in the coarsest wheel.
+    wheel.schedule(&timer, 100 * range * TICK_MS);
+    for (int64_t tick = 0; tick < range && fired == 0; tick += 1000)
+      wheel.advance(tick * TICK_MS);
+    wheel.advance(range * TICK_MS);
+    CHECK(fired != 0 && fired <= range * TICK_MS);
+  }
+}
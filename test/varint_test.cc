@@ -0,0 +1,90 @@
+#include "network.h"
+#include "test.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// The straightforward decoder, which network::readVarUint() must match
+// whether or not it takes its 8-byte fast path.
+static bool readVarUintByBytes(const char** position, const char* end,
+                               uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *position < end; shift += 7) {
+    unsigned char byte = *(*position)++;
+    *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// Decode [data, data + length) with both decoders and check that they agree.
+static void checkAgrees(const char* data, size_t length) {
+  const char* position = data;
+  const char* expected_position = data;
+  uint64_t value, expected_value;
+  bool ok = network::readVarUint(&position, data + length, &value);
+  bool expected_ok =
+      readVarUintByBytes(&expected_position, data + length, &expected_value);
+  CHECK(ok == expected_ok);
+  if (ok) {
+    CHECK(value == expected_value);
+    CHECK(position == expected_position);
+  }
+}
+
+int main() {
+  // Values either side of each change in length, including those either side
+  // of the 8-byte fast path's limit of 56 bits.
+  const uint64_t boundaries[] = {
+      0,
+      127,
+      128,
+      (uint64_t{1} << 14) - 1,
+      uint64_t{1} << 14,
+      (uint64_t{1} << 49) - 1,
+      uint64_t{1} << 49,
+      (uint64_t{1} << 56) - 1,
+      uint64_t{1} << 56,
+      (uint64_t{1} << 63) - 1,
+      uint64_t{1} << 63,
+      UINT64_MAX,
+  };
+  for (uint64_t boundary : boundaries) {
+    // Followed by nothing, which leaves the fast path to short values, and by
+    // enough data that every value up to 8 bytes takes it.
+    for (size_t padding = 0; padding <= 8; padding++) {
+      string data;
+      network::appendVarUint(&data, boundary);
+      size_t size = data.size();
+      CHECK(size == network::varUintSize(boundary));
+      data.append(padding, '\xFF');
+
+      const char* position = data.data();
+      uint64_t value;
+      CHECK(network::readVarUint(&position, data.data() + data.size(),
+                                 &value));
+      CHECK(value == boundary);
+      CHECK(position == data.data() + size);
+      for (size_t length = 0; length <= data.size(); length++)
+        checkAgrees(data.data(), length);
+    }
+  }
+
+  // Random bytes, with continuation bits of varying density so that every
+  // length of varuint is common, including malformed ones which never stop.
+  mt19937_64 random(1);
+  for (int i = 0; i < 1000000; i++) {
+    char data[16];
+    double density = (i % 10) / 9.0;
+    bernoulli_distribution more(density);
+    for (char& byte : data) {
+      byte = static_cast<char>(random() & 0x7F);
+      if (more(random)) byte |= 0x80;
+    }
+    size_t length = random() % (sizeof(data) + 1);
+    checkAgrees(data, length);
+  }
+}